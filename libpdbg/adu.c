@@ -17,10 +17,15 @@
 #include <stdint.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "operations.h"
 #include "bitutils.h"
 
+#undef PR_DEBUG
+#define PR_DEBUG(...)
+
 /* P8 ADU SCOM Register Definitions */
 #define P8_ALTD_CONTROL_REG	0x0
 #define P8_ALTD_CMD_REG		0x1
@@ -51,10 +56,6 @@
 #define P9_FBC_ALTD_TSIZE		PPC_BITMASK(32, 39)
 #define P9_FBC_ALTD_ADDRESS		PPC_BITMASK(8, 63)
 
-#define DROP_PRIORITY_LOW	0ULL
-#define DROP_PRIORITY_MEDIUM	1ULL
-#define DROP_PRIORITY_HIGH	2ULL
-
 #define SCOPE_NODAL		0
 #define SCOPE_GROUP		1
 #define SCOPE_SYSTEM		2
@@ -75,69 +76,495 @@
 #define P8_TTYPE_PBOPERATION 		0b111111
 
 /* P8/P9_ALTD_STATUS_REG fields */
+#define FBC_ALTD_BUSY		PPC_BIT(0)
 #define FBC_ALTD_ADDR_DONE	PPC_BIT(2)
 #define FBC_ALTD_DATA_DONE	PPC_BIT(3)
+#define FBC_ALTD_ADDRESS_ERROR	PPC_BIT(8)
 #define FBC_ALTD_PBINIT_MISSING PPC_BIT(18)
 
-int adu_getmem(struct target *adu_target, uint64_t start_addr, uint8_t *output, uint64_t size)
+/* In auto-increment mode the ADU only increments the address within
+ * an aligned block. Accesses crossing it need the address
+ * reprogrammed so we never ask for a block that spans one. */
+#define ADU_AUTOINC_BOUNDARY	0x800
+#define ADU_BLOCK_WORDS		(ADU_AUTOINC_BOUNDARY / 8)
+
+/* Returned by the access functions when nothing on the PowerBus took
+ * the address at the scope used, the one failure a wider scope fixes */
+#define ADU_ERR_SCOPE		-2
+
+/* Longest we wait before retrying after the fabric reports
+ * PBINIT_MISSING, in microseconds */
+#define ADU_MAX_BACKOFF		10000
+
+/* Memory accesses are rate limited by a token bucket shared between
+ * all ADUs so the total load on the fabric stays bounded no matter
+ * how many ADUs are in use. The bucket holds at most BURST_NS worth of
+ * bytes at the configured rate. */
+#define ADU_BUCKET_BURST_NS	10000000ULL
+#define NSEC_PER_SEC		1000000000ULL
+
+static struct {
+	pthread_mutex_t lock;
+	uint64_t rate;
+	int64_t tokens;
+	struct timespec last;
+} adu_bucket = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Limit memory accesses through all ADUs to rate bytes per second, or
+ * remove the limit if rate is 0. Bounding the rate keeps the bucket
+ * arithmetic below within 64 bits. */
+int adu_set_rate(uint64_t rate)
+{
+	if (rate > ADU_MAX_RATE) {
+		PR_ERROR("Rate limit of %" PRIu64 " bytes/s is too high\n", rate);
+		return -1;
+	}
+
+	pthread_mutex_lock(&adu_bucket.lock);
+	adu_bucket.rate = rate;
+	adu_bucket.tokens = 0;
+	clock_gettime(CLOCK_MONOTONIC, &adu_bucket.last);
+	pthread_mutex_unlock(&adu_bucket.lock);
+
+	return 0;
+}
+
+static void adu_sleep_ns(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / NSEC_PER_SEC;
+	ts.tv_nsec = ns % NSEC_PER_SEC;
+	while (nanosleep(&ts, &ts));
+}
+
+/* a * b / c without overflowing as long as (c - 1) * b fits */
+static uint64_t adu_mul_div(uint64_t a, uint64_t b, uint64_t c)
+{
+	return (a / c) * b + (a % c) * b / c;
+}
+
+/* Wait until we are allowed to move another size bytes. Tokens may go
+ * negative which makes later callers wait for the debt to be repaid,
+ * so concurrent readers share the rate fairly. */
+static void adu_throttle(uint64_t size)
+{
+	struct timespec now;
+	uint64_t elapsed, wait = 0;
+	int64_t burst;
+
+	pthread_mutex_lock(&adu_bucket.lock);
+	if (!adu_bucket.rate) {
+		pthread_mutex_unlock(&adu_bucket.lock);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - adu_bucket.last.tv_sec) * NSEC_PER_SEC
+		+ now.tv_nsec - adu_bucket.last.tv_nsec;
+	if (elapsed > NSEC_PER_SEC)
+		elapsed = NSEC_PER_SEC;
+	adu_bucket.last = now;
+
+	/* elapsed is at most a second and rate at most ADU_MAX_RATE so
+	 * neither product can overflow */
+	burst = adu_mul_div(adu_bucket.rate, ADU_BUCKET_BURST_NS, NSEC_PER_SEC);
+	adu_bucket.tokens += adu_mul_div(elapsed, adu_bucket.rate, NSEC_PER_SEC);
+	if (adu_bucket.tokens > burst)
+		adu_bucket.tokens = burst;
+
+	adu_bucket.tokens -= size;
+	if (adu_bucket.tokens < 0)
+		wait = adu_mul_div(-adu_bucket.tokens, NSEC_PER_SEC, adu_bucket.rate);
+	pthread_mutex_unlock(&adu_bucket.lock);
+
+	if (wait)
+		adu_sleep_ns(wait);
+}
+
+static bool adu_throttled(void)
+{
+	bool throttled;
+
+	pthread_mutex_lock(&adu_bucket.lock);
+	throttled = adu_bucket.rate != 0;
+	pthread_mutex_unlock(&adu_bucket.lock);
+
+	return throttled;
+}
+
+/* The fabric asked us to retry. Back off exponentially so we don't add
+ * to whatever is keeping it busy. */
+static void adu_backoff(int *backoff)
+{
+	*backoff = *backoff ? *backoff * 2 : 10;
+	if (*backoff > ADU_MAX_BACKOFF)
+		*backoff = ADU_MAX_BACKOFF;
+
+	adu_sleep_ns(*backoff * 1000ULL);
+}
+
+/* Set the PowerBus drop priority used for accesses through this ADU */
+int adu_set_priority(struct target *adu_target, int priority)
 {
 	struct adu *adu;
-	int rc = 0;
-	uint64_t addr;
 
 	assert(!strcmp(adu_target->class, "adu"));
 	adu = target_to_adu(adu_target);
 
-	/* We read data in 8-byte aligned chunks */
-	for (addr = 8*(start_addr / 8); addr < start_addr + size; addr += 8) {
-		uint64_t data;
+	if (priority < 0 || priority > DROP_PRIORITY_HIGH)
+		return -1;
+
+	adu->priority = priority;
+
+	return 0;
+}
+
+/* Copy the part of the big-endian word read from addr that falls
+ * inside [start_addr, start_addr + size) to the output buffer */
+static void adu_copy_word(uint64_t addr, uint64_t data, uint64_t start_addr,
+			  uint8_t *output, uint64_t size)
+{
+	uint64_t first, last;
+
+	/* ADU returns data in big-endian form in the register */
+	data = __builtin_bswap64(data);
+
+	first = addr < start_addr ? start_addr : addr;
+	last = addr + 8 > start_addr + size ? start_addr + size : addr + 8;
+	memcpy(output + (first - start_addr), ((uint8_t *) &data) + (first - addr), last - first);
+}
+
+/* Returns true if [addr, addr + size) lies entirely within the memory
+ * attached to the chip owning this ADU. The ranges come from the
+ * memory-ranges property (64-bit base and size pairs) on the ADU or
+ * one of its parents, either given in the device tree or filled in by
+ * the backend when probed. */
+bool adu_owns(struct target *adu_target, uint64_t addr, uint64_t size)
+{
+	const struct dt_property *p = NULL;
+	struct dt_node *dn;
+	uint64_t base, len;
+	int i;
+
+	for (dn = adu_target->dn; dn && !p; dn = dn->parent)
+		p = dt_find_property(dn, "memory-ranges");
+
+	if (!p)
+		return false;
+
+	for (i = 0; i + 4 <= p->len / 4; i += 4) {
+		base = ((uint64_t) dt_property_get_cell(p, i) << 32) | dt_property_get_cell(p, i + 1);
+		len = ((uint64_t) dt_property_get_cell(p, i + 2) << 32) | dt_property_get_cell(p, i + 3);
+		if (addr >= base && addr - base <= len && size <= len - (addr - base))
+			return true;
+	}
+
+	return false;
+}
+
+/* Local memory can be reached without broadcasting beyond the chip so
+ * start with the narrowest scope and only widen it if that fails */
+static void adu_set_scope(struct adu *adu, uint64_t addr, uint64_t size)
+{
+	adu->scope = adu_owns(&adu->target, addr, size) ? SCOPE_NODAL : adu->max_scope;
+}
+
+/* Move to the next wider scope after an access failed with rc. The new
+ * scope is used for the rest of the access. Returns false if the
+ * failure wasn't one a wider scope fixes or there is nothing left to
+ * try. */
+static bool adu_widen_scope(struct adu *adu, int rc)
+{
+	if (rc != ADU_ERR_SCOPE)
+		return false;
+
+	if (adu->scope >= adu->max_scope) {
+		if (!adu->quiet)
+			PR_ERROR("No PowerBus scope reaches the memory address\n");
+		return false;
+	}
+
+	adu->scope = adu->scope == SCOPE_NODAL ? SCOPE_GROUP : adu->max_scope;
+	PR_DEBUG("Retrying ADU access with scope %d\n", adu->scope);
+
+	return true;
+}
+
+static int adu_read_words(struct adu *adu, uint64_t addr, uint64_t *data, int count)
+{
+	int i, rc;
+
+	if (count > 1 && adu->getmem_block &&
+	    !adu->getmem_block(adu, addr, data, count))
+		return 0;
+
+	/* Fall back to reading a word at a time, which also tells us
+	 * why it failed */
+	for (i = 0; i < count; i++) {
+		rc = adu->getmem(adu, addr + 8*i, &data[i]);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int adu_read(struct adu *adu, uint64_t start_addr, uint8_t *output, uint64_t size)
+{
+	uint64_t addr, end_addr, data[ADU_BLOCK_WORDS];
+	int i, count, rc;
 
-		if (adu->getmem(adu, addr, &data))
+	/* Throttled reads go a block at a time so the rate holds
+	 * throughout */
+	if (adu->read && !adu_throttled())
+		return adu->read(adu, start_addr, output, size);
+
+	adu_set_scope(adu, start_addr, size);
+
+	/* We read data in 8-byte aligned chunks, a block at a time so
+	 * we never cross an auto-increment boundary */
+	end_addr = start_addr + size;
+	for (addr = 8*(start_addr / 8); addr < end_addr; addr += 8*count) {
+		count = (ADU_AUTOINC_BOUNDARY - (addr % ADU_AUTOINC_BOUNDARY)) / 8;
+		if (addr + 8*count > end_addr)
+			count = (end_addr - addr + 7) / 8;
+
+		adu_throttle(8*count);
+		do {
+			rc = adu_read_words(adu, addr, data, count);
+		} while (rc && adu_widen_scope(adu, rc));
+		if (rc)
 			return -1;
 
-		/* ADU returns data in big-endian form in the register */
-		data = __builtin_bswap64(data);
-
-		if (addr < start_addr) {
-			memcpy(output, ((uint8_t *) &data) + (start_addr - addr), 8 - (start_addr - addr));
-			output += 8 - (start_addr - addr);
-		} else if (addr + 8 > start_addr + size) {
-			memcpy(output, &data, start_addr + size - addr);
-		} else {
-			memcpy(output, &data, 8);
-			output += 8;
-		}
+		for (i = 0; i < count; i++)
+			adu_copy_word(addr + 8*i, data[i], start_addr, output, size);
 	}
 
+	return 0;
+}
+
+static int __adu_getmem(struct target *adu_target, uint64_t start_addr, uint8_t *output,
+			uint64_t size, bool quiet)
+{
+	struct adu *adu;
+	int rc;
+
+	assert(!strcmp(adu_target->class, "adu"));
+	adu = target_to_adu(adu_target);
+
+	pthread_mutex_lock(&adu->lock);
+	adu->quiet = quiet;
+	rc = adu_read(adu, start_addr, output, size);
+	adu->quiet = false;
+	pthread_mutex_unlock(&adu->lock);
+
 	return rc;
 }
 
+int adu_getmem(struct target *adu_target, uint64_t start_addr, uint8_t *output, uint64_t size)
+{
+	return __adu_getmem(adu_target, start_addr, output, size, false);
+}
+
+/* As adu_getmem() but for callers probing for memory which can be
+ * read, so failures are expected and not logged */
+int adu_probemem(struct target *adu_target, uint64_t start_addr, uint8_t *output, uint64_t size)
+{
+	return __adu_getmem(adu_target, start_addr, output, size, true);
+}
+
+/* Write up to the end of the containing word using the largest
+ * naturally aligned partial size (4, 2 or 1 bytes) that fits. Returns
+ * the number of bytes written or -1 on error. */
+static int adu_putmem_partial(struct adu *adu, uint64_t addr, uint8_t *input, uint64_t size)
+{
+	uint64_t data = 0;
+	int i, tsize, rc;
+
+	for (tsize = 4; tsize > 1; tsize >>= 1)
+		if (!(addr % tsize) && tsize <= size)
+			break;
+
+	/* Copy the input data in with correct alignment */
+	for (i = 0; i < tsize; i++)
+		data |= ((uint64_t) input[i]) << 8*(8 - (addr % 8) - i - 1);
+
+	rc = adu->putmem(adu, addr, data, tsize);
+	if (rc)
+		return rc < 0 ? rc : -1;
+
+	return tsize;
+}
+
+/* Write count words cycling through the first period words of data */
+static int adu_write_words(struct adu *adu, uint64_t addr, uint64_t *data, int count, int period)
+{
+	int i, rc;
+
+	if (count > 1 && adu->putmem_block &&
+	    !adu->putmem_block(adu, addr, data, count, period))
+		return 0;
+
+	/* Fall back to writing a word at a time */
+	for (i = 0; i < count; i++) {
+		rc = adu->putmem(adu, addr + 8*i, data[i % period], 8);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int adu_write(struct adu *adu, uint64_t start_addr, uint8_t *input, uint64_t size)
+{
+	uint64_t addr, end_addr, data[ADU_BLOCK_WORDS];
+	int i, count, tsize, rc;
+
+	adu_set_scope(adu, start_addr, size);
+
+	end_addr = start_addr + size;
+	for (addr = start_addr; addr < end_addr; addr += tsize, input += tsize) {
+		if ((addr % 8) || (addr + 8 > end_addr)) {
+			/* Unaligned head or tail */
+			adu_throttle(8);
+			do {
+				tsize = adu_putmem_partial(adu, addr, input, end_addr - addr);
+			} while (tsize < 0 && adu_widen_scope(adu, tsize));
+			if (tsize < 0)
+				return -1;
+			continue;
+		}
+
+		/* Write whole words a block at a time so we never cross
+		 * an auto-increment boundary */
+		count = (ADU_AUTOINC_BOUNDARY - (addr % ADU_AUTOINC_BOUNDARY)) / 8;
+		if (addr + 8*count > end_addr)
+			count = (end_addr - addr) / 8;
+		tsize = 8*count;
+
+		for (i = 0; i < count; i++) {
+			memcpy(&data[i], input + 8*i, sizeof(data[i]));
+			data[i] = __builtin_bswap64(data[i]);
+		}
+
+		adu_throttle(8*count);
+		do {
+			rc = adu_write_words(adu, addr, data, count, count);
+		} while (rc && adu_widen_scope(adu, rc));
+		if (rc)
+			return -1;
+	}
+
+	return 0;
+}
+
 int adu_putmem(struct target *adu_target, uint64_t start_addr, uint8_t *input, uint64_t size)
 {
 	struct adu *adu;
-	int rc = 0, tsize;
-	uint64_t addr, data, end_addr;
+	int rc;
 
 	assert(!strcmp(adu_target->class, "adu"));
 	adu = target_to_adu(adu_target);
+
+	pthread_mutex_lock(&adu->lock);
+	rc = adu_write(adu, start_addr, input, size);
+	pthread_mutex_unlock(&adu->lock);
+
+	return rc;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+	uint64_t t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+static int adu_fill_region(struct adu *adu, uint64_t start_addr, const uint8_t *pattern,
+			   uint64_t pattern_size, uint64_t size)
+{
+	uint64_t addr, end_addr, first, words[2*ADU_MAX_PATTERN];
+	uint8_t bytes[8];
+	int i, j, count, period, tsize, rc;
+
+	adu_set_scope(adu, start_addr, size);
+
+	/* The words written repeat every lcm(pattern_size, 8) bytes, at
+	 * most ADU_MAX_PATTERN words. They are stored twice over so any
+	 * rotation of them is contiguous. */
 	end_addr = start_addr + size;
-	for (addr = start_addr; addr < end_addr; addr += tsize, input += tsize) {
+	first = (start_addr + 7) & ~7ULL;
+	period = pattern_size / gcd(pattern_size, 8);
+	for (i = 0; i < 2*period; i++) {
+		for (j = 0; j < 8; j++)
+			bytes[j] = pattern[(first - start_addr + 8*i + j) % pattern_size];
+		memcpy(&words[i], bytes, sizeof(words[i]));
+		words[i] = __builtin_bswap64(words[i]);
+	}
+
+	for (addr = start_addr; addr < end_addr; addr += tsize) {
 		if ((addr % 8) || (addr + 8 > end_addr)) {
-			/* If the address is not 64-bit aligned we
-			 * copy in a byte at a time until it is. */
-			tsize = 1;
-
-			/* Copy the input data in with correct alignment */
-			data = ((uint64_t) *input) << 8*(8 - (addr % 8) - 1);
-		} else {
-			tsize = 8;
-			memcpy(&data, input, sizeof(data));
-			data = __builtin_bswap64(data);
+			/* Unaligned head or tail */
+			for (i = 0; i < 8; i++)
+				bytes[i] = pattern[(addr - start_addr + i) % pattern_size];
+
+			adu_throttle(8);
+			do {
+				tsize = adu_putmem_partial(adu, addr, bytes, end_addr - addr);
+			} while (tsize < 0 && adu_widen_scope(adu, tsize));
+			if (tsize < 0)
+				return -1;
+			continue;
 		}
 
-		adu->putmem(adu, addr, data, tsize);
+		count = (ADU_AUTOINC_BOUNDARY - (addr % ADU_AUTOINC_BOUNDARY)) / 8;
+		if (addr + 8*count > end_addr)
+			count = (end_addr - addr) / 8;
+		tsize = 8*count;
+
+		adu_throttle(8*count);
+		do {
+			rc = adu_write_words(adu, addr, &words[((addr - first) / 8) % period],
+					     count, period);
+		} while (rc && adu_widen_scope(adu, rc));
+		if (rc)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Fill [start_addr, start_addr + size) with copies of pattern starting
+ * at start_addr. Only the words making up one repeat of the pattern
+ * are held here, the auto-increment write cycles through them however
+ * large the region. */
+int adu_fill(struct target *adu_target, uint64_t start_addr, const uint8_t *pattern,
+	     uint64_t pattern_size, uint64_t size)
+{
+	struct adu *adu;
+	int rc;
+
+	assert(!strcmp(adu_target->class, "adu"));
+	adu = target_to_adu(adu_target);
+
+	if (!pattern_size || pattern_size > ADU_MAX_PATTERN) {
+		PR_ERROR("Fill pattern must be 1 to %d bytes long\n", ADU_MAX_PATTERN);
+		return -1;
 	}
 
+	pthread_mutex_lock(&adu->lock);
+	rc = adu_fill_region(adu, start_addr, pattern, pattern_size, size);
+	pthread_mutex_unlock(&adu->lock);
+
 	return rc;
 }
 
@@ -184,105 +611,218 @@ static int adu_reset(struct adu *adu)
 	return 0;
 }
 
+/* Run a single word access as one batch: clear the status, program
+ * the address (and data for writes), start the command, wait for it to
+ * finish and for reads fetch the result. The CONTROL and CMD registers
+ * are at the same addresses on P8 and P9. */
+static int adu_word_access(struct adu *adu, uint64_t status_reg, uint64_t data_reg,
+			   uint64_t ctrl_reg, uint64_t cmd_reg, uint64_t *data, bool write)
+{
+	struct pib_op ops[5];
+	int nr = 0, status, backoff = 0;
+	uint64_t val;
+
+	ops[nr++] = (struct pib_op) { .type = PIB_OP_RMW, .addr = P8_ALTD_CMD_REG,
+				      .mask = FBC_ALTD_CLEAR_STATUS | FBC_ALTD_RESET_AD_PCB,
+				      .data = FBC_ALTD_CLEAR_STATUS | FBC_ALTD_RESET_AD_PCB };
+	ops[nr++] = (struct pib_op) { .type = PIB_OP_WRITE, .addr = P8_ALTD_CONTROL_REG,
+				      .data = ctrl_reg };
+	if (write)
+		ops[nr++] = (struct pib_op) { .type = PIB_OP_WRITE, .addr = data_reg, .data = *data };
+	ops[nr++] = (struct pib_op) { .type = PIB_OP_WRITE, .addr = P8_ALTD_CMD_REG, .data = cmd_reg };
+
+	/* Wait for completion */
+	status = nr;
+	ops[nr++] = (struct pib_op) { .type = PIB_OP_POLL_NE, .addr = status_reg, .mask = -1ULL };
+	if (!write)
+		ops[nr++] = (struct pib_op) { .type = PIB_OP_READ, .addr = data_reg };
+
+retry:
+	CHECK_ERR(pib_batch(&adu->target, ops, nr));
+
+	val = ops[status].data;
+	if (!(val & FBC_ALTD_ADDR_DONE) ||
+	    !(val & FBC_ALTD_DATA_DONE)) {
+		/* PBINIT_MISSING is expected occasionally so just retry */
+		if (val & FBC_ALTD_PBINIT_MISSING) {
+			adu_backoff(&backoff);
+			goto retry;
+		}
+
+		/* Nothing took the address, which a wider scope may fix */
+		if (val & FBC_ALTD_ADDRESS_ERROR) {
+			PR_DEBUG("ADU address error at scope %d\n", adu->scope);
+			return ADU_ERR_SCOPE;
+		}
+
+		if (!adu->quiet)
+			PR_ERROR("Unable to %s memory. ALTD_STATUS_REG = 0x%016" PRIx64 "\n",
+				 write ? "write" : "read", val);
+		return -1;
+	}
+
+	if (!write)
+		*data = ops[nr - 1].data;
+
+	return 0;
+}
+
 static int p8_adu_getmem(struct adu *adu, uint64_t addr, uint64_t *data)
 {
-	uint64_t ctrl_reg, cmd_reg, val;
+	uint64_t ctrl_reg, cmd_reg;
+	int rc;
 
 	CHECK_ERR(adu_lock(adu));
 
 	ctrl_reg = P8_TTYPE_TREAD;
 	ctrl_reg = SETFIELD(P8_FBC_ALTD_TTYPE, ctrl_reg, P8_TTYPE_DMA_PARTIAL_READ);
 	ctrl_reg = SETFIELD(P8_FBC_ALTD_TSIZE, ctrl_reg, 8);
+	ctrl_reg = SETFIELD(P8_FBC_ALTD_ADDRESS, ctrl_reg, addr);
 
 	CHECK_ERR(pib_read(&adu->target, P8_ALTD_CMD_REG, &cmd_reg));
 	cmd_reg |= FBC_ALTD_START_OP;
-	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, SCOPE_SYSTEM);
-	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, DROP_PRIORITY_MEDIUM);
+	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, adu->scope);
+	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, adu->priority);
 
-retry:
-	/* Clear status bits */
-	CHECK_ERR(adu_reset(adu));
+	rc = adu_word_access(adu, P8_ALTD_STATUS_REG, P8_ALTD_DATA_REG,
+			     ctrl_reg, cmd_reg, data, false);
+	if (rc)
+		return rc;
 
-	/* Set the address */
+	adu_unlock(adu);
+
+	return 0;
+}
+
+/* Read count words starting at addr with a single ADU setup. The
+ * address auto-increments after each read of the data register so
+ * the caller must not cross ADU_AUTOINC_BOUNDARY. */
+static int p8_adu_getmem_block(struct adu *adu, uint64_t addr, uint64_t *data, int count)
+{
+	uint64_t ctrl_reg, cmd_reg, val;
+	int i, rc = 0;
+
+	CHECK_ERR(adu_lock(adu));
+
+	ctrl_reg = P8_TTYPE_TREAD;
+	ctrl_reg = SETFIELD(P8_FBC_ALTD_TTYPE, ctrl_reg, P8_TTYPE_DMA_PARTIAL_READ);
+	ctrl_reg = SETFIELD(P8_FBC_ALTD_TSIZE, ctrl_reg, 8);
 	ctrl_reg = SETFIELD(P8_FBC_ALTD_ADDRESS, ctrl_reg, addr);
-	CHECK_ERR(pib_write(&adu->target, P8_ALTD_CONTROL_REG, ctrl_reg));
 
-	/* Start the command */
+	CHECK_ERR(pib_read(&adu->target, P8_ALTD_CMD_REG, &cmd_reg));
+	cmd_reg |= FBC_ALTD_START_OP | FBC_ALTD_AUTO_INC;
+	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, adu->scope);
+	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, adu->priority);
+
+	CHECK_ERR(adu_reset(adu));
+	CHECK_ERR(pib_write(&adu->target, P8_ALTD_CONTROL_REG, ctrl_reg));
 	CHECK_ERR(pib_write(&adu->target, P8_ALTD_CMD_REG, cmd_reg));
 
-	/* Wait for completion */
-	do {
-		CHECK_ERR(pib_read(&adu->target, P8_ALTD_STATUS_REG, &val));
-	} while (!val);
+	for (i = 0; i < count; i++) {
+		do {
+			CHECK_ERR(pib_read(&adu->target, P8_ALTD_STATUS_REG, &val));
+		} while (!val || (val & FBC_ALTD_BUSY));
 
-	if( !(val & FBC_ALTD_ADDR_DONE) ||
-	    !(val & FBC_ALTD_DATA_DONE)) {
-		/* PBINIT_MISSING is expected occasionally so just retry */
-		if (val & FBC_ALTD_PBINIT_MISSING)
-			goto retry;
-		else {
-			PR_ERROR("Unable to read memory. "		\
-					 "ALTD_STATUS_REG = 0x%016" PRIx64 "\n", val);
-			return -1;
+		if (!(val & FBC_ALTD_ADDR_DONE) ||
+		    !(val & FBC_ALTD_DATA_DONE)) {
+			/* Let the caller retry a word at a time */
+			PR_DEBUG("Auto-increment read failed at 0x%016" PRIx64 ". "
+				 "ALTD_STATUS_REG = 0x%016" PRIx64 "\n", addr + 8*i, val);
+			rc = -1;
+			break;
 		}
-	}
 
-	/* Read data */
-	CHECK_ERR(pib_read(&adu->target, P8_ALTD_DATA_REG, data));
+		/* Stop the data read below from starting another access
+		 * past the end of the block */
+		if (i == count - 1)
+			CHECK_ERR(pib_write(&adu->target, P8_ALTD_CMD_REG,
+					    cmd_reg & ~(FBC_ALTD_START_OP | FBC_ALTD_AUTO_INC)));
+
+		CHECK_ERR(pib_read(&adu->target, P8_ALTD_DATA_REG, &data[i]));
+	}
 
+	if (rc)
+		adu_reset(adu);
 	adu_unlock(adu);
 
-	return 0;
+	return rc;
 }
 
 int p8_adu_putmem(struct adu *adu, uint64_t addr, uint64_t data, int size)
 {
-	int rc = 0;
-	uint64_t cmd_reg, ctrl_reg, val;
+	uint64_t cmd_reg, ctrl_reg;
+	int rc;
 
 	CHECK_ERR(adu_lock(adu));
 
 	ctrl_reg = P8_TTYPE_TWRITE;
 	ctrl_reg = SETFIELD(P8_FBC_ALTD_TTYPE, ctrl_reg, P8_TTYPE_DMA_PARTIAL_WRITE);
 	ctrl_reg = SETFIELD(P8_FBC_ALTD_TSIZE, ctrl_reg, size);
+	ctrl_reg = SETFIELD(P8_FBC_ALTD_ADDRESS, ctrl_reg, addr);
 
 	CHECK_ERR(pib_read(&adu->target, P8_ALTD_CMD_REG, &cmd_reg));
 	cmd_reg |= FBC_ALTD_START_OP;
-	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, SCOPE_SYSTEM);
-	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, DROP_PRIORITY_MEDIUM);
+	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, adu->scope);
+	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, adu->priority);
 
-	/* Clear status bits */
-	CHECK_ERR(adu_reset(adu));
+	rc = adu_word_access(adu, P8_ALTD_STATUS_REG, P8_ALTD_DATA_REG,
+			     ctrl_reg, cmd_reg, &data, true);
 
-	/* Set the address */
-	ctrl_reg = SETFIELD(P8_FBC_ALTD_ADDRESS, ctrl_reg, addr);
+	adu_unlock(adu);
 
-retry:
-	CHECK_ERR(pib_write(&adu->target, P8_ALTD_CONTROL_REG, ctrl_reg));
+	return rc;
+}
+
+/* Write count words starting at addr with a single ADU setup. Each
+ * write to the data register after the first starts the next access
+ * at the incremented address. */
+static int p8_adu_putmem_block(struct adu *adu, uint64_t addr, uint64_t *data, int count,
+			       int period)
+{
+	uint64_t ctrl_reg, cmd_reg, val;
+	int i, rc = 0;
+
+	CHECK_ERR(adu_lock(adu));
+
+	ctrl_reg = P8_TTYPE_TWRITE;
+	ctrl_reg = SETFIELD(P8_FBC_ALTD_TTYPE, ctrl_reg, P8_TTYPE_DMA_PARTIAL_WRITE);
+	ctrl_reg = SETFIELD(P8_FBC_ALTD_TSIZE, ctrl_reg, 8);
+	ctrl_reg = SETFIELD(P8_FBC_ALTD_ADDRESS, ctrl_reg, addr);
 
-	/* Write the data */
-	CHECK_ERR(pib_write(&adu->target, P8_ALTD_DATA_REG, data));
+	CHECK_ERR(pib_read(&adu->target, P8_ALTD_CMD_REG, &cmd_reg));
+	cmd_reg |= FBC_ALTD_START_OP | FBC_ALTD_AUTO_INC;
+	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, adu->scope);
+	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, adu->priority);
 
-	/* Start the command */
+	CHECK_ERR(adu_reset(adu));
+	CHECK_ERR(pib_write(&adu->target, P8_ALTD_CONTROL_REG, ctrl_reg));
+	CHECK_ERR(pib_write(&adu->target, P8_ALTD_DATA_REG, data[0]));
 	CHECK_ERR(pib_write(&adu->target, P8_ALTD_CMD_REG, cmd_reg));
 
-	/* Wait for completion */
-	do {
-		CHECK_ERR(pib_read(&adu->target, P8_ALTD_STATUS_REG, &val));
-	} while (!val);
+	for (i = 0; i < count; i++) {
+		do {
+			CHECK_ERR(pib_read(&adu->target, P8_ALTD_STATUS_REG, &val));
+		} while (!val || (val & FBC_ALTD_BUSY));
 
-	if( !(val & FBC_ALTD_ADDR_DONE) ||
-	    !(val & FBC_ALTD_DATA_DONE)) {
-		/* PBINIT_MISSING is expected occasionally so just retry */
-		if (val & FBC_ALTD_PBINIT_MISSING)
-			goto retry;
-		else {
-			PR_ERROR("Unable to write memory. "		\
-				 "P8_ALTD_STATUS_REG = 0x%016" PRIx64 "\n", val);
+		if (!(val & FBC_ALTD_ADDR_DONE) ||
+		    !(val & FBC_ALTD_DATA_DONE)) {
+			/* Let the caller retry a word at a time */
+			PR_DEBUG("Auto-increment write failed at 0x%016" PRIx64 ". "
+				 "P8_ALTD_STATUS_REG = 0x%016" PRIx64 "\n", addr + 8*i, val);
 			rc = -1;
+			break;
 		}
+
+		if (i < count - 1)
+			CHECK_ERR(pib_write(&adu->target, P8_ALTD_DATA_REG,
+					    data[(i + 1) % period]));
 	}
 
+	/* Leave auto-increment mode */
+	CHECK_ERR(pib_write(&adu->target, P8_ALTD_CMD_REG,
+			    cmd_reg & ~(FBC_ALTD_START_OP | FBC_ALTD_AUTO_INC)));
+	if (rc)
+		adu_reset(adu);
 	adu_unlock(adu);
 
 	return rc;
@@ -290,7 +830,7 @@ retry:
 
 static int p9_adu_getmem(struct adu *adu, uint64_t addr, uint64_t *data)
 {
-	uint64_t ctrl_reg, cmd_reg, val;
+	uint64_t ctrl_reg, cmd_reg;
 
 	cmd_reg = P9_TTYPE_TREAD;
 	cmd_reg = SETFIELD(P9_FBC_ALTD_TTYPE, cmd_reg, P9_TTYPE_DMA_PARTIAL_READ);
@@ -298,46 +838,68 @@ static int p9_adu_getmem(struct adu *adu, uint64_t addr, uint64_t *data)
 	/* For a read size is apparently always 0 */
 	cmd_reg = SETFIELD(P9_FBC_ALTD_TSIZE, cmd_reg, 0);
  	cmd_reg |= FBC_ALTD_START_OP;
-	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, SCOPE_REMOTE);
-	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, DROP_PRIORITY_LOW);
-
-retry:
-	/* Clear status bits */
-	CHECK_ERR(adu_reset(adu));
+	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, adu->scope);
+	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, adu->priority);
 
 	/* Set the address */
 	ctrl_reg = SETFIELD(P9_FBC_ALTD_ADDRESS, 0, addr);
-	CHECK_ERR(pib_write(&adu->target, P9_ALTD_CONTROL_REG, ctrl_reg));
 
-	/* Start the command */
+	return adu_word_access(adu, P9_ALTD_STATUS_REG, P9_ALTD_DATA_REG,
+			       ctrl_reg, cmd_reg, data, false);
+}
+
+/* Read count words starting at addr with a single ADU setup. The
+ * address auto-increments after each read of the data register so
+ * the caller must not cross ADU_AUTOINC_BOUNDARY. */
+static int p9_adu_getmem_block(struct adu *adu, uint64_t addr, uint64_t *data, int count)
+{
+	uint64_t ctrl_reg, cmd_reg, val;
+	int i, rc = 0;
+
+	cmd_reg = P9_TTYPE_TREAD;
+	cmd_reg = SETFIELD(P9_FBC_ALTD_TTYPE, cmd_reg, P9_TTYPE_DMA_PARTIAL_READ);
+	cmd_reg = SETFIELD(P9_FBC_ALTD_TSIZE, cmd_reg, 0);
+	cmd_reg |= FBC_ALTD_START_OP | FBC_ALTD_AUTO_INC;
+	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, adu->scope);
+	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, adu->priority);
+
+	CHECK_ERR(adu_reset(adu));
+	ctrl_reg = SETFIELD(P9_FBC_ALTD_ADDRESS, 0, addr);
+	CHECK_ERR(pib_write(&adu->target, P9_ALTD_CONTROL_REG, ctrl_reg));
 	CHECK_ERR(pib_write(&adu->target, P9_ALTD_CMD_REG, cmd_reg));
 
-	/* Wait for completion */
-	do {
-		CHECK_ERR(pib_read(&adu->target, P9_ALTD_STATUS_REG, &val));
-	} while (!val);
+	for (i = 0; i < count; i++) {
+		do {
+			CHECK_ERR(pib_read(&adu->target, P9_ALTD_STATUS_REG, &val));
+		} while (!val || (val & FBC_ALTD_BUSY));
 
-	if( !(val & FBC_ALTD_ADDR_DONE) ||
-	    !(val & FBC_ALTD_DATA_DONE)) {
-		/* PBINIT_MISSING is expected occasionally so just retry */
-		if (val & FBC_ALTD_PBINIT_MISSING)
-			goto retry;
-		else {
-			PR_ERROR("Unable to read memory. "		\
-					 "ALTD_STATUS_REG = 0x%016" PRIx64 "\n", val);
-			return -1;
+		if (!(val & FBC_ALTD_ADDR_DONE) ||
+		    !(val & FBC_ALTD_DATA_DONE)) {
+			/* Let the caller retry a word at a time */
+			PR_DEBUG("Auto-increment read failed at 0x%016" PRIx64 ". "
+				 "ALTD_STATUS_REG = 0x%016" PRIx64 "\n", addr + 8*i, val);
+			rc = -1;
+			break;
 		}
+
+		/* Stop the data read below from starting another access
+		 * past the end of the block */
+		if (i == count - 1)
+			CHECK_ERR(pib_write(&adu->target, P9_ALTD_CMD_REG,
+					    cmd_reg & ~(FBC_ALTD_START_OP | FBC_ALTD_AUTO_INC)));
+
+		CHECK_ERR(pib_read(&adu->target, P9_ALTD_DATA_REG, &data[i]));
 	}
 
-	/* Read data */
-	CHECK_ERR(pib_read(&adu->target, P9_ALTD_DATA_REG, data));
+	if (rc)
+		adu_reset(adu);
 
-	return 0;
+	return rc;
 }
 
 static int p9_adu_putmem(struct adu *adu, uint64_t addr, uint64_t data, int size)
 {
-	uint64_t ctrl_reg, cmd_reg, val;
+	uint64_t ctrl_reg, cmd_reg;
 
 	/* Format to tsize. This is the "secondary encode" and is
 	   shifted left on for writes. */
@@ -347,41 +909,64 @@ static int p9_adu_putmem(struct adu *adu, uint64_t addr, uint64_t data, int size
 	cmd_reg = SETFIELD(P9_FBC_ALTD_TTYPE, cmd_reg, P9_TTYPE_DMA_PARTIAL_WRITE);
 	cmd_reg = SETFIELD(P9_FBC_ALTD_TSIZE, cmd_reg, size);
  	cmd_reg |= FBC_ALTD_START_OP;
-	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, SCOPE_REMOTE);
-	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, DROP_PRIORITY_LOW);
-
-	/* Clear status bits */
-	CHECK_ERR(adu_reset(adu));
+	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, adu->scope);
+	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, adu->priority);
 
 	/* Set the address */
 	ctrl_reg = SETFIELD(P9_FBC_ALTD_ADDRESS, 0, addr);
-retry:
-	CHECK_ERR(pib_write(&adu->target, P9_ALTD_CONTROL_REG, ctrl_reg));
 
-	/* Write the data */
-	CHECK_ERR(pib_write(&adu->target, P9_ALTD_DATA_REG, data));
+	return adu_word_access(adu, P9_ALTD_STATUS_REG, P9_ALTD_DATA_REG,
+			       ctrl_reg, cmd_reg, &data, true);
+}
 
-	/* Start the command */
+/* Write count words starting at addr with a single ADU setup. Each
+ * write to the data register after the first starts the next access
+ * at the incremented address. */
+static int p9_adu_putmem_block(struct adu *adu, uint64_t addr, uint64_t *data, int count,
+			       int period)
+{
+	uint64_t ctrl_reg, cmd_reg, val;
+	int i, rc = 0;
+
+	cmd_reg = P9_TTYPE_TWRITE;
+	cmd_reg = SETFIELD(P9_FBC_ALTD_TTYPE, cmd_reg, P9_TTYPE_DMA_PARTIAL_WRITE);
+	cmd_reg = SETFIELD(P9_FBC_ALTD_TSIZE, cmd_reg, 8 << 1);
+	cmd_reg |= FBC_ALTD_START_OP | FBC_ALTD_AUTO_INC;
+	cmd_reg = SETFIELD(FBC_ALTD_SCOPE, cmd_reg, adu->scope);
+	cmd_reg = SETFIELD(FBC_ALTD_DROP_PRIORITY, cmd_reg, adu->priority);
+
+	CHECK_ERR(adu_reset(adu));
+	ctrl_reg = SETFIELD(P9_FBC_ALTD_ADDRESS, 0, addr);
+	CHECK_ERR(pib_write(&adu->target, P9_ALTD_CONTROL_REG, ctrl_reg));
+	CHECK_ERR(pib_write(&adu->target, P9_ALTD_DATA_REG, data[0]));
 	CHECK_ERR(pib_write(&adu->target, P9_ALTD_CMD_REG, cmd_reg));
 
-	/* Wait for completion */
-	do {
-		CHECK_ERR(pib_read(&adu->target, P9_ALTD_STATUS_REG, &val));
-	} while (!val);
+	for (i = 0; i < count; i++) {
+		do {
+			CHECK_ERR(pib_read(&adu->target, P9_ALTD_STATUS_REG, &val));
+		} while (!val || (val & FBC_ALTD_BUSY));
 
-	if( !(val & FBC_ALTD_ADDR_DONE) ||
-	    !(val & FBC_ALTD_DATA_DONE)) {
-		/* PBINIT_MISSING is expected occasionally so just retry */
-		if (val & FBC_ALTD_PBINIT_MISSING)
-			goto retry;
-		else {
-			PR_ERROR("Unable to read memory. "		\
-					 "ALTD_STATUS_REG = 0x%016" PRIx64 "\n", val);
-			return -1;
+		if (!(val & FBC_ALTD_ADDR_DONE) ||
+		    !(val & FBC_ALTD_DATA_DONE)) {
+			/* Let the caller retry a word at a time */
+			PR_DEBUG("Auto-increment write failed at 0x%016" PRIx64 ". "
+				 "ALTD_STATUS_REG = 0x%016" PRIx64 "\n", addr + 8*i, val);
+			rc = -1;
+			break;
 		}
+
+		if (i < count - 1)
+			CHECK_ERR(pib_write(&adu->target, P9_ALTD_DATA_REG,
+					    data[(i + 1) % period]));
 	}
 
-	return 0;
+	/* Leave auto-increment mode */
+	CHECK_ERR(pib_write(&adu->target, P9_ALTD_CMD_REG,
+			    cmd_reg & ~(FBC_ALTD_START_OP | FBC_ALTD_AUTO_INC)));
+	if (rc)
+		adu_reset(adu);
+
+	return rc;
 }
 
 struct adu p8_adu = {
@@ -391,7 +976,13 @@ struct adu p8_adu = {
 		.class = "adu",
 	},
 	.getmem = p8_adu_getmem,
+	.getmem_block = p8_adu_getmem_block,
 	.putmem = p8_adu_putmem,
+	.putmem_block = p8_adu_putmem_block,
+	.scope = SCOPE_SYSTEM,
+	.max_scope = SCOPE_SYSTEM,
+	.priority = DROP_PRIORITY_MEDIUM,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
 };
 DECLARE_HW_UNIT(p8_adu);
 
@@ -402,6 +993,12 @@ struct adu p9_adu = {
 		.class = "adu",
 	},
 	.getmem = p9_adu_getmem,
+	.getmem_block = p9_adu_getmem_block,
 	.putmem = p9_adu_putmem,
+	.putmem_block = p9_adu_putmem_block,
+	.scope = SCOPE_REMOTE,
+	.max_scope = SCOPE_REMOTE,
+	.priority = DROP_PRIORITY_LOW,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
 };
 DECLARE_HW_UNIT(p9_adu);
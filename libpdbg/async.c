@@ -0,0 +1,190 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <ccan/list/list.h>
+
+#include "target.h"
+#include "operations.h"
+#include "timing.h"
+
+/* Requests are queued per link (see target_link()). Everything below
+ * one link shares a bus (eg. all the chips behind one FSI master) so a
+ * link's requests run one at a time on its own worker thread while
+ * separate links run in parallel. A thread waiting for the next request
+ * on an idle link runs it itself rather than wait for the worker to
+ * wake up. */
+struct async_link {
+	struct target *root;
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct list_head reqs;
+	struct list_node link;
+
+	/* A request is running, on the worker or a waiting thread */
+	bool busy;
+};
+
+static LIST_HEAD(async_links);
+static pthread_mutex_t async_links_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The link the current thread is running a request for, if any */
+static __thread struct async_link *async_current;
+
+static void async_run(struct pib_req *req)
+{
+	/* The request can't start before it was submitted */
+	timing_sync(req->vtime);
+	if (req->run)
+		req->rc = req->run(req);
+	else
+		req->rc = __pib_batch(req->target, req->ops, req->count);
+	if (req->done)
+		req->done(req);
+	req->vtime = timing_now();
+}
+
+static void *async_worker(void *arg)
+{
+	struct async_link *link = arg;
+	struct pib_req *req;
+
+	async_current = link;
+	pthread_mutex_lock(&link->lock);
+	for (;;) {
+		while (link->busy || !(req = list_pop(&link->reqs, struct pib_req, link)))
+			pthread_cond_wait(&link->work, &link->lock);
+		link->busy = true;
+		pthread_mutex_unlock(&link->lock);
+
+		async_run(req);
+
+		pthread_mutex_lock(&link->lock);
+		link->busy = false;
+		req->complete = true;
+		pthread_cond_broadcast(&link->done);
+	}
+
+	return NULL;
+}
+
+/* Find the link a target is on, starting its worker the first time */
+static struct async_link *async_get_link(struct target *target)
+{
+	struct target *root = target_link(target);
+	struct async_link *link;
+
+	pthread_mutex_lock(&async_links_lock);
+	list_for_each(&async_links, link, link)
+		if (link->root == root)
+			goto out;
+
+	link = calloc(1, sizeof(*link));
+	assert(link);
+	link->root = root;
+	pthread_mutex_init(&link->lock, NULL);
+	pthread_cond_init(&link->work, NULL);
+	pthread_cond_init(&link->done, NULL);
+	list_head_init(&link->reqs);
+
+	/* Probes and other accesses to the link rely on the worker so
+	 * there is nothing sensible to fall back to */
+	if (pthread_create(&link->worker, NULL, async_worker, link)) {
+		PR_ERROR("Unable to start worker thread\n");
+		exit(1);
+	}
+	pthread_detach(link->worker);
+	list_add_tail(&async_links, &link->link);
+
+out:
+	pthread_mutex_unlock(&async_links_lock);
+
+	return link;
+}
+
+/* Queue a batch of operations on req->target's link and return without
+ * waiting for them. The done callback, if any, is called from the
+ * link's worker once they have run. The request must not be reused or
+ * freed until pib_wait() has returned. Requests made by the link's own
+ * worker, eg. a probe from a run callback, can't wait behind
+ * themselves so they run straight away. */
+int pib_submit(struct pib_req *req)
+{
+	struct async_link *link;
+
+	req->complete = false;
+	req->rc = -1;
+	req->vtime = timing_now();
+	link = async_get_link(req->target);
+	req->async_link = link;
+	if (link == async_current) {
+		async_run(req);
+		req->complete = true;
+		return 0;
+	}
+
+	pthread_mutex_lock(&link->lock);
+	list_add_tail(&link->reqs, &req->link);
+	pthread_cond_signal(&link->work);
+	pthread_mutex_unlock(&link->lock);
+
+	return 0;
+}
+
+/* Wait for a submitted request to finish, returning its result */
+int pib_wait(struct pib_req *req)
+{
+	struct async_link *link = req->async_link, *saved;
+
+	/* Never submitted, so queue it now like any other */
+	if (!link) {
+		pib_submit(req);
+		link = req->async_link;
+	}
+
+	/* Run it here if it is next and the link is idle */
+	pthread_mutex_lock(&link->lock);
+	if (!req->complete && !link->busy &&
+	    list_top(&link->reqs, struct pib_req, link) == req) {
+		list_del(&req->link);
+		link->busy = true;
+		pthread_mutex_unlock(&link->lock);
+
+		saved = async_current;
+		async_current = link;
+		async_run(req);
+		async_current = saved;
+
+		pthread_mutex_lock(&link->lock);
+		link->busy = false;
+		req->complete = true;
+		pthread_cond_broadcast(&link->done);
+		pthread_cond_signal(&link->work);
+	}
+
+	while (!req->complete)
+		pthread_cond_wait(&link->done, &link->lock);
+	pthread_mutex_unlock(&link->lock);
+	timing_sync(req->vtime);
+
+	return req->rc;
+}
@@ -25,4 +25,7 @@ struct scom_backend *fsi_init(void);
 /* i2c backend initialisation */
 struct scom_backend *i2c_init(char *bus, int addr);
 
+/* remote backend initialisation, server is a pdbg daemon address */
+void remote_init(const char *server);
+
 #endif
@@ -289,7 +289,7 @@ static int cfam_hmfsi_read(struct fsi *fsi, uint32_t addr, uint32_t *data)
 {
 	struct target *parent_fsi = fsi->target.dn->parent->target;
 
-	addr += dt_get_address(fsi->target.dn, 0, NULL);
+	addr += fsi->target.address;
 
 	return fsi_read(parent_fsi, addr, data);
 }
@@ -298,7 +298,7 @@ static int cfam_hmfsi_write(struct fsi *fsi, uint32_t addr, uint32_t data)
 {
 	struct target *parent_fsi = fsi->target.dn->parent->target;
 
-	addr += dt_get_address(fsi->target.dn, 0, NULL);
+	addr += fsi->target.address;
 
 	return fsi_write(parent_fsi, addr, data);
 }
@@ -0,0 +1,394 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "compress.h"
+
+/* The LZ codec encodes a block as a series of sequences, each a token
+ * byte holding the literal count in the top nibble and the match
+ * length less LZ_MIN_MATCH in the bottom nibble. Counts of 15 are
+ * continued in following bytes, each added on until one is less than
+ * 255. The literals come next followed by a little-endian 16-bit
+ * offset back to the match. The final sequence has only literals. */
+#define LZ_MIN_MATCH	4
+#define LZ_MAX_OFFSET	0xffff
+#define LZ_HASH_BITS	12
+
+static inline uint32_t lz_hash(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_len(uint8_t *op, uint8_t *oend, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+
+	if (op >= oend)
+		return NULL;
+	*op++ = len;
+
+	return op;
+}
+
+static uint8_t *lz_put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			   size_t nr_lit, size_t match, size_t offset)
+{
+	uint8_t *token = op++;
+
+	if (op > oend)
+		return NULL;
+
+	*token = (nr_lit < 15 ? nr_lit : 15) << 4;
+	if (nr_lit >= 15 && !(op = lz_put_len(op, oend, nr_lit - 15)))
+		return NULL;
+
+	if (op + nr_lit > oend)
+		return NULL;
+	memcpy(op, lit, nr_lit);
+	op += nr_lit;
+
+	if (!match)
+		return op;
+
+	if (op + 2 > oend)
+		return NULL;
+	*op++ = offset;
+	*op++ = offset >> 8;
+
+	match -= LZ_MIN_MATCH;
+	*token |= match < 15 ? match : 15;
+	if (match >= 15)
+		op = lz_put_len(op, oend, match - 15);
+
+	return op;
+}
+
+/* Greedy compression using a single hash table of recent positions.
+ * Returns the compressed size or 0 if it wouldn't fit in out_size. */
+static size_t lz_compress(const uint8_t *in, size_t size, uint8_t *out, size_t out_size)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const uint8_t *ip = in, *anchor = in, *end = in + size, *ref;
+	uint8_t *op = out, *oend = out + out_size;
+	size_t len;
+	uint32_t h;
+
+	/* Positions are stored plus one so zero means empty */
+	memset(table, 0, sizeof(table));
+	while (size >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+		h = lz_hash(ip);
+		ref = table[h] ? in + table[h] - 1 : NULL;
+		table[h] = ip - in + 1;
+
+		if (!ref || ip - ref > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH)) {
+			ip++;
+			continue;
+		}
+
+		for (len = LZ_MIN_MATCH; ip + len < end && ref[len] == ip[len]; len++);
+
+		op = lz_put_seq(op, oend, anchor, ip - anchor, len, ip - ref);
+		if (!op)
+			return 0;
+
+		ip += len;
+		anchor = ip;
+	}
+
+	op = lz_put_seq(op, oend, anchor, end - anchor, 0, 0);
+
+	return op ? op - out : 0;
+}
+
+static int lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/* Returns the decompressed size or -1 if the input is corrupt */
+static ssize_t lz_decompress(const uint8_t *in, size_t size, uint8_t *out, size_t out_size)
+{
+	const uint8_t *ip = in, *iend = in + size;
+	uint8_t *op = out, *oend = out + out_size;
+	size_t nr_lit, match, offset;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		nr_lit = token >> 4;
+		if (nr_lit == 15 && lz_get_len(&ip, iend, &nr_lit))
+			return -1;
+		if (nr_lit > (size_t) (iend - ip) || nr_lit > (size_t) (oend - op))
+			return -1;
+		memcpy(op, ip, nr_lit);
+		ip += nr_lit;
+		op += nr_lit;
+
+		/* The last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		match = token & 0xf;
+		if (match == 15 && lz_get_len(&ip, iend, &match))
+			return -1;
+		match += LZ_MIN_MATCH;
+
+		if (!offset || offset > (size_t) (op - out) || match > (size_t) (oend - op))
+			return -1;
+
+		/* Matches may overlap the output so copy forwards */
+		for (; match; match--, op++)
+			*op = *(op - offset);
+	}
+
+	return op - out;
+}
+
+static bool is_zero(const uint8_t *buf, size_t size)
+{
+	return !size || (!buf[0] && !memcmp(buf, buf + 1, size - 1));
+}
+
+/* Compress up to COMPRESS_BLOCK_SIZE bytes into a block, header
+ * included, returning its total size */
+size_t compress_block(const uint8_t *in, size_t size, uint8_t *out)
+{
+	uint32_t type, payload, val;
+
+	if (is_zero(in, size)) {
+		type = COMPRESS_ZERO;
+		payload = 0;
+	} else {
+		payload = lz_compress(in, size, out + COMPRESS_HDR_SIZE, size - 1);
+		if (payload)
+			type = COMPRESS_LZ;
+		else {
+			type = COMPRESS_STORED;
+			payload = size;
+			memcpy(out + COMPRESS_HDR_SIZE, in, size);
+		}
+	}
+
+	memset(out, 0, COMPRESS_HDR_SIZE);
+	out[0] = type;
+	val = htobe32(size);
+	memcpy(out + 4, &val, sizeof(val));
+	val = htobe32(payload);
+	memcpy(out + 8, &val, sizeof(val));
+
+	return COMPRESS_HDR_SIZE + payload;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t size)
+{
+	ssize_t rc;
+
+	while (size) {
+		rc = write(fd, buf, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		buf += rc;
+		size -= rc;
+	}
+
+	return 0;
+}
+
+/* Returns the number of bytes read, which is only short at the end of
+ * the file, or -1 on error */
+static ssize_t read_all(int fd, uint8_t *buf, size_t size)
+{
+	size_t done = 0;
+	ssize_t rc;
+
+	while (done < size) {
+		rc = read(fd, buf + done, size - done);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!rc)
+			break;
+
+		done += rc;
+	}
+
+	return done;
+}
+
+static int expand_block(uint8_t type, const uint8_t *in, uint32_t payload,
+			uint8_t *out, uint32_t raw)
+{
+	switch (type) {
+	case COMPRESS_ZERO:
+		memset(out, 0, raw);
+		return 0;
+
+	case COMPRESS_STORED:
+		if (payload != raw)
+			return -1;
+		memcpy(out, in, raw);
+		return 0;
+
+	case COMPRESS_LZ:
+		return lz_decompress(in, payload, out, raw) == raw ? 0 : -1;
+
+	default:
+		return -1;
+	}
+}
+
+/* Expand a block made by compress_block() into out, returning the
+ * original size or -1 if the block is corrupt or too big for out */
+ssize_t decompress_block(const uint8_t *in, size_t size, uint8_t *out, size_t out_size)
+{
+	uint32_t raw, payload;
+
+	if (size < COMPRESS_HDR_SIZE)
+		return -1;
+
+	memcpy(&raw, in + 4, sizeof(raw));
+	memcpy(&payload, in + 8, sizeof(payload));
+	raw = be32toh(raw);
+	payload = be32toh(payload);
+
+	if (raw > out_size || payload != size - COMPRESS_HDR_SIZE ||
+	    expand_block(in[0], in + COMPRESS_HDR_SIZE, payload, out, raw))
+		return -1;
+
+	return raw;
+}
+
+int compress_start(int fd)
+{
+	return write_all(fd, (const uint8_t *) COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE);
+}
+
+/* Compress buf to fd. Block boundaries depend on how the data is split
+ * between calls so callers should pass COMPRESS_BLOCK_SIZE at a time
+ * where they can. */
+int compress_write(int fd, const uint8_t *buf, size_t size)
+{
+	uint8_t *out;
+	size_t len;
+	int rc = 0;
+
+	out = malloc(COMPRESS_BOUND(COMPRESS_BLOCK_SIZE));
+	if (!out)
+		return -1;
+
+	while (!rc && size) {
+		len = size < COMPRESS_BLOCK_SIZE ? size : COMPRESS_BLOCK_SIZE;
+		rc = write_all(fd, out, compress_block(buf, len, out));
+		buf += len;
+		size -= len;
+	}
+
+	free(out);
+
+	return rc;
+}
+
+/* Expand a compressed dump from in_fd to out_fd */
+int decompress_stream(int in_fd, int out_fd)
+{
+	uint8_t hdr[COMPRESS_HDR_SIZE], *in, *out;
+	uint32_t raw, payload;
+	ssize_t len;
+	int rc = -1;
+
+	in = malloc(COMPRESS_BLOCK_SIZE);
+	out = malloc(COMPRESS_BLOCK_SIZE);
+	if (!in || !out)
+		goto out;
+
+	len = read_all(in_fd, hdr, COMPRESS_MAGIC_SIZE);
+	if (len != COMPRESS_MAGIC_SIZE || memcmp(hdr, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE)) {
+		fprintf(stderr, "Not a compressed dump\n");
+		goto out;
+	}
+
+	while ((len = read_all(in_fd, hdr, COMPRESS_HDR_SIZE)) == COMPRESS_HDR_SIZE) {
+		memcpy(&raw, hdr + 4, sizeof(raw));
+		memcpy(&payload, hdr + 8, sizeof(payload));
+		raw = be32toh(raw);
+		payload = be32toh(payload);
+
+		if (raw > COMPRESS_BLOCK_SIZE || payload > COMPRESS_BLOCK_SIZE ||
+		    read_all(in_fd, in, payload) != payload) {
+			fprintf(stderr, "Truncated or corrupt block\n");
+			goto out;
+		}
+
+		if (expand_block(hdr[0], in, payload, out, raw))
+			goto corrupt;
+
+		if (write_all(out_fd, out, raw)) {
+			fprintf(stderr, "Unable to write output: %m\n");
+			goto out;
+		}
+	}
+
+	if (len) {
+		fprintf(stderr, "Truncated block header\n");
+		goto out;
+	}
+
+	rc = 0;
+	goto out;
+
+corrupt:
+	fprintf(stderr, "Corrupt block\n");
+out:
+	free(in);
+	free(out);
+
+	return rc;
+}
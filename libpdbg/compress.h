@@ -0,0 +1,51 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* A compressed dump is the magic followed by a sequence of blocks,
+ * each holding up to COMPRESS_BLOCK_SIZE bytes of the original data:
+ *
+ *	u8 type, u8 reserved[3], be32 raw size, be32 payload size, payload
+ *
+ * Blocks of all zeroes have no payload, blocks which don't shrink are
+ * stored as is and everything else is compressed with a small LZ77
+ * codec so dumps can be written on the BMC without external
+ * libraries. */
+#define COMPRESS_MAGIC		"PDBGLZ01"
+#define COMPRESS_MAGIC_SIZE	8
+#define COMPRESS_BLOCK_SIZE	(64 * 1024)
+#define COMPRESS_HDR_SIZE	12
+
+#define COMPRESS_ZERO		0
+#define COMPRESS_STORED		1
+#define COMPRESS_LZ		2
+
+/* Space needed to hold a compressed block of size bytes */
+#define COMPRESS_BOUND(size)	(COMPRESS_HDR_SIZE + (size))
+
+size_t compress_block(const uint8_t *in, size_t size, uint8_t *out);
+ssize_t decompress_block(const uint8_t *in, size_t size, uint8_t *out, size_t out_size);
+
+int compress_start(int fd);
+int compress_write(int fd, const uint8_t *buf, size_t size);
+int decompress_stream(int in_fd, int out_fd);
+
+#endif
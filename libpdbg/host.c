@@ -29,12 +29,15 @@
 #include <errno.h>
 #include <err.h>
 #include <inttypes.h>
+#include <dirent.h>
+#include <endian.h>
 
 #include "bitutils.h"
 #include "operations.h"
 #include "target.h"
 
 #define XSCOM_BASE_PATH "/sys/kernel/debug/powerpc/scom"
+#define HOST_DT_PATH "/proc/device-tree"
 
 static uint64_t xscom_mangle_addr(uint64_t addr)
 {
@@ -80,6 +83,69 @@ static int xscom_write(struct pib *pib, uint64_t addr, uint64_t val)
 	return 0;
 }
 
+static int read_dt_file(const char *node, const char *prop, void *buf, size_t size)
+{
+	char *path;
+	int fd, rc;
+
+	if (asprintf(&path, "%s/%s/%s", HOST_DT_PATH, node, prop) < 0)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return -1;
+
+	rc = read(fd, buf, size);
+	close(fd);
+
+	return rc;
+}
+
+/* Record the memory attached to chip_id in the host device tree as a
+ * memory-ranges property (pairs of 64-bit base and size) so the ADU
+ * below this pib can tell which addresses are local to it. */
+static void host_memory_ranges(struct target *target, uint32_t chip_id)
+{
+	struct dirent *de;
+	DIR *dir;
+	uint64_t *ranges = NULL, *tmp, reg[2];
+	uint32_t id;
+	int nr_ranges = 0;
+
+	dir = opendir(HOST_DT_PATH);
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "memory@", 7))
+			continue;
+
+		if (read_dt_file(de->d_name, "ibm,chip-id", &id, sizeof(id)) != sizeof(id) ||
+		    be32toh(id) != chip_id)
+			continue;
+
+		/* The host uses two cells each for address and size */
+		if (read_dt_file(de->d_name, "reg", reg, sizeof(reg)) != sizeof(reg))
+			continue;
+
+		tmp = realloc(ranges, (nr_ranges + 1) * sizeof(reg));
+		if (!tmp)
+			break;
+		ranges = tmp;
+
+		/* Already big-endian which is what the property wants */
+		ranges[2*nr_ranges] = reg[0];
+		ranges[2*nr_ranges + 1] = reg[1];
+		nr_ranges++;
+	}
+	closedir(dir);
+
+	if (nr_ranges)
+		dt_add_property(target->dn, "memory-ranges", ranges, nr_ranges * sizeof(reg));
+	free(ranges);
+}
+
 static int host_pib_probe(struct target *target)
 {
 	struct pib *pib = target_to_pib(target);
@@ -87,7 +153,11 @@ static int host_pib_probe(struct target *target)
 	char *access_fn;
 	uint32_t chip_id;
 
-	fd = malloc(sizeof(fd));
+	/* Opened by an earlier probe */
+	if (pib->priv)
+		return 0;
+
+	fd = malloc(sizeof(*fd));
 	if (!fd)
 		return -1;
 
@@ -99,11 +169,16 @@ static int host_pib_probe(struct target *target)
 
 	*fd = open(access_fn, O_RDWR);
 	free(access_fn);
-	if (fd < 0)
+	if (*fd < 0) {
+		free(fd);
 		return -1;
+	}
 
 	pib->priv = fd;
 
+	if (!dt_find_property(target->dn, "memory-ranges"))
+		host_memory_ranges(target, chip_id);
+
 	return 0;
 }
 
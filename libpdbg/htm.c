@@ -14,8 +14,11 @@
  * limitations under the License.
  */
 #define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -28,6 +31,7 @@
 #include "operations.h"
 #include "bitutils.h"
 #include "target.h"
+#include "compress.h"
 
 #define HTM_ERR(x) ({int rc = x; if (rc) {PR_ERROR("HTM Error %d %s:%d\n", \
 			rc, __FILE__, __LINE__);} \
@@ -209,14 +213,14 @@ int htm_status(struct target *target)
 	return htm ? htm->status(htm) : -1;
 }
 
-int htm_dump(struct target *target, uint64_t size, const char *filename)
+int htm_dump(struct target *target, uint64_t size, const char *filename, int flags)
 {
 	struct htm *htm = check_and_convert(target);
 
 	if (!htm || !filename)
 		return -1;
 
-	return htm->dump(htm, 0, filename);
+	return htm->dump(htm, 0, filename, flags);
 }
 
 static int get_status(struct htm *htm, struct htm_status *status)
@@ -743,14 +747,72 @@ static int do_htm_status(struct htm *htm)
 	return 1;
 }
 
-static int do_htm_dump(struct htm *htm, uint64_t size, const char *basename)
+/* Buffers between the thread reading the trace and the caller
+ * compressing and writing it out, so the debugfs reads keep going
+ * while a block is being compressed */
+#define HTM_DUMP_BUFS	4
+
+struct htm_dump_buf {
+	uint8_t *data;
+	ssize_t size;
+	int err;
+	bool full;
+};
+
+struct htm_dump_pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct htm_dump_buf bufs[HTM_DUMP_BUFS];
+	int fd;
+	uint64_t size;
+	bool stop;
+};
+
+static void *htm_dump_reader(void *arg)
+{
+	struct htm_dump_pipe *pipe = arg;
+	struct htm_dump_buf *buf;
+	uint64_t size = pipe->size;
+	bool stop;
+	int i;
+
+	for (i = 0; size; i = (i + 1) % HTM_DUMP_BUFS) {
+		buf = &pipe->bufs[i];
+
+		pthread_mutex_lock(&pipe->lock);
+		while (buf->full && !pipe->stop)
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		stop = pipe->stop;
+		pthread_mutex_unlock(&pipe->lock);
+		if (stop)
+			break;
+
+		buf->size = read(pipe->fd, buf->data, MIN(COMPRESS_BLOCK_SIZE, size));
+		buf->err = errno;
+
+		pthread_mutex_lock(&pipe->lock);
+		buf->full = true;
+		pthread_cond_broadcast(&pipe->cond);
+		pthread_mutex_unlock(&pipe->lock);
+
+		/* The consumer stops at the short read too */
+		if (buf->size <= 0)
+			break;
+		size -= buf->size;
+	}
+
+	return NULL;
+}
+
+static int do_htm_dump(struct htm *htm, uint64_t size, const char *basename, int flags)
 {
 	char *trace_file, *dump_file;
 	struct htm_status status;
-	uint64_t trace[0x1000];
-	int trace_fd, dump_fd;
+	struct htm_dump_pipe pipe;
+	struct htm_dump_buf *buf;
+	pthread_t reader;
+	int trace_fd, dump_fd, i, rc = 1;
 	uint32_t chip_id;
-	size_t r;
 
 	if (!basename)
 		return -1;
@@ -803,28 +865,72 @@ static int do_htm_dump(struct htm *htm, uint64_t size, const char *basename)
 		return -1;
 	}
 
-	while (size) {
-		r = read(trace_fd, &trace, MIN(sizeof(trace), size));
-		if (r == -1) {
-			PR_ERROR("Failed to read from %s: %m\n", trace_file);
-			free(trace_file);
-			free(dump_file);
-			close(trace_fd);
-			close(dump_fd);
-			return -1;
+	if ((flags & HTM_DUMP_COMPRESS) && compress_start(dump_fd))
+		PR_ERROR("Short write!\n");
+
+	memset(&pipe, 0, sizeof(pipe));
+	pthread_mutex_init(&pipe.lock, NULL);
+	pthread_cond_init(&pipe.cond, NULL);
+	pipe.fd = trace_fd;
+	pipe.size = size;
+	for (i = 0; i < HTM_DUMP_BUFS; i++) {
+		pipe.bufs[i].data = malloc(COMPRESS_BLOCK_SIZE);
+		if (!pipe.bufs[i].data) {
+			rc = -1;
+			goto out;
+		}
+	}
+
+	if (pthread_create(&reader, NULL, htm_dump_reader, &pipe)) {
+		rc = -1;
+		goto out;
+	}
+
+	for (i = 0; size; i = (i + 1) % HTM_DUMP_BUFS) {
+		buf = &pipe.bufs[i];
+
+		pthread_mutex_lock(&pipe.lock);
+		while (!buf->full)
+			pthread_cond_wait(&pipe.cond, &pipe.lock);
+		pthread_mutex_unlock(&pipe.lock);
+
+		if (buf->size == -1) {
+			PR_ERROR("Failed to read from %s: %s\n", trace_file, strerror(buf->err));
+			rc = -1;
+			break;
 		}
+		if (!buf->size)
+			break;
 
-		if (write(dump_fd, &trace, r) != r)
+		if (flags & HTM_DUMP_COMPRESS) {
+			if (compress_write(dump_fd, buf->data, buf->size))
+				PR_ERROR("Short write!\n");
+		} else if (write(dump_fd, buf->data, buf->size) != buf->size)
 			PR_ERROR("Short write!\n");
+		size -= buf->size;
 
-		size -= r;
+		pthread_mutex_lock(&pipe.lock);
+		buf->full = false;
+		pthread_cond_broadcast(&pipe.cond);
+		pthread_mutex_unlock(&pipe.lock);
 	}
 
+	pthread_mutex_lock(&pipe.lock);
+	pipe.stop = true;
+	pthread_cond_broadcast(&pipe.cond);
+	pthread_mutex_unlock(&pipe.lock);
+	pthread_join(reader, NULL);
+
+out:
+	for (i = 0; i < HTM_DUMP_BUFS; i++)
+		free(pipe.bufs[i].data);
+	pthread_mutex_destroy(&pipe.lock);
+	pthread_cond_destroy(&pipe.cond);
 	free(trace_file);
 	free(dump_file);
 	close(trace_fd);
 	close(dump_fd);
-	return 1;
+	return rc;
 }
 
 static int htm_probe(struct target *target)
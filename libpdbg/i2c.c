@@ -13,6 +13,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,6 +22,7 @@
 #include <unistd.h>
 #include <endian.h>
 #include <sys/ioctl.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
 #include "bitutils.h"
@@ -29,6 +31,10 @@
 struct i2c_data {
 	int addr;
 	int fd;
+
+	/* The adapter can run several messages in one I2C_RDWR with a
+	 * stop after each */
+	bool rdwr;
 };
 
 static int i2c_set_addr(int fd, int addr)
@@ -41,15 +47,32 @@ static int i2c_set_addr(int fd, int addr)
 	return 0;
 }
 
-static int i2c_set_scom_addr(struct i2c_data *i2c_data, uint32_t addr)
+static void i2c_scom_addr(uint8_t *data, uint32_t addr)
 {
-	uint8_t data[4];
-
 	addr <<= 1;
 	data[3] = GETFIELD(PPC_BITMASK32(0, 7), addr);
 	data[2] = GETFIELD(PPC_BITMASK32(8, 15), addr);
 	data[1] = GETFIELD(PPC_BITMASK32(16, 23), addr);
 	data[0] = GETFIELD(PPC_BITMASK32(23, 31), addr);
+}
+
+static void i2c_scom_data(uint8_t *data, uint64_t value)
+{
+	data[7] = GETFIELD(PPC_BITMASK(0, 7), value);
+	data[6] = GETFIELD(PPC_BITMASK(8, 15), value);
+	data[5] = GETFIELD(PPC_BITMASK(16, 23), value);
+	data[4] = GETFIELD(PPC_BITMASK(23, 31), value);
+	data[3] = GETFIELD(PPC_BITMASK(32, 39), value);
+	data[2] = GETFIELD(PPC_BITMASK(40, 47), value);
+	data[1] = GETFIELD(PPC_BITMASK(48, 55), value);
+	data[0] = GETFIELD(PPC_BITMASK(56, 63), value);
+}
+
+static int i2c_set_scom_addr(struct i2c_data *i2c_data, uint32_t addr)
+{
+	uint8_t data[4];
+
+	i2c_scom_addr(data, addr);
 	if (write(i2c_data->fd, data, sizeof(data)) != 4) {
 		PR_ERROR("Error writing address bytes\n");
 		return -1;
@@ -80,22 +103,9 @@ static int i2c_putscom(struct pib *pib, uint64_t addr, uint64_t value)
 	struct i2c_data *i2c_data = pib->priv;
 	uint8_t data[12];
 
-	/* Setup scom address */
-	addr <<= 1;
-	data[3] = GETFIELD(PPC_BITMASK32(0, 7), addr);
-	data[2] = GETFIELD(PPC_BITMASK32(8, 15), addr);
-	data[1] = GETFIELD(PPC_BITMASK32(16, 23), addr);
-	data[0] = GETFIELD(PPC_BITMASK32(23, 31), addr);
-
-	/* Add data value */
-	data[11] = GETFIELD(PPC_BITMASK(0, 7), value);
-	data[10] = GETFIELD(PPC_BITMASK(8, 15), value);
-	data[9] = GETFIELD(PPC_BITMASK(16, 23), value);
-	data[8] = GETFIELD(PPC_BITMASK(23, 31), value);
-	data[7] = GETFIELD(PPC_BITMASK(32, 39), value);
-	data[6] = GETFIELD(PPC_BITMASK(40, 47), value);
-	data[5] = GETFIELD(PPC_BITMASK(48, 55), value);
-	data[4] = GETFIELD(PPC_BITMASK(56, 63), value);
+	/* Setup scom address and add data value */
+	i2c_scom_addr(data, addr);
+	i2c_scom_data(data + 4, value);
 
 	/* Write value */
 	if (write(i2c_data->fd, data, sizeof(data)) != 12) {
@@ -106,6 +116,77 @@ static int i2c_putscom(struct pib *pib, uint64_t addr, uint64_t value)
 	return 0;
 }
 
+/* Reads take two messages, the address write and the data read, while
+ * writes take one */
+#define I2C_BATCH_OPS	(I2C_RDWR_IOCTL_MAX_MSGS / 2)
+
+/* Run a run of plain reads and writes as a single I2C_RDWR transfer.
+ * Every message ends in a stop, as when each is a separate read() or
+ * write(), so the slave sees the same bus sequence as before. */
+static int i2c_transfer(struct i2c_data *i2c_data, struct pib_op *ops, int count)
+{
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	struct i2c_rdwr_ioctl_data rdwr = { .msgs = msgs, .nmsgs = 0 };
+	uint8_t bufs[I2C_BATCH_OPS][12];
+	uint64_t data;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		i2c_scom_addr(bufs[i], ops[i].addr);
+		if (ops[i].type == PIB_OP_WRITE) {
+			i2c_scom_data(bufs[i] + 4, ops[i].data);
+			msgs[rdwr.nmsgs++] = (struct i2c_msg) { .addr = i2c_data->addr, .flags = I2C_M_STOP,
+								.len = 12, .buf = bufs[i] };
+		} else {
+			msgs[rdwr.nmsgs++] = (struct i2c_msg) { .addr = i2c_data->addr, .flags = I2C_M_STOP,
+								.len = 4, .buf = bufs[i] };
+			msgs[rdwr.nmsgs++] = (struct i2c_msg) { .addr = i2c_data->addr,
+								.flags = I2C_M_RD | I2C_M_STOP,
+								.len = 8, .buf = bufs[i] + 4 };
+		}
+	}
+
+	if (ioctl(i2c_data->fd, I2C_RDWR, &rdwr) < 0) {
+		PR_ERROR("Error running i2c transfer\n");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (ops[i].type != PIB_OP_READ)
+			continue;
+
+		memcpy(&data, bufs[i] + 4, sizeof(data));
+		ops[i].data = le64toh(data);
+	}
+
+	return 0;
+}
+
+/* Consecutive reads and writes go out together in one transfer, saving
+ * a syscall per access. Anything which depends on
+ * a value read (read-modify-writes and polls) runs on its own. */
+static int i2c_batch(struct pib *pib, struct pib_op *ops, int count)
+{
+	struct i2c_data *i2c_data = pib->priv;
+	int i, n;
+
+	for (i = 0; i < count; i += n) {
+		for (n = 0; i + n < count && n < I2C_BATCH_OPS; n++)
+			if (ops[i + n].type != PIB_OP_READ && ops[i + n].type != PIB_OP_WRITE)
+				break;
+
+		if (n && i2c_data->rdwr) {
+			CHECK_ERR(i2c_transfer(i2c_data, &ops[i], n));
+			continue;
+		}
+
+		n = 1;
+		CHECK_ERR(pib_run_op(pib, &ops[i]));
+	}
+
+	return 0;
+}
+
 #if 0
 /* TODO: At present we don't have a generic destroy method as there aren't many
  * use cases for it. So for the moment we can just let the OS close the file
@@ -127,8 +208,13 @@ int i2c_target_probe(struct target *target)
 	struct pib *pib = target_to_pib(target);
 	struct i2c_data *i2c_data;
 	const char *bus;
+	unsigned long funcs;
 	int addr;
 
+	/* Opened by an earlier probe */
+	if (pib->priv)
+		return 0;
+
 	bus = "/dev/i2c4";
 	addr = dt_get_address(pib->target.dn, 0, NULL);
 	assert(addr);
@@ -141,11 +227,21 @@ int i2c_target_probe(struct target *target)
 	i2c_data->fd = open(bus, O_RDWR);
 	if (i2c_data->fd < 0) {
 		perror("Error opening bus");
+		free(i2c_data);
 		return -1;
 	}
 
-	if (i2c_set_addr(i2c_data->fd, addr) < 0)
+	if (i2c_set_addr(i2c_data->fd, addr) < 0) {
+		close(i2c_data->fd);
+		free(i2c_data);
 		return -1;
+	}
+
+	/* Without I2C_M_STOP the adapter would use a repeated start
+	 * between the address write and data read, which the slave
+	 * hasn't been validated with, so stick to separate accesses */
+	i2c_data->rdwr = !ioctl(i2c_data->fd, I2C_FUNCS, &funcs) &&
+		(funcs & I2C_FUNC_I2C) && (funcs & I2C_FUNC_PROTOCOL_MANGLING);
 
 	pib->priv = i2c_data;
 
@@ -161,5 +257,6 @@ struct pib p8_i2c_pib = {
 	},
 	.read = i2c_getscom,
 	.write = i2c_putscom,
+	.batch = i2c_batch,
 };
 DECLARE_HW_UNIT(p8_i2c_pib);
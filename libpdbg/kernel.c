@@ -40,13 +40,9 @@ static int kernel_fsi_getcfam(struct fsi *fsi, uint32_t addr64, uint32_t *value)
 	int rc;
 	uint32_t tmp, addr = (addr64 & 0x7ffc00) | ((addr64 & 0x3ff) << 2);
 
-	rc = lseek(fsi_fd, addr, SEEK_SET);
-	if (rc < 0) {
-		warn("Failed to seek %s", FSI_CFAM_PATH);
-		return errno;
-	}
-
-	rc = read(fsi_fd, &tmp, 4);
+	/* Use pread() so accesses from different threads can't race on
+	 * the shared file offset */
+	rc = pread(fsi_fd, &tmp, 4, addr);
 	if (rc < 0) {
 		if ((addr64 & 0xfff) != 0xc09)
 			/* We expect reads of 0xc09 to occasionally
@@ -65,14 +61,8 @@ static int kernel_fsi_putcfam(struct fsi *fsi, uint32_t addr64, uint32_t data)
 	int rc;
 	uint32_t tmp, addr = (addr64 & 0x7ffc00) | ((addr64 & 0x3ff) << 2);
 
-	rc = lseek(fsi_fd, addr, SEEK_SET);
-	if (rc < 0) {
-		warn("Failed to seek %s", FSI_CFAM_PATH);
-		return errno;
-	}
-
 	tmp = htobe32(data);
-	rc = write(fsi_fd, &tmp, 4);
+	rc = pwrite(fsi_fd, &tmp, 4, addr);
 	if (rc < 0) {
 		warn("Failed to write to 0x%08" PRIx32 " (%016" PRIx32 ")", addr, addr64);
 		return errno;
@@ -130,7 +120,8 @@ int kernel_fsi_probe(struct target *target)
 
 	}
 
-	return -1;
+	/* Opened by an earlier probe */
+	return 0;
 }
 
 struct fsi kernel_fsi = {
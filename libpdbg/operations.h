@@ -33,8 +33,25 @@
 #define FSI2PIB_BASE	0x1000
 
 /* Alter display unit functions */
+#define DROP_PRIORITY_LOW	0ULL
+#define DROP_PRIORITY_MEDIUM	1ULL
+#define DROP_PRIORITY_HIGH	2ULL
+
+/* Longest pattern adu_fill() accepts */
+#define ADU_MAX_PATTERN		128
+
 int adu_getmem(struct target *target, uint64_t addr, uint8_t *output, uint64_t size);
+int adu_probemem(struct target *target, uint64_t addr, uint8_t *output, uint64_t size);
 int adu_putmem(struct target *target, uint64_t start_addr, uint8_t *input, uint64_t size);
+int adu_fill(struct target *target, uint64_t start_addr, const uint8_t *pattern,
+	     uint64_t pattern_size, uint64_t size);
+bool adu_owns(struct target *target, uint64_t addr, uint64_t size);
+int adu_set_priority(struct target *target, int priority);
+
+/* Highest rate in bytes per second adu_set_rate() accepts, far above
+ * anything an ADU can actually do */
+#define ADU_MAX_RATE		(16ULL << 30)
+int adu_set_rate(uint64_t rate);
 
 /* Functions to ram instructions */
 #define THREAD_STATUS_DISABLED  PPC_BIT(0)
@@ -75,7 +92,10 @@ int htm_stop(struct target *target);
 int htm_start(struct target *target);
 int htm_status(struct target *target);
 int htm_reset(struct target *target, uint64_t *base, uint64_t *size);
-int htm_dump(struct target *target, uint64_t, const char *);
+/* Compress the dump in the format understood by pdbg-decompress */
+#define HTM_DUMP_COMPRESS	0x1
+
+int htm_dump(struct target *target, uint64_t, const char *, int flags);
 
 /* GDB server functionality */
 int gdbserver_start(uint16_t port);
@@ -0,0 +1,701 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "backend.h"
+#include "compress.h"
+#include "operations.h"
+#include "remote.h"
+#include "target.h"
+
+/* Batch requests kept in flight on a connection before waiting for
+ * their responses. Each one's responses fit easily in the socket
+ * buffers so neither end can block the other. */
+#define REMOTE_WINDOW		4
+
+/* Bytes fetched by one remote getmem_block(), which is never more than
+ * an auto-increment block */
+#define REMOTE_MAX_BLOCK	0x800
+
+/* A connection to the daemon, shared by everything on a processor */
+struct remote_conn {
+	int fd;
+	pthread_mutex_t lock;
+};
+
+static const char *remote_server;
+
+int remote_send_all(int fd, const void *buf, size_t size)
+{
+	ssize_t rc;
+
+	while (size) {
+		rc = write(fd, buf, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		buf += rc;
+		size -= rc;
+	}
+
+	return 0;
+}
+
+int remote_recv_all(int fd, void *buf, size_t size)
+{
+	ssize_t rc;
+
+	while (size) {
+		rc = read(fd, buf, size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+
+		buf += rc;
+		size -= rc;
+	}
+
+	return 0;
+}
+
+int remote_send_req(int fd, struct daemon_req *req)
+{
+	struct daemon_req wire = {
+		.op = htobe16(req->op),
+		.flags = htobe16(req->flags),
+		.procs = htobe32(req->procs),
+		.addr = htobe64(req->addr),
+		.data = htobe64(req->data),
+		.mask = htobe64(req->mask),
+	};
+
+	return remote_send_all(fd, &wire, sizeof(wire));
+}
+
+int remote_recv_req(int fd, struct daemon_req *req)
+{
+	if (remote_recv_all(fd, req, sizeof(*req)))
+		return -1;
+
+	req->op = be16toh(req->op);
+	req->flags = be16toh(req->flags);
+	req->procs = be32toh(req->procs);
+	req->addr = be64toh(req->addr);
+	req->data = be64toh(req->data);
+	req->mask = be64toh(req->mask);
+
+	return 0;
+}
+
+int remote_send_resp(int fd, int32_t rc, uint32_t index, uint64_t data)
+{
+	struct daemon_resp wire = {
+		.rc = htobe32(rc),
+		.index = htobe32(index),
+		.data = htobe64(data),
+	};
+
+	return remote_send_all(fd, &wire, sizeof(wire));
+}
+
+int remote_recv_resp(int fd, struct daemon_resp *resp)
+{
+	if (remote_recv_all(fd, resp, sizeof(*resp)))
+		return -1;
+
+	resp->rc = be32toh(resp->rc);
+	resp->index = be32toh(resp->index);
+	resp->data = be64toh(resp->data);
+
+	return 0;
+}
+
+int remote_send_ops(int fd, struct pib_op *ops, int count)
+{
+	struct daemon_pib_op wire[DAEMON_MAX_BATCH];
+	int i;
+
+	assert(count <= DAEMON_MAX_BATCH);
+	memset(wire, 0, count * sizeof(wire[0]));
+	for (i = 0; i < count; i++) {
+		wire[i].type = ops[i].type;
+		wire[i].addr = htobe64(ops[i].addr);
+		wire[i].data = htobe64(ops[i].data);
+		wire[i].mask = htobe64(ops[i].mask);
+		wire[i].value = htobe64(ops[i].value);
+	}
+
+	return remote_send_all(fd, wire, count * sizeof(wire[0]));
+}
+
+int remote_recv_ops(int fd, struct pib_op *ops, int count)
+{
+	struct daemon_pib_op wire[DAEMON_MAX_BATCH];
+	int i;
+
+	if (count > DAEMON_MAX_BATCH || remote_recv_all(fd, wire, count * sizeof(wire[0])))
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		if (wire[i].type > PIB_OP_POLL_NE)
+			return -1;
+
+		ops[i].type = wire[i].type;
+		ops[i].addr = be64toh(wire[i].addr);
+		ops[i].data = be64toh(wire[i].data);
+		ops[i].mask = be64toh(wire[i].mask);
+		ops[i].value = be64toh(wire[i].value);
+	}
+
+	return 0;
+}
+
+int remote_getaddrinfo(const char *addr, struct addrinfo **res)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_NUMERICSERV,
+	};
+	char *host, *port, *end;
+	int rc;
+
+	host = strdup(addr ? addr : "");
+	if (!host)
+		return -1;
+
+	/* IPv6 addresses are given in brackets to separate the port */
+	port = strrchr(host, ':');
+	if (host[0] == '[' && (end = strchr(host, ']'))) {
+		*end = '\0';
+		port = end[1] == ':' ? end + 1 : NULL;
+		memmove(host, host + 1, strlen(host + 1) + 1);
+		if (port)
+			port -= 1;
+	}
+	if (port)
+		*port++ = '\0';
+
+	rc = getaddrinfo(*host ? host : NULL, port && *port ? port : DAEMON_PORT, &hints, res);
+	if (rc)
+		PR_ERROR("Unable to resolve %s: %s\n", addr, gai_strerror(rc));
+	free(host);
+
+	return rc ? -1 : 0;
+}
+
+/* Prove to the daemon at the other end of a TCP connection that we
+ * are allowed to use it */
+static int remote_auth(int fd)
+{
+	const char *token = getenv(DAEMON_TOKEN_ENV);
+	struct daemon_req req = { .op = DAEMON_AUTH };
+	struct daemon_resp resp;
+
+	if (!token || strlen(token) > DAEMON_MAX_TOKEN) {
+		PR_ERROR("Set %s to the daemon's token to connect over TCP\n", DAEMON_TOKEN_ENV);
+		return -1;
+	}
+
+	req.data = strlen(token);
+	if (remote_send_req(fd, &req) || remote_send_all(fd, token, req.data) ||
+	    remote_recv_resp(fd, &resp) || resp.rc) {
+		PR_ERROR("The daemon didn't accept the token in %s\n", DAEMON_TOKEN_ENV);
+		return -1;
+	}
+
+	return 0;
+}
+
+int remote_connect(const char *addr)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct addrinfo *res, *ai;
+	int fd = -1, one = 1;
+
+	if (addr && strchr(addr, '/')) {
+		if (strlen(addr) >= sizeof(sun.sun_path)) {
+			PR_ERROR("Socket path %s is too long\n", addr);
+			return -1;
+		}
+		strcpy(sun.sun_path, addr);
+
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr *) &sun, sizeof(sun))) {
+			PR_ERROR("Unable to connect to %s: %m\n", addr);
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+
+		return fd;
+	}
+
+	if (remote_getaddrinfo(addr, &res))
+		return -1;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		PR_ERROR("Unable to connect to %s: %m\n", addr ? addr : "localhost");
+		return -1;
+	}
+
+	/* Requests are small and a round trip each, don't hold them back */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (remote_auth(fd)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void remote_init(const char *server)
+{
+	remote_server = server;
+}
+
+/* The remote backend. Each processor gets its own connection so
+ * processors are accessed in parallel, just as the daemon accesses
+ * them. */
+
+/* Finds the remote pib a target sits under, along with its
+ * connection */
+static struct pib *remote_target_pib(struct target *target, struct remote_conn **conn)
+{
+	struct dt_node *dn;
+
+	for (dn = target->dn; dn; dn = dn->parent)
+		if (dn->target && !strcmp(dn->target->class, "pib"))
+			break;
+
+	*conn = dn ? target_to_pib(dn->target)->priv : NULL;
+
+	return *conn ? target_to_pib(dn->target) : NULL;
+}
+
+/* Drop a connection which has lost track of the protocol. Everything
+ * using it fails from then on. */
+static int remote_broken(struct remote_conn *conn)
+{
+	PR_ERROR("Lost connection to %s\n", remote_server ? remote_server : "localhost");
+	close(conn->fd);
+	conn->fd = -1;
+
+	return -1;
+}
+
+/* Read the responses to one batch request into ops. Returns the batch's
+ * result, or -2 if the connection failed. */
+static int remote_recv_batch(struct remote_conn *conn, struct pib_op *ops, int count)
+{
+	struct daemon_resp resp;
+
+	while (!remote_recv_resp(conn->fd, &resp)) {
+		if (resp.index == DAEMON_END)
+			return resp.rc ? -1 : 0;
+		if (resp.index < count)
+			ops[resp.index].data = resp.data;
+	}
+
+	return -2;
+}
+
+/* Send the batch DAEMON_MAX_BATCH ops at a time, keeping several
+ * requests in flight. Requests after the first are only run if the one
+ * before worked, preserving pib_batch() stopping at the first
+ * failure. */
+static int remote_pib_batch(struct pib *pib, struct pib_op *ops, int count)
+{
+	struct remote_conn *conn = pib->priv;
+	struct daemon_req req = {
+		.op = DAEMON_BATCH,
+		.procs = 1U << pib->target.index,
+	};
+	int sent = 0, done = 0, n, rc = 0, batch_rc;
+
+	pthread_mutex_lock(&conn->lock);
+	if (conn->fd < 0) {
+		pthread_mutex_unlock(&conn->lock);
+		return -1;
+	}
+
+	while (done < sent || (!rc && sent < count)) {
+		while (!rc && sent < count && sent - done < REMOTE_WINDOW * DAEMON_MAX_BATCH) {
+			n = count - sent < DAEMON_MAX_BATCH ? count - sent : DAEMON_MAX_BATCH;
+			req.data = n;
+			req.flags = sent ? DAEMON_IF_OK : 0;
+			if (remote_send_req(conn->fd, &req) ||
+			    remote_send_ops(conn->fd, &ops[sent], n)) {
+				rc = remote_broken(conn);
+				goto out;
+			}
+			sent += n;
+		}
+
+		n = sent - done < DAEMON_MAX_BATCH ? sent - done : DAEMON_MAX_BATCH;
+		batch_rc = remote_recv_batch(conn, &ops[done], n);
+		if (batch_rc == -2) {
+			rc = remote_broken(conn);
+			goto out;
+		}
+		if (batch_rc)
+			rc = -1;
+		done += n;
+	}
+out:
+	pthread_mutex_unlock(&conn->lock);
+
+	return rc;
+}
+
+static int remote_pib_read(struct pib *pib, uint64_t addr, uint64_t *value)
+{
+	struct pib_op op = { .type = PIB_OP_READ, .addr = addr };
+
+	CHECK_ERR(remote_pib_batch(pib, &op, 1));
+	*value = op.data;
+
+	return 0;
+}
+
+static int remote_pib_write(struct pib *pib, uint64_t addr, uint64_t value)
+{
+	struct pib_op op = { .type = PIB_OP_WRITE, .addr = addr, .data = value };
+
+	return remote_pib_batch(pib, &op, 1);
+}
+
+static int remote_pib_probe(struct target *target)
+{
+	struct pib *pib = target_to_pib(target);
+	struct daemon_req req = { .op = DAEMON_BATCH };
+	struct remote_conn *conn;
+	int rc;
+
+	if (target->index < 0 || target->index >= 32)
+		return -1;
+
+	/* Probing again reuses the connection but still asks the daemon */
+	conn = pib->priv;
+	if (!conn) {
+		conn = malloc(sizeof(*conn));
+		if (!conn)
+			return -1;
+
+		conn->fd = remote_connect(remote_server);
+		if (conn->fd < 0) {
+			free(conn);
+			return -1;
+		}
+		pthread_mutex_init(&conn->lock, NULL);
+		pib->priv = conn;
+	}
+
+	/* An empty batch only works if the daemon has the processor */
+	req.procs = 1U << target->index;
+	pthread_mutex_lock(&conn->lock);
+	rc = remote_send_req(conn->fd, &req) || remote_recv_batch(conn, NULL, 0);
+	pthread_mutex_unlock(&conn->lock);
+	if (rc) {
+		close(conn->fd);
+		pthread_mutex_destroy(&conn->lock);
+		free(conn);
+		pib->priv = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+struct pib remote_pib = {
+	.target = {
+		.name = "Remote PIB",
+		.compatible = "ibm,remote-pib",
+		.class = "pib",
+		.probe = remote_pib_probe,
+	},
+	.read = remote_pib_read,
+	.write = remote_pib_write,
+	.batch = remote_pib_batch,
+};
+DECLARE_HW_UNIT(remote_pib);
+
+static int remote_fsi_access(struct fsi *fsi, uint16_t op, uint32_t addr, uint32_t *value)
+{
+	struct remote_conn *conn;
+	struct daemon_req req = {
+		.op = op,
+		.procs = 1U << fsi->target.index,
+		.addr = addr,
+		.data = *value,
+		.mask = -1ULL,
+	};
+	struct daemon_resp resp;
+	int rc = -1;
+
+	if (!remote_target_pib(&fsi->target, &conn))
+		return -1;
+
+	pthread_mutex_lock(&conn->lock);
+	if (conn->fd < 0)
+		goto out;
+
+	if (remote_send_req(conn->fd, &req))
+		goto broken;
+
+	while (!remote_recv_resp(conn->fd, &resp)) {
+		if (resp.index == DAEMON_END) {
+			/* The end has the number of processors which worked */
+			rc = resp.rc == 1 ? 0 : -1;
+			goto out;
+		}
+		*value = resp.data;
+	}
+broken:
+	remote_broken(conn);
+out:
+	pthread_mutex_unlock(&conn->lock);
+
+	return rc;
+}
+
+static int remote_fsi_read(struct fsi *fsi, uint32_t addr, uint32_t *value)
+{
+	*value = 0;
+
+	return remote_fsi_access(fsi, DAEMON_GETCFAM, addr, value);
+}
+
+static int remote_fsi_write(struct fsi *fsi, uint32_t addr, uint32_t value)
+{
+	return remote_fsi_access(fsi, DAEMON_PUTCFAM, addr, &value);
+}
+
+/* The CFAM is only there if the daemon can read the chip id */
+static int remote_fsi_probe(struct target *target)
+{
+	uint32_t value;
+
+	return remote_fsi_read(target_to_fsi(target), 0xc09, &value);
+}
+
+struct fsi remote_fsi = {
+	.target = {
+		.name = "Remote FSI",
+		.compatible = "ibm,remote-fsi",
+		.class = "fsi",
+		.probe = remote_fsi_probe,
+	},
+	.read = remote_fsi_read,
+	.write = remote_fsi_write,
+};
+DECLARE_HW_UNIT(remote_fsi);
+
+/* Memory is read and written by the daemon's ADU on the same processor,
+ * with reads coming back compressed. A whole range is read with one
+ * GETMEM which the daemon streams back as it goes, so there is only
+ * one round trip however large it is. */
+static int remote_adu_read(struct adu *adu, uint64_t addr, uint8_t *output, uint64_t size)
+{
+	struct remote_conn *conn;
+	struct pib *pib = remote_target_pib(&adu->target, &conn);
+	struct daemon_req req = {
+		.op = DAEMON_GETMEM,
+		.flags = DAEMON_COMPRESS | DAEMON_ON_PROC,
+		.addr = addr,
+		.data = size,
+	};
+	struct daemon_resp resp;
+	uint8_t *block;
+	uint64_t len = 0;
+	ssize_t raw;
+	int rc = -1;
+
+	if (!pib)
+		return -1;
+	req.procs = 1U << pib->target.index;
+
+	block = malloc(COMPRESS_BOUND(DAEMON_MAX_GETMEM));
+	if (!block)
+		return -1;
+
+	pthread_mutex_lock(&conn->lock);
+	if (conn->fd < 0)
+		goto out;
+
+	if (remote_send_req(conn->fd, &req))
+		goto broken;
+
+	while (!remote_recv_resp(conn->fd, &resp)) {
+		if (resp.index == DAEMON_END) {
+			rc = !resp.rc && len == size ? 0 : -1;
+			goto out;
+		}
+
+		if (resp.data > COMPRESS_BOUND(DAEMON_MAX_GETMEM) ||
+		    remote_recv_all(conn->fd, block, resp.data))
+			break;
+
+		raw = decompress_block(block, resp.data, output + len, size - len);
+		if (raw < 0)
+			break;
+		len += raw;
+	}
+broken:
+	remote_broken(conn);
+out:
+	pthread_mutex_unlock(&conn->lock);
+	free(block);
+
+	return rc;
+}
+
+/* Words are in the big-endian order the ADU data register uses */
+static int remote_adu_getmem_block(struct adu *adu, uint64_t addr, uint64_t *data, int count)
+{
+	uint8_t buf[REMOTE_MAX_BLOCK];
+	int i;
+
+	if (8*count > REMOTE_MAX_BLOCK)
+		return -1;
+
+	CHECK_ERR(remote_adu_read(adu, addr, buf, 8*count));
+
+	for (i = 0; i < count; i++) {
+		memcpy(&data[i], buf + 8*i, sizeof(data[i]));
+		data[i] = be64toh(data[i]);
+	}
+
+	return 0;
+}
+
+static int remote_adu_getmem(struct adu *adu, uint64_t addr, uint64_t *data)
+{
+	return remote_adu_getmem_block(adu, addr, data, 1);
+}
+
+static int remote_adu_put(struct adu *adu, uint64_t addr, uint8_t *buf, uint64_t size)
+{
+	struct remote_conn *conn;
+	struct pib *pib = remote_target_pib(&adu->target, &conn);
+	struct daemon_req req = {
+		.op = DAEMON_PUTMEM,
+		.flags = DAEMON_ON_PROC,
+		.addr = addr,
+		.data = size,
+	};
+	struct daemon_resp resp;
+	int rc = -1;
+
+	if (!pib)
+		return -1;
+	req.procs = 1U << pib->target.index;
+
+	pthread_mutex_lock(&conn->lock);
+	if (conn->fd < 0)
+		goto out;
+
+	if (remote_send_req(conn->fd, &req) || remote_send_all(conn->fd, buf, size) ||
+	    remote_recv_resp(conn->fd, &resp))
+		remote_broken(conn);
+	else
+		rc = resp.rc ? -1 : 0;
+out:
+	pthread_mutex_unlock(&conn->lock);
+
+	return rc;
+}
+
+/* Partial writes carry their bytes in the same place within the word
+ * as they have in memory */
+static int remote_adu_putmem(struct adu *adu, uint64_t addr, uint64_t data, int size)
+{
+	uint8_t buf[8];
+	int i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = data >> 8*(8 - (addr % 8) - i - 1);
+
+	return remote_adu_put(adu, addr, buf, size);
+}
+
+static int remote_adu_putmem_block(struct adu *adu, uint64_t addr, uint64_t *data, int count,
+				   int period)
+{
+	uint8_t buf[REMOTE_MAX_BLOCK];
+	uint64_t word;
+	int i;
+
+	if (8*count > REMOTE_MAX_BLOCK)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		word = htobe64(data[i % period]);
+		memcpy(buf + 8*i, &word, sizeof(word));
+	}
+
+	return remote_adu_put(adu, addr, buf, 8*count);
+}
+
+struct adu remote_adu = {
+	.target = {
+		.name = "Remote ADU",
+		.compatible = "ibm,remote-adu",
+		.class = "adu",
+	},
+	.getmem = remote_adu_getmem,
+	.getmem_block = remote_adu_getmem_block,
+	.putmem = remote_adu_putmem,
+	.putmem_block = remote_adu_putmem_block,
+	.read = remote_adu_read,
+	/* The daemon's ADU picks the scope so never retry wider here */
+	.scope = 0,
+	.max_scope = 0,
+	.priority = DROP_PRIORITY_LOW,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+DECLARE_HW_UNIT(remote_adu);
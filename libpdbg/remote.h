@@ -0,0 +1,132 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __REMOTE_H
+#define __REMOTE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netdb.h>
+
+#include "target.h"
+
+/* Protocol spoken between a pdbg daemon and its clients, which are
+ * either "pdbg -D" or the remote backend.
+ *
+ * A client sends a request header, followed by data for DAEMON_PUTMEM
+ * and DAEMON_BATCH, and gets back any number of responses ending with
+ * one whose index is DAEMON_END. Everything is in network byte order.
+ * Clients may send more requests before reading the responses to
+ * earlier ones, which are answered in order.
+ *
+ *	GETSCOM/GETCFAM	addr		one response per processor with
+ *					the value read in data
+ *	PUTSCOM/PUTCFAM	addr data mask	one response per processor
+ *	GETMEM		addr data=size	responses with data=length, each
+ *					followed by that many bytes and
+ *					holding up to DAEMON_MAX_GETMEM
+ *					bytes of memory
+ *	PUTMEM		addr data=size	size (up to DAEMON_MAX_PUTMEM)
+ *					bytes follow the request
+ *	INVALIDATE			probe everything again
+ *	BATCH		data=count	count (up to DAEMON_MAX_BATCH)
+ *					struct daemon_pib_op follow and are
+ *					run as one pib_batch() on the first
+ *					selected processor, followed by
+ *					one response per op with its data
+ *					if the batch worked
+ *	AUTH		data=length	length (up to DAEMON_MAX_TOKEN)
+ *					bytes of token follow. Must be the
+ *					first request over TCP, the
+ *					connection is dropped if the token
+ *					isn't the daemon's
+ *
+ * Per processor responses are only sent for selected processors which
+ * are present. The final response has the number of processors which
+ * succeeded in rc, or 0 or -1 for requests which aren't per
+ * processor. */
+#define DAEMON_GETSCOM		1
+#define DAEMON_PUTSCOM		2
+#define DAEMON_GETCFAM		3
+#define DAEMON_PUTCFAM		4
+#define DAEMON_GETMEM		5
+#define DAEMON_PUTMEM		6
+#define DAEMON_INVALIDATE	7
+#define DAEMON_BATCH		8
+#define DAEMON_AUTH		9
+
+/* Request flags. DAEMON_COMPRESS sends each GETMEM chunk as a block
+ * from compress_block(). DAEMON_ON_PROC makes GETMEM and PUTMEM use
+ * the ADU of the first selected processor rather than the one owning
+ * the memory. DAEMON_IF_OK skips a BATCH, failing it, if the previous
+ * BATCH on the connection failed so pipelined batches stop at the
+ * first error. */
+#define DAEMON_COMPRESS		0x1
+#define DAEMON_ON_PROC		0x2
+#define DAEMON_IF_OK		0x4
+
+#define DAEMON_END		0xffffffff
+#define DAEMON_MAX_PUTMEM	(64 * 1024)
+#define DAEMON_MAX_GETMEM	(64 * 1024)
+#define DAEMON_MAX_BATCH	256
+
+/* Default TCP port when an address only gives a host */
+#define DAEMON_PORT		"6543"
+
+/* TCP has no way of telling who is connecting so the daemon and its
+ * clients share a token, given in this environment variable */
+#define DAEMON_TOKEN_ENV	"PDBG_TOKEN"
+#define DAEMON_MAX_TOKEN	256
+
+struct daemon_req {
+	uint16_t op;
+	uint16_t flags;
+	uint32_t procs;		/* bitmask of processor indexes */
+	uint64_t addr;
+	uint64_t data;
+	uint64_t mask;
+};
+
+struct daemon_resp {
+	int32_t rc;
+	uint32_t index;
+	uint64_t data;
+};
+
+struct daemon_pib_op {
+	uint8_t type;		/* enum pib_op_type */
+	uint8_t reserved[7];
+	uint64_t addr;
+	uint64_t data;
+	uint64_t mask;
+	uint64_t value;
+};
+
+/* Addresses containing a '/' are UNIX socket paths, anything else is
+ * [host][:port] for TCP. The host defaults to the loopback interface
+ * and the port to DAEMON_PORT. */
+int remote_getaddrinfo(const char *addr, struct addrinfo **res);
+int remote_connect(const char *addr);
+
+int remote_send_all(int fd, const void *buf, size_t size);
+int remote_recv_all(int fd, void *buf, size_t size);
+int remote_send_req(int fd, struct daemon_req *req);
+int remote_recv_req(int fd, struct daemon_req *req);
+int remote_send_resp(int fd, int32_t rc, uint32_t index, uint64_t data);
+int remote_recv_resp(int fd, struct daemon_resp *resp);
+int remote_send_ops(int fd, struct pib_op *ops, int count);
+int remote_recv_ops(int fd, struct pib_op *ops, int count);
+
+#endif
@@ -0,0 +1,939 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "bitutils.h"
+#include "operations.h"
+#include "target.h"
+
+/* A register level model of POWER8 and POWER9 processors so pdbg can be
+ * run and measured without hardware. SCOM registers nobody models hold
+ * whatever was last written to them. On top of that the ADU, RAM mode,
+ * thread start/stop/quiesce, special wakeup and HTM registers behave
+ * enough like the hardware for the code driving them to work. The
+ * models are placed where the device tree puts the cores, ADU and HTMs
+ * below each sim pib. All processors share one sparse memory. */
+
+/* Indirect SCOMs */
+#define PIB_IND_READ		PPC_BIT(0)
+#define PIB_IND_ADDR		PPC_BITMASK(12, 31)
+#define PIB_IND_DATA		PPC_BITMASK(48, 63)
+#define PIB_DATA_IND_COMPLETE	PPC_BIT(32)
+
+/* Chip id register, also readable through the CFAM */
+#define CHIP_ID_REG		0xf000f
+#define CFAM_CHIP_ID_REG	0xc09
+#define P8_CHIP_ID		0x220ea049
+#define P9_CHIP_ID		0x220d1049
+
+/* ADU registers, relative to the ADU */
+#define ALTD_CONTROL_REG	0x0
+#define ALTD_CMD_REG		0x1
+#define P8_ALTD_STATUS_REG	0x2
+#define P8_ALTD_DATA_REG	0x3
+#define P9_ALTD_STATUS_REG	0x3
+#define P9_ALTD_DATA_REG	0x4
+#define ALTD_NR_REGS		5
+#define  FBC_ALTD_START_OP	PPC_BIT(2)
+#define  FBC_ALTD_CLEAR_STATUS	PPC_BIT(3)
+#define  FBC_ALTD_RESET_AD_PCB	PPC_BIT(4)
+#define  FBC_ALTD_AUTO_INC	PPC_BIT(19)
+#define  P9_TTYPE_TREAD		PPC_BIT(5)
+#define  P9_FBC_ALTD_TSIZE	PPC_BITMASK(32, 39)
+#define  P9_FBC_ALTD_ADDRESS	PPC_BITMASK(8, 63)
+#define  P8_TTYPE_TREAD		PPC_BIT(6)
+#define  P8_FBC_ALTD_TSIZE	PPC_BITMASK(7, 13)
+#define  P8_FBC_ALTD_ADDRESS	PPC_BITMASK(14, 63)
+#define  FBC_ALTD_ADDR_DONE	PPC_BIT(2)
+#define  FBC_ALTD_DATA_DONE	PPC_BIT(3)
+
+/* HTM registers, relative to the HTM */
+#define HTM_MEMORY_CONF		1
+#define  HTM_MEM_ALLOC		PPC_BIT(0)
+#define  HTM_MEM_BASE		PPC_BITMASK(8, 39)
+#define HTM_STATUS		2
+#define  HTM_STATUS_READY	PPC_BIT(10)
+#define  HTM_STATUS_TRACING	PPC_BIT(11)
+#define  HTM_STATUS_PAUSED	PPC_BIT(12)
+#define  HTM_STATUS_COMPLETE	PPC_BIT(14)
+#define HTM_LAST_ADDRESS	3
+#define HTM_SCOM_TRIGGER	4
+#define  HTM_TRIG_START		PPC_BIT(0)
+#define  HTM_TRIG_STOP		PPC_BIT(1)
+#define  HTM_TRIG_PAUSE		PPC_BIT(2)
+#define  HTM_TRIG_RESET		PPC_BIT(4)
+#define HTM_FLEX_MUX		9
+#define  HTM_FLEX_MUX_MASK	PPC_BITMASK(0, 35)
+#define  HTM_FLEX_DEFAULT	0xCB3456129
+#define HTM_NR_REGS		10
+
+/* POWER8 core registers, relative to the core */
+#define P8_RAS_STATUS_REG	0x2
+#define P8_THREAD_REGS		0x13000
+#define P8_THREAD_REGS_SIZE	0x10
+#define  P8_DIRECT_CONTROLS_REG	0x0
+#define   DIRECT_CONTROL_SP_STEP	PPC_BIT(61)
+#define   DIRECT_CONTROL_SP_START	PPC_BIT(62)
+#define   DIRECT_CONTROL_SP_STOP	PPC_BIT(63)
+#define  P8_THREAD_RAS_STATUS_REG	0x2
+#define   RAS_STATUS_SRQ_EMPTY		PPC_BIT(8)
+#define   RAS_STATUS_LSU_QUIESCED	PPC_BIT(9)
+#define   RAS_STATUS_INST_COMPLETE	PPC_BIT(12)
+#define   RAS_STATUS_THREAD_ACTIVE	PPC_BIT(48)
+#define   RAS_STATUS_TS_QUIESCE		PPC_BIT(49)
+#define P8_SCR0_REG		0x13283
+#define P8_RAM_MODE_REG		0x13c00
+#define P8_RAM_CTRL_REG		0x13c01
+#define  P8_RAM_THREAD_SELECT	PPC_BITMASK(0, 2)
+#define  P8_RAM_INSTR		PPC_BITMASK(3, 34)
+#define P8_RAM_STATUS_REG	0x13c02
+#define P8_SCOM_EX_GP3		0xf0012
+#define P8_PMSPCWKUPFSP_REG	0xf010d
+#define P8_EX_PM_GP0_REG	0xf0100
+#define  P8_SPECIAL_WKUP_DONE	PPC_BIT(31)
+
+/* POWER9 core registers, relative to the core */
+#define P9_RAS_STATUS		0x10a02
+#define P9_DIRECT_CONTROL	0x10a9c
+#define P9_RAM_MODEREG		0x10a4e
+#define P9_RAM_CTRL		0x10a4f
+#define  P9_RAM_THREAD_SELECT	PPC_BITMASK(0, 1)
+#define  P9_RAM_PREDECODE	PPC_BITMASK(2, 5)
+#define  P9_RAM_INSTR		PPC_BITMASK(8, 39)
+#define P9_RAM_STATUS		0x10a50
+#define P9_SCR0_REG		0x10a86
+#define P9_NET_CTRL0		0xf0040
+#define  NET_CTRL0_CHIPLET_ENABLE	PPC_BIT(0)
+#define P9_PPM_GPMMR		0xf0100
+#define P9_PPM_SPWKUP_OTR	0xf010a
+#define  P9_SPECIAL_WKUP_DONE	PPC_BIT(1)
+
+#define CORE_REGS_SIZE		0x100000
+
+#define RAM_STATUS_DONE		PPC_BIT(1)
+#define RAM_STATUS_EXCEPTION	(PPC_BIT(2) | PPC_BIT(3))
+
+/* RAM mode sets SPRC up so SPR 277 is the core's SCR0 */
+#define SPR_SCRATCH		277
+#define NR_SPRS			1024
+
+#define LD_PRIMARY		58
+#define P9_MFNIA_PREDECODE	2
+#define SRESET_VECTOR		0x100
+
+#define SIM_PAGE_SIZE		0x10000
+
+/* Open addressed hash table of 64-bit keys and values */
+struct sim_map {
+	uint64_t *keys;
+	uint64_t *vals;
+	uint8_t *used;
+	size_t size;
+	size_t nr;
+};
+
+struct sim_thread {
+	bool quiesced;
+	bool stepped;
+	uint64_t gpr[32];
+	uint64_t msr;
+	uint64_t nia;
+	uint64_t *sprs;
+};
+
+struct sim_core {
+	uint64_t base;
+	int nr_threads;
+	struct sim_thread threads[THREADS_PER_CORE];
+	bool ram_mode;
+	uint64_t ram_status;
+	uint64_t scr0;
+	bool spwkup;
+};
+
+struct sim_adu {
+	uint64_t base;
+	uint64_t control;
+	uint64_t cmd;
+	uint64_t status;
+	uint64_t data;
+	uint64_t addr;
+	bool auto_inc;
+};
+
+struct sim_htm {
+	uint64_t base;
+	uint64_t regs[HTM_NR_REGS];
+};
+
+struct sim_chip {
+	pthread_mutex_t lock;
+	bool p9;
+	struct sim_map regs;
+	struct sim_map indirect;
+	struct sim_map cfam;
+	struct sim_core *cores;
+	int nr_cores;
+	struct sim_adu *adus;
+	int nr_adus;
+	struct sim_htm *htms;
+	int nr_htms;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct sim_map pages;
+} sim_mem = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t sim_hash(uint64_t key, size_t size)
+{
+	return (key * 0x9e3779b97f4a7c15ULL) >> 32 & (size - 1);
+}
+
+static int sim_map_grow(struct sim_map *map)
+{
+	struct sim_map new = { .size = map->size ? map->size * 2 : 64 };
+	size_t i, j;
+
+	new.keys = calloc(new.size, sizeof(*new.keys));
+	new.vals = calloc(new.size, sizeof(*new.vals));
+	new.used = calloc(new.size, sizeof(*new.used));
+	if (!new.keys || !new.vals || !new.used) {
+		free(new.keys);
+		free(new.vals);
+		free(new.used);
+		return -1;
+	}
+
+	for (i = 0; i < map->size; i++) {
+		if (!map->used[i])
+			continue;
+
+		for (j = sim_hash(map->keys[i], new.size); new.used[j]; j = (j + 1) & (new.size - 1));
+		new.keys[j] = map->keys[i];
+		new.vals[j] = map->vals[i];
+		new.used[j] = 1;
+	}
+	new.nr = map->nr;
+
+	free(map->keys);
+	free(map->vals);
+	free(map->used);
+	*map = new;
+
+	return 0;
+}
+
+/* Returns the value stored for key, adding it as 0 if create is set,
+ * or NULL if it isn't there */
+static uint64_t *sim_map_find(struct sim_map *map, uint64_t key, bool create)
+{
+	size_t i;
+
+	if (map->size) {
+		for (i = sim_hash(key, map->size); map->used[i]; i = (i + 1) & (map->size - 1))
+			if (map->keys[i] == key)
+				return &map->vals[i];
+	}
+
+	if (!create)
+		return NULL;
+
+	/* Keep the table at most half full */
+	if (2 * (map->nr + 1) > map->size && sim_map_grow(map))
+		return NULL;
+
+	for (i = sim_hash(key, map->size); map->used[i]; i = (i + 1) & (map->size - 1));
+	map->keys[i] = key;
+	map->vals[i] = 0;
+	map->used[i] = 1;
+	map->nr++;
+
+	return &map->vals[i];
+}
+
+static uint64_t sim_map_get(struct sim_map *map, uint64_t key)
+{
+	uint64_t *val = sim_map_find(map, key, false);
+
+	return val ? *val : 0;
+}
+
+static void sim_map_set(struct sim_map *map, uint64_t key, uint64_t val)
+{
+	uint64_t *slot = sim_map_find(map, key, true);
+
+	if (slot)
+		*slot = val;
+}
+
+static void sim_map_free(struct sim_map *map)
+{
+	free(map->keys);
+	free(map->vals);
+	free(map->used);
+}
+
+/* Memory is allocated a page at a time on first write and reads as
+ * zero until then */
+static void sim_mem_access(uint64_t addr, uint8_t *buf, size_t size, bool write)
+{
+	uint64_t *page, offset;
+	size_t len;
+	uint8_t *p;
+
+	pthread_mutex_lock(&sim_mem.lock);
+	while (size) {
+		offset = addr % SIM_PAGE_SIZE;
+		len = SIM_PAGE_SIZE - offset < size ? SIM_PAGE_SIZE - offset : size;
+
+		page = sim_map_find(&sim_mem.pages, addr / SIM_PAGE_SIZE, write);
+		p = page ? (uint8_t *) (uintptr_t) *page : NULL;
+		if (write && page && !p) {
+			p = calloc(1, SIM_PAGE_SIZE);
+			*page = (uintptr_t) p;
+		}
+
+		if (p && write)
+			memcpy(p + offset, buf, len);
+		else if (p)
+			memcpy(buf, p + offset, len);
+		else if (!write)
+			memset(buf, 0, len);
+
+		addr += len;
+		buf += len;
+		size -= len;
+	}
+	pthread_mutex_unlock(&sim_mem.lock);
+}
+
+static uint64_t sim_mem_read_word(uint64_t addr)
+{
+	uint64_t val;
+
+	sim_mem_access(addr, (uint8_t *) &val, sizeof(val), false);
+
+	return be64toh(val);
+}
+
+/* The ADU and RAM mode see memory as big-endian words */
+static void sim_mem_write_word(uint64_t addr, uint64_t data, int size)
+{
+	uint64_t val = htobe64(data);
+
+	if (!size || size > 8)
+		size = 8;
+
+	sim_mem_access(addr, ((uint8_t *) &val) + addr % 8, size, true);
+}
+
+static struct sim_chip *sim_chip(struct pib *pib)
+{
+	return pib->priv;
+}
+
+static void sim_adu_run(struct sim_chip *chip, struct sim_adu *adu)
+{
+	bool read;
+	int tsize;
+
+	if (chip->p9) {
+		read = adu->cmd & P9_TTYPE_TREAD;
+		tsize = GETFIELD(P9_FBC_ALTD_TSIZE, adu->cmd) >> 1;
+	} else {
+		read = adu->control & P8_TTYPE_TREAD;
+		tsize = GETFIELD(P8_FBC_ALTD_TSIZE, adu->control);
+	}
+
+	if (read)
+		adu->data = sim_mem_read_word(adu->addr & ~7ULL);
+	else
+		sim_mem_write_word(adu->addr, adu->data, tsize);
+
+	adu->status = FBC_ALTD_ADDR_DONE | FBC_ALTD_DATA_DONE;
+}
+
+static bool sim_adu_reading(struct sim_chip *chip, struct sim_adu *adu)
+{
+	return chip->p9 ? adu->cmd & P9_TTYPE_TREAD : adu->control & P8_TTYPE_TREAD;
+}
+
+static void sim_adu_read(struct sim_chip *chip, struct sim_adu *adu, uint64_t reg, uint64_t *val)
+{
+	uint64_t status_reg = chip->p9 ? P9_ALTD_STATUS_REG : P8_ALTD_STATUS_REG;
+	uint64_t data_reg = chip->p9 ? P9_ALTD_DATA_REG : P8_ALTD_DATA_REG;
+
+	if (reg == ALTD_CONTROL_REG)
+		*val = adu->control;
+	else if (reg == ALTD_CMD_REG)
+		*val = adu->cmd;
+	else if (reg == status_reg)
+		*val = adu->status;
+	else if (reg == data_reg) {
+		*val = adu->data;
+
+		/* Reading the data starts the next auto-increment read */
+		if (adu->auto_inc && sim_adu_reading(chip, adu)) {
+			adu->addr += 8;
+			sim_adu_run(chip, adu);
+		}
+	} else
+		*val = 0;
+}
+
+static void sim_adu_write(struct sim_chip *chip, struct sim_adu *adu, uint64_t reg, uint64_t val)
+{
+	uint64_t data_reg = chip->p9 ? P9_ALTD_DATA_REG : P8_ALTD_DATA_REG;
+
+	if (reg == ALTD_CONTROL_REG)
+		adu->control = val;
+	else if (reg == ALTD_CMD_REG) {
+		/* Start, clear and reset act once rather than being held */
+		adu->cmd = val & ~(FBC_ALTD_START_OP | FBC_ALTD_CLEAR_STATUS | FBC_ALTD_RESET_AD_PCB);
+		adu->auto_inc = false;
+
+		if (val & (FBC_ALTD_CLEAR_STATUS | FBC_ALTD_RESET_AD_PCB))
+			adu->status = 0;
+
+		if (val & FBC_ALTD_START_OP) {
+			adu->addr = chip->p9 ? GETFIELD(P9_FBC_ALTD_ADDRESS, adu->control) :
+				GETFIELD(P8_FBC_ALTD_ADDRESS, adu->control);
+			adu->auto_inc = !!(val & FBC_ALTD_AUTO_INC);
+			sim_adu_run(chip, adu);
+		}
+	} else if (reg == data_reg) {
+		adu->data = val;
+
+		/* Writing the data starts the next auto-increment write */
+		if (adu->auto_inc && !sim_adu_reading(chip, adu)) {
+			adu->addr += 8;
+			sim_adu_run(chip, adu);
+		}
+	}
+}
+
+static void sim_htm_write(struct sim_htm *htm, uint64_t reg, uint64_t val)
+{
+	uint64_t *status = &htm->regs[HTM_STATUS];
+
+	if (reg != HTM_SCOM_TRIGGER) {
+		htm->regs[reg] = val;
+		return;
+	}
+
+	if ((val & HTM_TRIG_RESET) && (htm->regs[HTM_MEMORY_CONF] & HTM_MEM_ALLOC))
+		*status = HTM_STATUS_READY;
+
+	if ((val & HTM_TRIG_START) && (*status & (HTM_STATUS_READY | HTM_STATUS_PAUSED))) {
+		*status = HTM_STATUS_TRACING;
+		htm->regs[HTM_LAST_ADDRESS] = htm->regs[HTM_MEMORY_CONF] & HTM_MEM_BASE;
+	}
+
+	if ((val & HTM_TRIG_PAUSE) && (*status & HTM_STATUS_TRACING))
+		*status = HTM_STATUS_PAUSED;
+
+	if ((val & HTM_TRIG_STOP) && (*status & (HTM_STATUS_TRACING | HTM_STATUS_PAUSED)))
+		*status = HTM_STATUS_COMPLETE;
+}
+
+static uint64_t sim_spr_read(struct sim_core *core, struct sim_thread *thread, int spr)
+{
+	if (spr == SPR_SCRATCH)
+		return core->scr0;
+
+	return thread->sprs ? thread->sprs[spr] : 0;
+}
+
+static void sim_spr_write(struct sim_core *core, struct sim_thread *thread, int spr, uint64_t val)
+{
+	if (spr == SPR_SCRATCH) {
+		core->scr0 = val;
+		return;
+	}
+
+	if (!thread->sprs)
+		thread->sprs = calloc(NR_SPRS, sizeof(*thread->sprs));
+	if (thread->sprs)
+		thread->sprs[spr] = val;
+}
+
+/* Execute a RAMed instruction, covering what chip.c generates */
+static void sim_ram(struct sim_core *core, int tid, uint32_t opcode, int predecode)
+{
+	struct sim_thread *thread = &core->threads[tid];
+	int rt = (opcode >> 21) & 0x1f;
+	int ra = (opcode >> 16) & 0x1f;
+	int spr = ((opcode >> 16) & 0x1f) | ((opcode >> 6) & 0x3e0);
+	int64_t ds;
+
+	core->ram_status = RAM_STATUS_EXCEPTION;
+	if (!core->ram_mode || tid >= core->nr_threads || !thread->quiesced)
+		return;
+
+	if (predecode == P9_MFNIA_PREDECODE) {
+		thread->gpr[rt] = thread->nia;
+		core->ram_status = RAM_STATUS_DONE;
+		return;
+	}
+
+	if (opcode >> 26 == LD_PRIMARY && !(opcode & 3)) {
+		ds = (int16_t) (opcode & 0xfffc);
+		thread->gpr[rt] = sim_mem_read_word((ra ? thread->gpr[ra] : 0) + ds);
+		core->ram_status = RAM_STATUS_DONE;
+		return;
+	}
+
+	switch (opcode & OPCODE_MASK) {
+	case MFNIA_OPCODE:
+		thread->gpr[rt] = thread->nia;
+		break;
+
+	case MTNIA_OPCODE:
+		thread->nia = thread->gpr[rt];
+		break;
+
+	case MFMSR_OPCODE:
+		thread->gpr[rt] = thread->msr;
+		break;
+
+	case MTMSR_OPCODE:
+		thread->msr = thread->gpr[rt];
+		break;
+
+	case MFSPR_OPCODE:
+		thread->gpr[rt] = sim_spr_read(core, thread, spr);
+		break;
+
+	case MTSPR_OPCODE:
+		sim_spr_write(core, thread, spr, thread->gpr[rt]);
+		break;
+
+	default:
+		return;
+	}
+
+	core->ram_status = RAM_STATUS_DONE;
+}
+
+static uint64_t sim_p8_ras_status(struct sim_thread *thread)
+{
+	uint64_t val = RAS_STATUS_THREAD_ACTIVE;
+
+	if (thread->quiesced)
+		val |= RAS_STATUS_SRQ_EMPTY | RAS_STATUS_LSU_QUIESCED | RAS_STATUS_TS_QUIESCE;
+	if (thread->stepped)
+		val |= RAS_STATUS_INST_COMPLETE;
+
+	return val;
+}
+
+/* Returns true if the register is modelled, otherwise it comes from
+ * the register file */
+static bool sim_p8_core_read(struct sim_core *core, uint64_t reg, uint64_t *val)
+{
+	int i, tid = (reg - P8_THREAD_REGS) / P8_THREAD_REGS_SIZE;
+
+	if (reg >= P8_THREAD_REGS && tid < core->nr_threads) {
+		if ((reg - P8_THREAD_REGS) % P8_THREAD_REGS_SIZE != P8_THREAD_RAS_STATUS_REG)
+			return false;
+
+		*val = sim_p8_ras_status(&core->threads[tid]);
+		return true;
+	}
+
+	switch (reg) {
+	case P8_RAS_STATUS_REG:
+		*val = 0;
+		for (i = 0; i < core->nr_threads; i++)
+			*val |= sim_p8_ras_status(&core->threads[i]);
+		return true;
+
+	case P8_SCOM_EX_GP3:
+		*val = PPC_BIT(0);
+		return true;
+
+	case P8_EX_PM_GP0_REG:
+		*val = core->spwkup ? P8_SPECIAL_WKUP_DONE : 0;
+		return true;
+
+	case P8_RAM_MODE_REG:
+		*val = core->ram_mode ? PPC_BIT(0) : 0;
+		return true;
+
+	case P8_RAM_STATUS_REG:
+		*val = core->ram_status;
+		return true;
+
+	case P8_SCR0_REG:
+		*val = core->scr0;
+		return true;
+	}
+
+	return false;
+}
+
+static bool sim_p8_core_write(struct sim_core *core, uint64_t reg, uint64_t val)
+{
+	int tid = (reg - P8_THREAD_REGS) / P8_THREAD_REGS_SIZE;
+	struct sim_thread *thread;
+
+	if (reg >= P8_THREAD_REGS && tid < core->nr_threads) {
+		if ((reg - P8_THREAD_REGS) % P8_THREAD_REGS_SIZE != P8_DIRECT_CONTROLS_REG)
+			return false;
+
+		thread = &core->threads[tid];
+		if (val & DIRECT_CONTROL_SP_STOP)
+			thread->quiesced = true;
+		if (val & DIRECT_CONTROL_SP_START) {
+			thread->quiesced = false;
+			thread->stepped = false;
+		}
+		if ((val & DIRECT_CONTROL_SP_STEP) && thread->quiesced) {
+			thread->nia += 4;
+			thread->stepped = true;
+		}
+		return true;
+	}
+
+	switch (reg) {
+	case P8_PMSPCWKUPFSP_REG:
+		core->spwkup = !!(val & PPC_BIT(0));
+		return false;
+
+	case P8_RAM_MODE_REG:
+		core->ram_mode = !!(val & PPC_BIT(0));
+		return true;
+
+	case P8_RAM_CTRL_REG:
+		sim_ram(core, GETFIELD(P8_RAM_THREAD_SELECT, val), GETFIELD(P8_RAM_INSTR, val), 0);
+		return true;
+
+	case P8_SCR0_REG:
+		core->scr0 = val;
+		return true;
+	}
+
+	return false;
+}
+
+static bool sim_p9_core_read(struct sim_core *core, uint64_t reg, uint64_t *val)
+{
+	int i;
+
+	switch (reg) {
+	case P9_RAS_STATUS:
+		*val = 0;
+		for (i = 0; i < core->nr_threads; i++)
+			if (core->threads[i].quiesced)
+				*val = SETFIELD(PPC_BITMASK(8*i, 3 + 8*i), *val, 0xf);
+		return true;
+
+	case P9_NET_CTRL0:
+		*val = NET_CTRL0_CHIPLET_ENABLE;
+		return true;
+
+	case P9_PPM_GPMMR:
+		*val = core->spwkup ? P9_SPECIAL_WKUP_DONE : 0;
+		return true;
+
+	case P9_RAM_MODEREG:
+		*val = core->ram_mode ? PPC_BIT(0) : 0;
+		return true;
+
+	case P9_RAM_STATUS:
+		*val = core->ram_status;
+		return true;
+
+	case P9_SCR0_REG:
+		*val = core->scr0;
+		return true;
+	}
+
+	return false;
+}
+
+static bool sim_p9_core_write(struct sim_core *core, uint64_t reg, uint64_t val)
+{
+	struct sim_thread *thread;
+	int i;
+
+	switch (reg) {
+	case P9_DIRECT_CONTROL:
+		for (i = 0; i < core->nr_threads; i++) {
+			thread = &core->threads[i];
+			if (val & PPC_BIT(7 + 8*i))
+				thread->quiesced = true;
+			if (val & PPC_BIT(6 + 8*i))
+				thread->quiesced = false;
+			if ((val & PPC_BIT(4 + 8*i)) && thread->quiesced) {
+				thread->nia = SRESET_VECTOR;
+				thread->quiesced = false;
+			}
+		}
+		return true;
+
+	case P9_PPM_SPWKUP_OTR:
+		core->spwkup = !!(val & PPC_BIT(0));
+		return false;
+
+	case P9_RAM_MODEREG:
+		core->ram_mode = !!(val & PPC_BIT(0));
+		return true;
+
+	case P9_RAM_CTRL:
+		sim_ram(core, GETFIELD(P9_RAM_THREAD_SELECT, val), GETFIELD(P9_RAM_INSTR, val),
+			GETFIELD(P9_RAM_PREDECODE, val));
+		return true;
+
+	case P9_SCR0_REG:
+		core->scr0 = val;
+		return true;
+	}
+
+	return false;
+}
+
+/* Indirect SCOMs are recognised by the write having the indirect
+ * address or read bit set. The completed access reads back from the
+ * same register. */
+static bool sim_indirect_write(struct sim_chip *chip, uint64_t addr, uint64_t val)
+{
+	uint64_t key;
+
+	if (!(val & (PIB_IND_READ | PIB_IND_ADDR)))
+		return false;
+
+	key = addr << 32 | GETFIELD(PIB_IND_ADDR, val);
+	if (!(val & PIB_IND_READ))
+		sim_map_set(&chip->indirect, key, val & PIB_IND_DATA);
+	sim_map_set(&chip->regs, addr, PIB_DATA_IND_COMPLETE |
+		    (sim_map_get(&chip->indirect, key) & PIB_IND_DATA));
+
+	return true;
+}
+
+static int sim_pib_read(struct pib *pib, uint64_t addr, uint64_t *value)
+{
+	struct sim_chip *chip = sim_chip(pib);
+	bool done = false;
+	int i;
+
+	pthread_mutex_lock(&chip->lock);
+	for (i = 0; i < chip->nr_adus && !done; i++)
+		if (addr - chip->adus[i].base < ALTD_NR_REGS) {
+			sim_adu_read(chip, &chip->adus[i], addr - chip->adus[i].base, value);
+			done = true;
+		}
+
+	for (i = 0; i < chip->nr_htms && !done; i++)
+		if (addr - chip->htms[i].base < HTM_NR_REGS) {
+			*value = chip->htms[i].regs[addr - chip->htms[i].base];
+			done = true;
+		}
+
+	for (i = 0; i < chip->nr_cores && !done; i++)
+		if (addr - chip->cores[i].base < CORE_REGS_SIZE)
+			done = chip->p9 ?
+				sim_p9_core_read(&chip->cores[i], addr - chip->cores[i].base, value) :
+				sim_p8_core_read(&chip->cores[i], addr - chip->cores[i].base, value);
+
+	if (!done)
+		*value = sim_map_get(&chip->regs, addr);
+	pthread_mutex_unlock(&chip->lock);
+
+	return 0;
+}
+
+static int sim_pib_write(struct pib *pib, uint64_t addr, uint64_t value)
+{
+	struct sim_chip *chip = sim_chip(pib);
+	bool done = false;
+	int i;
+
+	pthread_mutex_lock(&chip->lock);
+	for (i = 0; i < chip->nr_adus && !done; i++)
+		if (addr - chip->adus[i].base < ALTD_NR_REGS) {
+			sim_adu_write(chip, &chip->adus[i], addr - chip->adus[i].base, value);
+			done = true;
+		}
+
+	for (i = 0; i < chip->nr_htms && !done; i++)
+		if (addr - chip->htms[i].base < HTM_NR_REGS) {
+			sim_htm_write(&chip->htms[i], addr - chip->htms[i].base, value);
+			done = true;
+		}
+
+	for (i = 0; i < chip->nr_cores && !done; i++)
+		if (addr - chip->cores[i].base < CORE_REGS_SIZE)
+			done = chip->p9 ?
+				sim_p9_core_write(&chip->cores[i], addr - chip->cores[i].base, value) :
+				sim_p8_core_write(&chip->cores[i], addr - chip->cores[i].base, value);
+
+	if (!done && !sim_indirect_write(chip, addr, value))
+		sim_map_set(&chip->regs, addr, value);
+	pthread_mutex_unlock(&chip->lock);
+
+	return 0;
+}
+
+static void *sim_add(void **array, int *nr, size_t size)
+{
+	void *tmp = realloc(*array, (*nr + 1) * size);
+
+	if (!tmp)
+		return NULL;
+	*array = tmp;
+	memset((char *) tmp + *nr * size, 0, size);
+
+	return (char *) tmp + (*nr)++ * size;
+}
+
+static void sim_chip_free(struct sim_chip *chip)
+{
+	int i, j;
+
+	for (i = 0; i < chip->nr_cores; i++)
+		for (j = 0; j < THREADS_PER_CORE; j++)
+			free(chip->cores[i].threads[j].sprs);
+	free(chip->cores);
+	free(chip->adus);
+	free(chip->htms);
+	sim_map_free(&chip->regs);
+	sim_map_free(&chip->indirect);
+	sim_map_free(&chip->cfam);
+	pthread_mutex_destroy(&chip->lock);
+	free(chip);
+}
+
+/* Put the models where the device tree has the units they stand in
+ * for */
+static int sim_pib_probe(struct target *target)
+{
+	struct pib *pib = target_to_pib(target);
+	struct sim_chip *chip;
+	struct sim_core *core;
+	struct sim_adu *adu;
+	struct sim_htm *htm;
+	struct dt_node *dn, *child;
+
+	/* Probing again keeps the simulated state */
+	if (pib->priv)
+		return 0;
+
+	chip = calloc(1, sizeof(*chip));
+	if (!chip)
+		return -1;
+	pthread_mutex_init(&chip->lock, NULL);
+
+	dt_for_each_node(target->dn, dn) {
+		if (dt_node_is_compatible(dn, "ibm,power8-core") ||
+		    dt_node_is_compatible(dn, "ibm,power9-core")) {
+			core = sim_add((void **) &chip->cores, &chip->nr_cores, sizeof(*core));
+			if (!core)
+				goto fail;
+
+			core->base = dt_get_address(dn, 0, NULL);
+			dt_for_each_child(dn, child)
+				if (core->nr_threads < THREADS_PER_CORE)
+					core->nr_threads++;
+		} else if (dt_node_is_compatible(dn, "ibm,power8-adu") ||
+			   dt_node_is_compatible(dn, "ibm,power9-adu")) {
+			chip->p9 = dt_node_is_compatible(dn, "ibm,power9-adu");
+			adu = sim_add((void **) &chip->adus, &chip->nr_adus, sizeof(*adu));
+			if (!adu)
+				goto fail;
+
+			adu->base = dt_get_address(dn, 0, NULL);
+		} else if (dt_node_is_compatible(dn, "ibm,htm")) {
+			htm = sim_add((void **) &chip->htms, &chip->nr_htms, sizeof(*htm));
+			if (!htm)
+				goto fail;
+
+			htm->base = dt_get_address(dn, 0, NULL);
+			htm->regs[HTM_FLEX_MUX] = SETFIELD(HTM_FLEX_MUX_MASK, 0ULL, HTM_FLEX_DEFAULT);
+		}
+	}
+
+	sim_map_set(&chip->regs, CHIP_ID_REG, (uint64_t) (chip->p9 ? P9_CHIP_ID : P8_CHIP_ID) << 32);
+	sim_map_set(&chip->cfam, CFAM_CHIP_ID_REG, chip->p9 ? P9_CHIP_ID : P8_CHIP_ID);
+	pib->priv = chip;
+
+	return 0;
+
+fail:
+	sim_chip_free(chip);
+	return -1;
+}
+
+struct pib sim_pib = {
+	.target = {
+		.name = "Simulated PIB",
+		.compatible = "ibm,sim-pib",
+		.class = "pib",
+		.probe = sim_pib_probe,
+	},
+	.read = sim_pib_read,
+	.write = sim_pib_write,
+};
+DECLARE_HW_UNIT(sim_pib);
+
+/* The CFAM of a simulated processor is just a register file */
+static struct sim_chip *sim_fsi_chip(struct fsi *fsi)
+{
+	return sim_chip(target_to_pib(require_target_parent(&fsi->target)));
+}
+
+static int sim_fsi_read(struct fsi *fsi, uint32_t addr, uint32_t *value)
+{
+	struct sim_chip *chip = sim_fsi_chip(fsi);
+
+	pthread_mutex_lock(&chip->lock);
+	*value = sim_map_get(&chip->cfam, addr);
+	pthread_mutex_unlock(&chip->lock);
+
+	return 0;
+}
+
+static int sim_fsi_write(struct fsi *fsi, uint32_t addr, uint32_t value)
+{
+	struct sim_chip *chip = sim_fsi_chip(fsi);
+
+	pthread_mutex_lock(&chip->lock);
+	sim_map_set(&chip->cfam, addr, value);
+	pthread_mutex_unlock(&chip->lock);
+
+	return 0;
+}
+
+struct fsi sim_fsi = {
+	.target = {
+		.name = "Simulated FSI",
+		.compatible = "ibm,sim-fsi",
+		.class = "fsi",
+	},
+	.read = sim_fsi_read,
+	.write = sim_fsi_write,
+};
+DECLARE_HW_UNIT(sim_fsi);
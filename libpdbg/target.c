@@ -1,6 +1,13 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
 #include <assert.h>
+#include <pthread.h>
 #include <ccan/list/list.h>
 #include <libfdt/libfdt.h>
 
@@ -8,6 +15,7 @@
 #include "target.h"
 #include "device.h"
 #include "operations.h"
+#include "timing.h"
 
 #undef PR_DEBUG
 #define PR_DEBUG(...)
@@ -15,24 +23,59 @@
 struct list_head empty_list = LIST_HEAD_INIT(empty_list);
 struct list_head target_classes = LIST_HEAD_INIT(target_classes);
 
-/* Work out the address to access based on the current target and
- * final class name */
-static struct dt_node *get_class_target_addr(struct dt_node *dn, const char *name, uint64_t *addr)
+static const char *target_bus_class[TARGET_BUS_MAX] = {
+	[TARGET_BUS_PIB] = "pib",
+	[TARGET_BUS_OPB] = "opb",
+	[TARGET_BUS_FSI] = "fsi",
+};
+
+/* Work out where accesses of each bus class through the target go by
+ * walking up the tree translating addresses. Called once for every
+ * target from targets_init(). */
+static void target_resolve_paths(struct target *target)
 {
-	/* Check class */
-	while (strcmp(dn->target->class, name)) {
-		/* Keep walking the tree translating addresses */
-		*addr += dt_get_address(dn, 0, NULL);
-		dn = dn->parent;
+	struct dt_node *dn;
+	uint64_t offset;
+	int bus;
+
+	for (bus = 0; bus < TARGET_BUS_MAX; bus++) {
+		offset = 0;
+		for (dn = target->dn; dn && dn->target; dn = dn->parent) {
+			if (!strcmp(dn->target->class, target_bus_class[bus])) {
+				target->paths[bus].bus = dn->target;
+				target->paths[bus].offset = offset;
+				break;
+			}
+
+			/* Nodes without an address can't be passed through */
+			if (!dt_find_property(dn, "reg"))
+				break;
+			offset += dn->target->address;
+		}
+	}
+}
+
+/* Return the target accesses of the given bus class through target go
+ * to, translating addr for it, or NULL if the target isn't present */
+static struct target *get_class_target_addr(struct target *target, enum target_bus bus,
+					    uint64_t *addr)
+{
+	struct target_path *path = &target->paths[bus];
 
-		/* The should always be a parent. If there isn't it
-		 * means we traversed up the whole device tree and
-		 * didn't find a parent matching the given class. */
-		assert(dn);
-		assert(dn->target);
+	/* There should always be a target of the class above. If there
+	 * isn't the caller has asked for an access through the wrong
+	 * sort of target. */
+	assert(path->bus);
+
+	/* Targets are probed the first time they are used */
+	if (target_ensure_probed(target) != TARGET_PRESENT) {
+		PR_ERROR("%s is not present\n", target->dn->name);
+		return NULL;
 	}
 
-	return dn;
+	*addr += path->offset;
+
+	return path->bus;
 }
 
 /* The indirect access code was largely stolen from hw/xscom.c in skiboot */
@@ -45,6 +88,32 @@ static struct dt_node *get_class_target_addr(struct dt_node *dn, const char *nam
 #define PIB_DATA_IND_ERR PPC_BITMASK(33, 35)
 #define PIB_DATA_IND_DATA PPC_BITMASK(48, 63)
 
+/* Every call into a backend goes through these so the timing model
+ * sees it */
+static int pib_hw_read(struct pib *pib, uint64_t addr, uint64_t *data)
+{
+	int rc;
+
+	if (timing_begin())
+		timing_pib(&pib->target, 1, false);
+	rc = pib->read(pib, addr, data);
+	timing_end();
+
+	return rc;
+}
+
+static int pib_hw_write(struct pib *pib, uint64_t addr, uint64_t data)
+{
+	int rc;
+
+	if (timing_begin())
+		timing_pib(&pib->target, 1, false);
+	rc = pib->write(pib, addr, data);
+	timing_end();
+
+	return rc;
+}
+
 static int pib_indirect_read(struct pib *pib, uint64_t addr, uint64_t *data)
 {
 	uint64_t indirect_addr;
@@ -57,11 +126,11 @@ static int pib_indirect_read(struct pib *pib, uint64_t addr, uint64_t *data)
 
 	indirect_addr = addr & 0x7fffffff;
 	*data = PIB_IND_READ | (addr & PIB_IND_ADDR);
-	CHECK_ERR(pib->write(pib, indirect_addr, *data));
+	CHECK_ERR(pib_hw_write(pib, indirect_addr, *data));
 
 	/* Wait for completion */
 	for (retries = 0; retries < PIB_IND_MAX_RETRIES; retries++) {
-		CHECK_ERR(pib->read(pib, indirect_addr, data));
+		CHECK_ERR(pib_hw_read(pib, indirect_addr, data));
 
 		if ((*data & PIB_DATA_IND_COMPLETE) &&
 		    ((*data & PIB_DATA_IND_ERR) == 0)) {
@@ -92,11 +161,11 @@ static int pib_indirect_write(struct pib *pib, uint64_t addr, uint64_t data)
 	indirect_addr = addr & 0x7fffffff;
 	data &= PIB_IND_DATA;
 	data |= addr & PIB_IND_ADDR;
-	CHECK_ERR(pib->write(pib, indirect_addr, data));
+	CHECK_ERR(pib_hw_write(pib, indirect_addr, data));
 
 	/* Wait for completion */
 	for (retries = 0; retries < PIB_IND_MAX_RETRIES; retries++) {
-		CHECK_ERR(pib->read(pib, indirect_addr, &data));
+		CHECK_ERR(pib_hw_read(pib, indirect_addr, &data));
 
 		if ((data & PIB_DATA_IND_COMPLETE) &&
 		    ((data & PIB_DATA_IND_ERR) == 0))
@@ -112,86 +181,260 @@ static int pib_indirect_write(struct pib *pib, uint64_t addr, uint64_t data)
 	return 0;
 }
 
+/* Synchronous accesses are queued on the link like asynchronous ones
+ * (see pib_submit()) so they are serialised with everything else on
+ * the link */
 int pib_read(struct target *pib_dt, uint64_t addr, uint64_t *data)
 {
-	struct pib *pib;
-	struct dt_node *dn = pib_dt->dn;
+	struct pib_op op = { .type = PIB_OP_READ, .addr = addr };
 	int rc;
 
-	dn = get_class_target_addr(dn, "pib", &addr);
-	pib_dt = dn->target;
-	pib = target_to_pib(pib_dt);
-	if (addr & PPC_BIT(0))
-		rc = pib_indirect_read(pib, addr, data);
-	else
-		rc = pib->read(pib, addr, data);
+	rc = pib_batch(pib_dt, &op, 1);
+	*data = op.data;
+
 	return rc;
 }
 
 int pib_write(struct target *pib_dt, uint64_t addr, uint64_t data)
+{
+	struct pib_op op = { .type = PIB_OP_WRITE, .addr = addr, .data = data };
+
+	return pib_batch(pib_dt, &op, 1);
+}
+
+int pib_batch(struct target *pib_dt, struct pib_op *ops, int count)
+{
+	struct pib_req req = { .target = pib_dt, .ops = ops, .count = count };
+
+	pib_submit(&req);
+
+	return pib_wait(&req);
+}
+
+/* Run a single operation from a batch on the given pib. Backends
+ * implementing the batch hook can use this for any operations they
+ * can't combine. */
+int pib_run_op(struct pib *pib, struct pib_op *op)
+{
+	int (*read)(struct pib *, uint64_t, uint64_t *) = pib_hw_read;
+	int (*write)(struct pib *, uint64_t, uint64_t) = pib_hw_write;
+	uint64_t val;
+	int i;
+
+	if (op->addr & PPC_BIT(0)) {
+		read = pib_indirect_read;
+		write = pib_indirect_write;
+	}
+
+	switch (op->type) {
+	case PIB_OP_READ:
+		return read(pib, op->addr, &op->data);
+
+	case PIB_OP_WRITE:
+		return write(pib, op->addr, op->data);
+
+	case PIB_OP_RMW:
+		CHECK_ERR(read(pib, op->addr, &val));
+		op->data = (val & ~op->mask) | (op->data & op->mask);
+		return write(pib, op->addr, op->data);
+
+	case PIB_OP_POLL_EQ:
+	case PIB_OP_POLL_NE:
+		for (i = 0; i < PIB_POLL_MAX_READS; i++) {
+			CHECK_ERR(read(pib, op->addr, &op->data));
+			if (((op->data & op->mask) == op->value) == (op->type == PIB_OP_POLL_EQ))
+				return 0;
+		}
+
+		PR_ERROR("Timed out polling 0x%016" PRIx64 "\n", op->addr);
+		return -1;
+	}
+
+	return -1;
+}
+
+/* Run count operations in order, stopping at the first failure. The
+ * whole batch goes to the backend if it can take it, saving a walk of
+ * the tree and possibly round trips for each operation. Only called
+ * from the link's worker, everything else uses pib_batch(). */
+int __pib_batch(struct target *pib_dt, struct pib_op *ops, int count)
 {
 	struct pib *pib;
-	struct dt_node *dn = pib_dt->dn;
-	int rc;
+	uint64_t offset = 0;
+	bool indirect = false;
+	int i, nr_accesses, rc = 0;
 
-	dn = get_class_target_addr(dn, "pib", &addr);
-	pib_dt = dn->target;
+	pib_dt = get_class_target_addr(pib_dt, TARGET_BUS_PIB, &offset);
+	if (!pib_dt)
+		return -1;
 	pib = target_to_pib(pib_dt);
-	if (addr & PPC_BIT(0))
-		rc = pib_indirect_write(pib, addr, data);
+
+	for (i = 0; i < count; i++) {
+		ops[i].addr += offset;
+		if (ops[i].addr & PPC_BIT(0))
+			indirect = true;
+	}
+
+	/* The timing model charges for the batch as a whole, whether or
+	 * not this backend can combine it, so batching can be evaluated
+	 * against any backend. Read-modify-writes and indirect accesses
+	 * are two accesses and polls a single read. */
+	if (timing_begin()) {
+		for (i = 0, nr_accesses = count; i < count; i++)
+			if (ops[i].type == PIB_OP_RMW || (ops[i].addr & PPC_BIT(0)))
+				nr_accesses++;
+		timing_pib(&pib->target, nr_accesses, true);
+	}
+
+	if (pib->batch && !indirect)
+		rc = pib->batch(pib, ops, count);
 	else
-		rc = pib->write(pib, addr, data);
+		for (i = 0; i < count && !rc; i++)
+			rc = pib_run_op(pib, &ops[i]);
+	timing_end();
+
+	for (i = 0; i < count; i++)
+		ops[i].addr -= offset;
+
 	return rc;
 }
 
-int opb_read(struct target *opb_dt, uint32_t addr, uint32_t *data)
+static int __opb_read(struct target *opb_dt, uint32_t addr, uint32_t *data)
 {
 	struct opb *opb;
-	struct dt_node *dn = opb_dt->dn;
 	uint64_t addr64 = addr;
+	int rc;
 
-	dn = get_class_target_addr(dn, "opb", &addr64);
-	opb_dt = dn->target;
+	opb_dt = get_class_target_addr(opb_dt, TARGET_BUS_OPB, &addr64);
+	if (!opb_dt)
+		return -1;
 	opb = target_to_opb(opb_dt);
-	return opb->read(opb, addr64, data);
+	if (timing_begin())
+		timing_cfam(opb_dt);
+	rc = opb->read(opb, addr64, data);
+	timing_end();
+
+	return rc;
 }
 
-int opb_write(struct target *opb_dt, uint32_t addr, uint32_t data)
+static int __opb_write(struct target *opb_dt, uint32_t addr, uint32_t data)
 {
 	struct opb *opb;
-	struct dt_node *dn = opb_dt->dn;
 	uint64_t addr64 = addr;
+	int rc;
 
-	dn = get_class_target_addr(dn, "opb", &addr64);
-	opb_dt = dn->target;
+	opb_dt = get_class_target_addr(opb_dt, TARGET_BUS_OPB, &addr64);
+	if (!opb_dt)
+		return -1;
 	opb = target_to_opb(opb_dt);
+	if (timing_begin())
+		timing_cfam(opb_dt);
+	rc = opb->write(opb, addr64, data);
+	timing_end();
 
-	return opb->write(opb, addr64, data);
+	return rc;
 }
 
-int fsi_read(struct target *fsi_dt, uint32_t addr, uint32_t *data)
+static int __fsi_read(struct target *fsi_dt, uint32_t addr, uint32_t *data)
 {
 	struct fsi *fsi;
-	struct dt_node *dn = fsi_dt->dn;
 	uint64_t addr64 = addr;
+	int rc;
 
-	dn = get_class_target_addr(dn, "fsi", &addr64);
-	fsi_dt = dn->target;
+	fsi_dt = get_class_target_addr(fsi_dt, TARGET_BUS_FSI, &addr64);
+	if (!fsi_dt)
+		return -1;
 	fsi = target_to_fsi(fsi_dt);
-	return fsi->read(fsi, addr64, data);
+	if (timing_begin())
+		timing_cfam(fsi_dt);
+	rc = fsi->read(fsi, addr64, data);
+	timing_end();
+
+	return rc;
 }
 
-int fsi_write(struct target *fsi_dt, uint32_t addr, uint32_t data)
+static int __fsi_write(struct target *fsi_dt, uint32_t addr, uint32_t data)
 {
 	struct fsi *fsi;
-	struct dt_node *dn = fsi_dt->dn;
 	uint64_t addr64 = addr;
+	int rc;
 
-	dn = get_class_target_addr(dn, "fsi", &addr64);
-	fsi_dt = dn->target;
+	fsi_dt = get_class_target_addr(fsi_dt, TARGET_BUS_FSI, &addr64);
+	if (!fsi_dt)
+		return -1;
 	fsi = target_to_fsi(fsi_dt);
+	if (timing_begin())
+		timing_cfam(fsi_dt);
+	rc = fsi->write(fsi, addr64, data);
+	timing_end();
+
+	return rc;
+}
+
+/* OPB and FSI accesses are queued on the link too (see pib_read()) */
+struct bus_access {
+	struct pib_req req;
+	enum target_bus bus;
+	bool write;
+	uint32_t addr;
+	uint32_t data;
+};
+
+static int bus_access_run(struct pib_req *req)
+{
+	struct bus_access *access = container_of(req, struct bus_access, req);
+
+	if (access->bus == TARGET_BUS_OPB)
+		return access->write ?
+			__opb_write(req->target, access->addr, access->data) :
+			__opb_read(req->target, access->addr, &access->data);
+
+	return access->write ?
+		__fsi_write(req->target, access->addr, access->data) :
+		__fsi_read(req->target, access->addr, &access->data);
+}
+
+static int bus_access(struct target *target, enum target_bus bus, bool write,
+		      uint32_t addr, uint32_t *data)
+{
+	struct bus_access access = {
+		.req = { .target = target, .run = bus_access_run },
+		.bus = bus,
+		.write = write,
+		.addr = addr,
+		.data = *data,
+	};
+	int rc;
+
+	pib_submit(&access.req);
+	rc = pib_wait(&access.req);
+	*data = access.data;
+
+	return rc;
+}
+
+int opb_read(struct target *opb_dt, uint32_t addr, uint32_t *data)
+{
+	*data = 0;
+
+	return bus_access(opb_dt, TARGET_BUS_OPB, false, addr, data);
+}
+
+int opb_write(struct target *opb_dt, uint32_t addr, uint32_t data)
+{
+	return bus_access(opb_dt, TARGET_BUS_OPB, true, addr, &data);
+}
+
+int fsi_read(struct target *fsi_dt, uint32_t addr, uint32_t *data)
+{
+	*data = 0;
+
+	return bus_access(fsi_dt, TARGET_BUS_FSI, false, addr, data);
+}
 
-	return fsi->write(fsi, addr64, data);
+int fsi_write(struct target *fsi_dt, uint32_t addr, uint32_t data)
+{
+	return bus_access(fsi_dt, TARGET_BUS_FSI, true, addr, &data);
 }
 
 struct target *require_target_parent(struct target *target)
@@ -291,12 +534,19 @@ void targets_init(void *fdt)
 			dn->target = new_target;
 			index = dt_prop_get_u32_def(dn, "index", -1);
 			dn->target->index = index;
+			dn->target->cache_id = LINK_ID_NONE;
+			if (dt_find_property(dn, "reg"))
+				new_target->address = dt_get_address(dn, 0, NULL);
 			target_class = get_target_class(new_target->class);
 			list_add(&target_class->targets, &new_target->class_link);
 			PR_DEBUG("Found target %s for %s\n", new_target->name, dn->name);
 		} else
 			PR_DEBUG("No target found for %s\n", dn->name);
 	}
+
+	dt_for_each_node(dt_root, dn)
+		if (dn->target)
+			target_resolve_paths(dn->target);
 }
 
 /* Disable a node and all it's children */
@@ -314,39 +564,427 @@ static void disable_node(struct dt_node *dn)
 		disable_node(next);
 }
 
-static void _target_probe(struct dt_node *dn)
+/* The nearest ancestor with a target, which has to be probed first */
+static struct target *target_parent(struct target *target)
 {
-	int rc;
-	struct dt_node *next;
-	struct dt_property *p;
+	struct dt_node *dn;
 
-	PR_DEBUG("Probe %s - ", dn->name);
-	if (!dn->target) {
-		PR_DEBUG("target not found\n");
+	for (dn = target->dn->parent; dn; dn = dn->parent)
+		if (dn->target)
+			return dn->target;
+
+	return NULL;
+}
+
+/* Set once a target remembered as present turns out to be absent */
+static bool probe_cache_stale;
+
+/* The PIB which identifies a link, the first one on it. It is always
+ * probed as its result decides whether the others can be trusted. */
+static struct target *link_pib(struct target *link)
+{
+	struct dt_node *dn;
+
+	if (!strcmp(link->class, "pib"))
+		return link;
+
+	dt_for_each_node(link->dn, dn)
+		if (dn->target && !strcmp(dn->target->class, "pib"))
+			return dn->target;
+
+	return NULL;
+}
+
+/* Time of day value, which starts counting when the chip is IPLed */
+#define TOD_VALUE_REG		0x40020
+
+/* Cheaply identify the IPL of the chip at the end of a link by reading
+ * its time of day. The chip id isn't enough as it stays the same when
+ * the host is powered off and on again, while the time of day is reset
+ * and only counts up until the next IPL. See target_link_changed(). */
+uint64_t target_link_id(struct target *link)
+{
+	struct target *pib = link_pib(link);
+	uint64_t value;
+
+	if (!pib || target_ensure_probed(pib) != TARGET_PRESENT)
+		return LINK_ID_NONE;
+
+	return pib_read(pib, TOD_VALUE_REG, &value) ? LINK_ID_NONE : value;
+}
+
+/* Whether the chip behind a link has been powered on, off or IPLed
+ * again between reading old and now from target_link_id() */
+bool target_link_changed(uint64_t old, uint64_t now)
+{
+	if (old == LINK_ID_NONE || now == LINK_ID_NONE)
+		return old != now;
+
+	return now < old;
+}
+
+/* Once per link, before relying on anything remembered about the
+ * targets below it, check the link still leads to the same chip in the
+ * same state. If not the remembered results are dropped and those
+ * targets get probed again. */
+static void probe_cache_check(struct target *link)
+{
+	struct dt_node *dn;
+	uint64_t id;
+
+	if (link->cache_checked)
 		return;
+	link->cache_checked = true;
+
+	id = target_link_id(link);
+	if (target_link_changed(link->cache_id, id))
+		dt_for_each_node(link->dn, dn)
+			if (dn->target && dn->target->status == TARGET_UNPROBED)
+				dn->target->cached = TARGET_UNPROBED;
+	link->cache_id = id;
+}
+
+static enum target_status __target_ensure_probed(struct target *target)
+{
+	enum target_status status;
+	struct target *parent;
+	struct dt_property *p;
+	int rc = 0;
+
+	/* A probe callback accessing its own target sees it as present */
+	if (target->status != TARGET_UNPROBED)
+		return target->status == TARGET_PROBING ? TARGET_PRESENT : target->status;
+
+	/* Targets below a parent which isn't there, or which are
+	 * disabled, aren't probed. Neither is remembered as the parent or
+	 * target may only be disabled because it wasn't selected, and a
+	 * later command could select it. */
+	parent = target_parent(target);
+	if (parent && target_ensure_probed(parent) != TARGET_PRESENT)
+		return TARGET_ABSENT;
+
+	PR_DEBUG("Probe %s - ", target->dn->name);
+	p = dt_find_property(target->dn, "status");
+	if (p && !strcmp(p->prop, "disabled")) {
+		PR_DEBUG("disabled\n");
+		return TARGET_ABSENT;
 	}
 
-	p = dt_find_property(dn, "status");
-	if ((p && !strcmp(p->prop, "disabled")) || (dn->target->probe && (rc = dn->target->probe(dn->target)))) {
-		if (rc)
-			PR_DEBUG("not found\n");
-		else
-			PR_DEBUG("disabled\n");
+	if (target->cached == TARGET_ABSENT)
+		probe_cache_check(target_link(target));
 
-		disable_node(dn);
+	if (target->cached == TARGET_ABSENT) {
+		PR_DEBUG("not found last time\n");
+		status = TARGET_ABSENT;
 	} else {
-		PR_DEBUG("success\n");
-		dt_for_each_child(dn, next)
-			_target_probe(next);
+		target->status = TARGET_PROBING;
+		if (target->probe)
+			rc = target->probe(target);
+		status = rc ? TARGET_ABSENT : TARGET_PRESENT;
+		PR_DEBUG("%s\n", rc ? "not found" : "success");
+
+		if (target->cached == TARGET_PRESENT && status == TARGET_ABSENT)
+			__atomic_store_n(&probe_cache_stale, true, __ATOMIC_RELAXED);
+		target->cached = status;
+	}
+
+	if (status == TARGET_ABSENT)
+		disable_node(target->dn);
+
+	/* Publish the result only once everything the probe set up is
+	 * visible to other threads */
+	__atomic_store_n(&target->status, status, __ATOMIC_RELEASE);
+
+	return status;
+}
+
+static int probe_run(struct pib_req *req)
+{
+	return __target_ensure_probed(req->priv);
+}
+
+/* Probe a target after its parents if it hasn't been already. The
+ * result is recorded so the probe callback runs at most once however
+ * often we get asked. Targets which are disabled or have an absent
+ * parent are absent too. Targets which fail to probe get their subtree
+ * disabled.
+ *
+ * This is called on every access so the common case of an already
+ * probed target only looks at its status. Probing accesses the
+ * hardware so it runs on the link's worker (see pib_submit()), which
+ * keeps it from overlapping other requests queued on the link and
+ * serialises probes of targets on the same link. */
+enum target_status target_ensure_probed(struct target *target)
+{
+	struct pib_req req = { .target = target, .run = probe_run, .priv = target };
+	enum target_status status;
+
+	status = __atomic_load_n(&target->status, __ATOMIC_ACQUIRE);
+	if (status == TARGET_PRESENT || status == TARGET_ABSENT)
+		return status;
+
+	pib_submit(&req);
+
+	return pib_wait(&req);
+}
+
+/* Whether a target is present and neither it nor any of its parents
+ * has been disabled or hidden to deselect it. Only the topmost target
+ * which isn't selected gets disabled, so targets below it which were
+ * probed before it was deselected still look present by themselves. */
+bool target_selected(struct target *target)
+{
+	struct dt_property *p;
+	struct dt_node *dn;
+
+	if (target_ensure_probed(target) != TARGET_PRESENT)
+		return false;
+
+	p = dt_find_property(target->dn, "status");
+	if (p && (!strcmp(p->prop, "disabled") || !strcmp(p->prop, "hidden")))
+		return false;
+
+	for (dn = target->dn->parent; dn; dn = dn->parent) {
+		p = dt_find_property(dn, "status");
+		if (p && !strcmp(p->prop, "disabled"))
+			return false;
+	}
+
+	return true;
+}
+
+/* The link a target is on, the topmost target it hangs off. Targets
+ * on different links can be accessed independently. */
+struct target *target_link(struct target *target)
+{
+	struct dt_node *dn = target->dn;
+
+	while (dn->parent && dn->parent->target)
+		dn = dn->parent;
+
+	return dn->target;
+}
+
+struct probe_pool {
+	struct target **links;
+	int nr_links;
+	int next;
+	pthread_mutex_t lock;
+
+	/* Virtual times the probing started and finished */
+	uint64_t start;
+	uint64_t end;
+};
+
+/* Each link is probed by a single worker in tree order, so parents are
+ * always probed before their children and the results don't depend on
+ * how the workers get scheduled */
+static void *probe_worker(void *arg)
+{
+	struct probe_pool *pool = arg;
+	struct target *link;
+	struct dt_node *dn;
+
+	timing_sync(pool->start);
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		link = pool->next < pool->nr_links ? pool->links[pool->next++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
+		if (!link)
+			break;
+
+		target_ensure_probed(link);
+		dt_for_each_node(link->dn, dn)
+			if (dn->target)
+				target_ensure_probed(dn->target);
 	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (timing_now() > pool->end)
+		pool->end = timing_now();
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
 }
 
 /* We walk the tree root down disabling targets which might/should
- * exist but don't */
+ * exist but don't. Independent links are probed in parallel by up to
+ * PROBE_MAX_WORKERS threads. */
 void target_probe(void)
 {
+	struct probe_pool pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	pthread_t workers[PROBE_MAX_WORKERS - 1];
 	struct dt_node *dn;
+	int i, nr_workers = 0;
+
+	dt_for_each_node(dt_root, dn) {
+		if (!dn->target || target_link(dn->target) != dn->target)
+			continue;
+
+		pool.links = realloc(pool.links, (pool.nr_links + 1) * sizeof(*pool.links));
+		assert(pool.links);
+		pool.links[pool.nr_links++] = dn->target;
+	}
+
+	/* The calling thread does its share of the work too */
+	pool.start = timing_now();
+	for (i = 0; i < pool.nr_links - 1 && i < PROBE_MAX_WORKERS - 1; i++) {
+		if (pthread_create(&workers[i], NULL, probe_worker, &pool))
+			break;
+		nr_workers++;
+	}
+
+	probe_worker(&pool);
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i], NULL);
+	timing_sync(pool.end);
+
+	free(pool.links);
+}
+
+/* Forget everything found below the links so it all gets probed again,
+ * eg. after the host has been powered on or off. Nodes which were
+ * disabled because their target was absent are enabled again, so this
+ * can't be mixed with selecting targets by disabling them. Nothing may
+ * be accessing targets at the same time. Links keep their state as
+ * their probes have set up the backend. */
+void target_invalidate(void)
+{
+	struct dt_property *p;
+	struct dt_node *dn, *parent;
+
+	dt_for_each_node(dt_root, dn) {
+		for (parent = dn->parent; parent && !parent->target; parent = parent->parent);
+		if (!parent)
+			continue;
+
+		p = dt_find_property(dn, "status");
+		if (p && !strcmp(p->prop, "disabled"))
+			dt_del_property(dn, p);
+
+		if (dn->target) {
+			dn->target->status = TARGET_UNPROBED;
+			dn->target->cached = TARGET_UNPROBED;
+		}
+	}
 
 	dt_for_each_node(dt_root, dn)
-		_target_probe(dn);
+		if (dn->target && target_link(dn->target) == dn->target)
+			dn->target->cache_checked = false;
+}
+
+#define PROBE_CACHE_HEADER	"# pdbg probe cache v3"
+
+/* Probe results are remembered as a list of target paths and whether
+ * each was present. Targets remembered as absent aren't probed again,
+ * which saves a lot of time with many deconfigured chiplets, as long as
+ * the chip behind their link hasn't been IPLed again since the file was
+ * written (see target_link_id()). Those remembered as present still get
+ * probed as that sets them up, and doubles as a check that the file is
+ * still right. Links, and the PIB identifying them, are always probed so
+ * links only have their id in the file. Must be called
+ * before anything is probed. */
+void probe_cache_load(const char *path)
+{
+	char line[PATH_MAX + 24], node[PATH_MAX], status[24];
+	struct dt_node *dn;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	if (!fgets(line, sizeof(line), f) || strcmp(line, PROBE_CACHE_HEADER "\n"))
+		goto out;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%4095s %23s", node, status) != 2)
+			break;
+
+		dn = dt_find_by_path(dt_root, node);
+		if (!dn || !dn->target)
+			continue;
+
+		if (target_link(dn->target) == dn->target) {
+			if (!strncmp(status, "link=", 5))
+				dn->target->cache_id = strcmp(status + 5, "none") ?
+					strtoull(status + 5, NULL, 16) : LINK_ID_NONE;
+			continue;
+		}
+
+		if (dn->target == link_pib(target_link(dn->target)))
+			continue;
+
+		if (!strcmp(status, "present"))
+			dn->target->cached = TARGET_PRESENT;
+		else if (!strcmp(status, "absent"))
+			dn->target->cached = TARGET_ABSENT;
+	}
+
+out:
+	fclose(f);
+}
+
+static bool probe_cache_has_absent(struct target *link)
+{
+	struct dt_node *dn;
+
+	dt_for_each_node(link->dn, dn)
+		if (dn->target && dn->target->cached == TARGET_ABSENT)
+			return true;
+
+	return false;
+}
+
+/* Write out what is known about each target, whether from this run or
+ * an earlier one. If something remembered as present has gone the
+ * hardware has changed under us so the file is removed instead and the
+ * next invocation probes everything again. */
+void probe_cache_save(const char *path)
+{
+	char tmp[PATH_MAX];
+	struct dt_node *dn;
+	struct target *target;
+	char *node;
+	FILE *f;
+
+	if (probe_cache_stale) {
+		unlink(path);
+		return;
+	}
+
+	/* Write a new file and rename it over the old so invocations
+	 * running at the same time never see a partial one */
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid()) >= sizeof(tmp))
+		return;
+
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+
+	fprintf(f, PROBE_CACHE_HEADER "\n");
+	dt_for_each_node(dt_root, dn) {
+		target = dn->target;
+		if (!target)
+			continue;
+
+		node = dt_get_path(dn);
+		if (target_link(target) == target) {
+			/* The IPL is only needed to trust absent
+			 * targets, and links which weren't used keep what
+			 * was loaded */
+			if (target->status == TARGET_PRESENT && probe_cache_has_absent(target))
+				probe_cache_check(target);
+			if (target->cache_id == LINK_ID_NONE)
+				fprintf(f, "%s link=none\n", node);
+			else
+				fprintf(f, "%s link=%" PRIx64 "\n", node, target->cache_id);
+		} else if (target->cached != TARGET_UNPROBED &&
+			   target != link_pib(target_link(target)))
+			fprintf(f, "%s %s\n", node, target->cached == TARGET_PRESENT ? "present" : "absent");
+		free(node);
+	}
+
+	if (fclose(f) || rename(tmp, path))
+		unlink(tmp);
 }
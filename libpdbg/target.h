@@ -16,7 +16,9 @@
 #ifndef __TARGET_H
 #define __TARGET_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <ccan/list/list.h>
 #include <ccan/container_of/container_of.h>
 #include "compiler.h"
@@ -37,14 +39,45 @@ struct target_class {
 	struct list_node class_head_link;
 };
 
+/* Bus classes which can be accessed through any target below them */
+enum target_bus { TARGET_BUS_PIB, TARGET_BUS_OPB, TARGET_BUS_FSI, TARGET_BUS_MAX };
+
+/* Accesses of one bus class through a target go to the nearest target
+ * of that class at or above it, with offset added to the address. bus
+ * is NULL if there isn't one. */
+struct target_path {
+	struct target *bus;
+	uint64_t offset;
+};
+
+/* Result of probing a target. Each target is probed at most once. */
+enum target_status { TARGET_UNPROBED, TARGET_PROBING, TARGET_PRESENT, TARGET_ABSENT };
+
 struct target {
 	char *name;
 	char *compatible;
 	char *class;
 	int (*probe)(struct target *target);
 	int index;
+	enum target_status status;
+
+	/* Whether the hardware was there when it was last probed, which
+	 * may have been by an earlier invocation (see probe_cache_load) */
+	enum target_status cached;
+
+	/* Links only: what target_link_id() read when the probe results
+	 * were saved, and whether it has been compared with the hardware
+	 * yet */
+	uint64_t cache_id;
+	bool cache_checked;
 	struct dt_node *dn;
 	struct list_node class_link;
+
+	/* First address from reg, if there is one, and the resolved
+	 * access paths. Both are filled in by targets_init() so accesses
+	 * don't need to walk the device tree. */
+	uint64_t address;
+	struct target_path paths[TARGET_BUS_MAX];
 };
 
 struct target *require_target_parent(struct target *target);
@@ -77,7 +110,7 @@ struct htm {
 	int (*reset)(struct htm *, uint64_t *, uint64_t *);
 	int (*pause)(struct htm *);
 	int (*status)(struct htm *);
-	int (*dump)(struct htm *, uint64_t, const char *);
+	int (*dump)(struct htm *, uint64_t, const char *, int);
 };
 #define target_to_htm(x) container_of(x, struct htm, target)
 
@@ -85,13 +118,79 @@ struct adu {
 	struct target target;
 	int (*getmem)(struct adu *, uint64_t, uint64_t *);
 	int (*putmem)(struct adu *, uint64_t, uint64_t, int);
+
+	/* Optional auto-increment access to count consecutive words. The
+	 * write cycles through the first period words of data. */
+	int (*getmem_block)(struct adu *, uint64_t, uint64_t *, int);
+	int (*putmem_block)(struct adu *, uint64_t, uint64_t *, int, int);
+
+	/* Optional read of a whole range of bytes, for ADUs which do
+	 * better given all of it at once than a block at a time */
+	int (*read)(struct adu *, uint64_t, uint8_t *, uint64_t);
+
+	/* PowerBus scope used for the current access and the widest
+	 * scope which can reach all of memory */
+	int scope;
+	int max_scope;
+
+	/* PowerBus drop priority for commands issued by this ADU */
+	int priority;
+
+	/* Don't log failed accesses, set while probing for holes */
+	bool quiet;
+
+	/* Serialises accesses from different threads */
+	pthread_mutex_t lock;
 };
 #define target_to_adu(x) container_of(x, struct adu, target)
 
+/* One step of a batch of PIB accesses. Reads leave the value read in
+ * data. A read-modify-write replaces the bits in mask with those from
+ * data and leaves the value written in data. Polls read addr until
+ * (data & mask) is equal, or not equal, to value and leave the last
+ * value read in data. */
+enum pib_op_type { PIB_OP_READ, PIB_OP_WRITE, PIB_OP_RMW, PIB_OP_POLL_EQ, PIB_OP_POLL_NE };
+
+struct pib_op {
+	enum pib_op_type type;
+	uint64_t addr;
+	uint64_t data;
+	uint64_t mask;
+	uint64_t value;
+};
+
+/* Number of reads a poll makes before giving up */
+#define PIB_POLL_MAX_READS	100000
+
+/* An asynchronous batch of operations, see pib_submit() */
+struct pib_req {
+	struct target *target;
+	struct pib_op *ops;
+	int count;
+	void (*done)(struct pib_req *);
+	void *priv;
+
+	/* Optional work to run on the link instead of ops, for other
+	 * accesses which mustn't overlap the link's PIB operations */
+	int (*run)(struct pib_req *);
+
+	/* Filled in by the link the request is queued on */
+	int rc;
+	bool complete;
+	uint64_t vtime;
+	struct async_link *async_link;
+	struct list_node link;
+};
+
 struct pib {
 	struct target target;
 	int (*read)(struct pib *, uint64_t, uint64_t *);
 	int (*write)(struct pib *, uint64_t, uint64_t);
+
+	/* Optional hook to run a whole batch of operations, which may be
+	 * able to combine them into fewer transactions. The addresses are
+	 * already translated and never indirect. */
+	int (*batch)(struct pib *, struct pib_op *, int);
 	void *priv;
 };
 #define target_to_pib(x) container_of(x, struct pib, target)
@@ -135,10 +234,32 @@ struct thread {
 #define target_to_thread(x) container_of(x, struct thread, target)
 
 void targets_init(void *fdt);
+
+/* Most links probed at once by target_probe() */
+#define PROBE_MAX_WORKERS	8
+
 void target_probe(void);
+enum target_status target_ensure_probed(struct target *target);
+bool target_selected(struct target *target);
+struct target *target_link(struct target *target);
+
+/* What target_link_id() returns when nothing answers on the link */
+#define LINK_ID_NONE	UINT64_MAX
+uint64_t target_link_id(struct target *link);
+bool target_link_changed(uint64_t old, uint64_t now);
+
+/* Keep probe results in a file between invocations */
+void probe_cache_load(const char *path);
+void probe_cache_save(const char *path);
+void target_invalidate(void);
 
 int pib_read(struct target *pib_dt, uint64_t addr, uint64_t *data);
 int pib_write(struct target *pib_dt, uint64_t addr, uint64_t data);
+int pib_batch(struct target *pib_dt, struct pib_op *ops, int count);
+int __pib_batch(struct target *pib_dt, struct pib_op *ops, int count);
+int pib_run_op(struct pib *pib, struct pib_op *op);
+int pib_submit(struct pib_req *req);
+int pib_wait(struct pib_req *req);
 int opb_read(struct target *opb_dt, uint32_t addr, uint32_t *data);
 int opb_write(struct target *opb_dt, uint32_t addr, uint32_t data);
 int fsi_read(struct target *fsi_dt, uint32_t addr, uint32_t *data);
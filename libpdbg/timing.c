@@ -0,0 +1,296 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ccan/array_size/array_size.h>
+
+#include "operations.h"
+#include "target.h"
+#include "timing.h"
+
+/* Clocks for an FSI command on the wire: 50 idle clocks, the start
+ * bit, 60 bits of command, address and data plus CRC, then the start
+ * bit, ack and CRC of the response, as bmcfsi.c sends them. A PIB
+ * access through FSI2PIB takes four of them. */
+#define FSI_CMD_BITS		125
+#define FSI2PIB_CMDS		4
+
+/* An I2C getscom, the 4 byte address write and 8 byte read including
+ * slave addresses, acks, starts and stops */
+#define I2C_SCOM_BITS		130
+
+struct timing_model {
+	const char *name;
+	uint64_t syscall;	/* ns for a system call */
+	uint64_t bit;		/* ns to clock a bit on the bus */
+	uint64_t relax;		/* ns slept before each FSI2PIB access */
+	uint64_t access;	/* ns for the PIB itself to respond */
+	int pib_syscalls;
+	int pib_bits;
+	int cfam_syscalls;
+	int cfam_bits;
+	bool batch;		/* a batch is a single system call */
+	bool shared;		/* all processors are behind one bus */
+};
+
+/* Rough numbers for a BMC and a host. The FSI relax is usleep(50),
+ * which takes about twice that with the default timer slack. */
+static const struct timing_model timing_models[] = {
+	{
+		.name = "bmcfsi",
+		.bit = 500,
+		.relax = 100000,
+		.pib_bits = FSI2PIB_CMDS * FSI_CMD_BITS,
+		.cfam_bits = FSI_CMD_BITS,
+		.shared = true,
+	}, {
+		.name = "kernel",
+		.syscall = 5000,
+		.bit = 250,
+		.relax = 100000,
+		.pib_syscalls = FSI2PIB_CMDS,
+		.pib_bits = FSI2PIB_CMDS * FSI_CMD_BITS,
+		.cfam_syscalls = 1,
+		.cfam_bits = FSI_CMD_BITS,
+		.shared = true,
+	}, {
+		.name = "i2c",
+		.syscall = 5000,
+		.bit = 2500,
+		.pib_syscalls = 2,
+		.pib_bits = I2C_SCOM_BITS,
+		.batch = true,
+		.shared = true,
+	}, {
+		.name = "host",
+		.syscall = 1000,
+		.access = 1000,
+		.pib_syscalls = 1,
+	},
+};
+
+/* When each link (or the one shared bus) is next free */
+struct timing_bus {
+	struct target *link;
+	uint64_t free;
+};
+
+static struct timing_model model;
+static bool enabled;
+static unsigned int jitter;
+static unsigned int seed = 1;
+
+static pthread_mutex_t timing_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timing_bus *buses;
+static int nr_buses;
+static struct timing_stats stats;
+
+/* Threads' times from before the last reset are stale */
+static unsigned int generation;
+
+static __thread struct {
+	unsigned int generation;
+	uint64_t now;
+	int depth;
+} timing_thread;
+
+static int timing_set_param(const char *param)
+{
+	unsigned long long val;
+	const char *eq;
+	char *end;
+
+	eq = strchr(param, '=');
+	if (!eq)
+		return -1;
+
+	val = strtoull(eq + 1, &end, 0);
+	if (end == eq + 1 || *end)
+		return -1;
+
+	if (!strncmp(param, "syscall=", eq - param + 1))
+		model.syscall = val;
+	else if (!strncmp(param, "bit=", eq - param + 1))
+		model.bit = val;
+	else if (!strncmp(param, "relax=", eq - param + 1))
+		model.relax = val;
+	else if (!strncmp(param, "access=", eq - param + 1))
+		model.access = val;
+	else if (!strncmp(param, "jitter=", eq - param + 1) && val <= 100)
+		jitter = val;
+	else if (!strncmp(param, "seed=", eq - param + 1))
+		seed = val;
+	else
+		return -1;
+
+	return 0;
+}
+
+/* Returns 0 on success or -1 if the spec isn't valid */
+int timing_init(const char *spec)
+{
+	char *copy, *tok, *saveptr;
+	int i, rc = -1;
+
+	copy = strdup(spec);
+	if (!copy)
+		return -1;
+
+	tok = strtok_r(copy, ",", &saveptr);
+	for (i = 0; tok && i < ARRAY_SIZE(timing_models); i++)
+		if (!strcmp(tok, timing_models[i].name))
+			break;
+
+	if (!tok || i == ARRAY_SIZE(timing_models)) {
+		PR_ERROR("Unknown timing model %s\n", tok ? tok : "");
+		goto out;
+	}
+	model = timing_models[i];
+
+	while ((tok = strtok_r(NULL, ",", &saveptr))) {
+		if (timing_set_param(tok)) {
+			PR_ERROR("Invalid timing parameter %s\n", tok);
+			goto out;
+		}
+	}
+
+	enabled = true;
+	rc = 0;
+
+out:
+	free(copy);
+	return rc;
+}
+
+bool timing_enabled(void)
+{
+	return enabled;
+}
+
+const char *timing_model_name(void)
+{
+	return model.name;
+}
+
+void timing_reset(void)
+{
+	pthread_mutex_lock(&timing_lock);
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+	nr_buses = 0;
+	memset(&stats, 0, sizeof(stats));
+	pthread_mutex_unlock(&timing_lock);
+
+	timing_thread.generation = generation;
+	timing_thread.now = 0;
+}
+
+uint64_t timing_now(void)
+{
+	unsigned int gen = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+
+	if (timing_thread.generation != gen) {
+		timing_thread.generation = gen;
+		timing_thread.now = 0;
+	}
+
+	return timing_thread.now;
+}
+
+void timing_sync(uint64_t t)
+{
+	if (t > timing_now())
+		timing_thread.now = t;
+}
+
+void timing_get_stats(struct timing_stats *s)
+{
+	pthread_mutex_lock(&timing_lock);
+	*s = stats;
+	pthread_mutex_unlock(&timing_lock);
+}
+
+bool timing_begin(void)
+{
+	return timing_thread.depth++ == 0 && enabled;
+}
+
+void timing_end(void)
+{
+	timing_thread.depth--;
+}
+
+/* Wait for the bus, then keep it busy for cost. Called with
+ * timing_lock held. */
+static void timing_charge(struct target *target, uint64_t cost)
+{
+	struct target *link = model.shared ? NULL : target_link(target);
+	struct timing_bus *bus = NULL;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < nr_buses; i++)
+		if (buses[i].link == link)
+			bus = &buses[i];
+
+	if (!bus) {
+		bus = realloc(buses, (nr_buses + 1) * sizeof(*buses));
+		if (!bus)
+			return;
+		buses = bus;
+		bus = &buses[nr_buses++];
+		bus->link = link;
+		bus->free = 0;
+	}
+
+	/* Vary the cost by up to jitter percent either way */
+	if (jitter)
+		cost = cost * (100 - jitter + rand_r(&seed) % (2 * jitter + 1)) / 100;
+
+	start = timing_now() > bus->free ? timing_now() : bus->free;
+	bus->free = start + cost;
+	timing_thread.now = bus->free;
+	stats.busy += cost;
+}
+
+/* Charge for count PIB accesses, which the backend was given together
+ * if batch is set */
+void timing_pib(struct target *target, int count, bool batch)
+{
+	uint64_t cost;
+
+	cost = count * (model.pib_bits * model.bit + model.relax + model.access);
+	if (batch && model.batch)
+		cost += model.pib_syscalls * model.syscall;
+	else
+		cost += count * model.pib_syscalls * model.syscall;
+
+	pthread_mutex_lock(&timing_lock);
+	stats.pib_accesses += count;
+	timing_charge(target, cost);
+	pthread_mutex_unlock(&timing_lock);
+}
+
+void timing_cfam(struct target *target)
+{
+	pthread_mutex_lock(&timing_lock);
+	stats.cfam_accesses++;
+	timing_charge(target, model.cfam_syscalls * model.syscall + model.cfam_bits * model.bit);
+	pthread_mutex_unlock(&timing_lock);
+}
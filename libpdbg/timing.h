@@ -0,0 +1,62 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __TIMING_H
+#define __TIMING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "target.h"
+
+/* A model of how long the accesses pdbg makes would take over a given
+ * transport, whichever backend actually does them. Time is virtual and
+ * kept per thread, in ns: each access starts once both the thread and
+ * the bus it uses are free and moves both on by what it costs. Work
+ * handed to another thread carries the time it was handed over with
+ * it, and waiting for the result catches up with the time it finished,
+ * so accesses to independent links overlap as they would for real.
+ *
+ * Models are chosen by name, optionally followed by parameters to
+ * change, eg. "bmcfsi,bit=300,jitter=10". */
+int timing_init(const char *spec);
+bool timing_enabled(void);
+const char *timing_model_name(void);
+
+/* Start timing a new command from zero */
+void timing_reset(void);
+
+/* The calling thread's virtual time, and moving it on to t if that's
+ * later for threads picking up or waiting for work */
+uint64_t timing_now(void);
+void timing_sync(uint64_t t);
+
+/* What was accessed since timing_reset() */
+struct timing_stats {
+	uint64_t pib_accesses;
+	uint64_t cfam_accesses;
+	uint64_t busy;
+};
+void timing_get_stats(struct timing_stats *stats);
+
+/* Accesses are charged when a backend is called. Backends calling
+ * back into the library are inside an access already charged for, so
+ * only the outermost access is. timing_begin() returns true for it. */
+bool timing_begin(void);
+void timing_end(void);
+void timing_pib(struct target *target, int count, bool batch);
+void timing_cfam(struct target *target);
+
+#endif
@@ -0,0 +1,37 @@
+/dts-v1/;
+
+/ {
+	#address-cells = <0x1>;
+	#size-cells = <0x0>;
+
+	/* Register level simulation of two processors */
+	pib@0 {
+	      #address-cells = <0x2>;
+	      #size-cells = <0x1>;
+	      compatible = "ibm,sim-pib";
+	      chip-id = <0x0>;
+	      index = <0x0>;
+	      include(p8-pib.dts.m4)dnl
+
+	      fsi@0 {
+		      compatible = "ibm,sim-fsi";
+		      reg = <0x0 0x0 0x0>;
+		      index = <0x0>;
+	      };
+	};
+
+	pib@8 {
+	      #address-cells = <0x2>;
+	      #size-cells = <0x1>;
+	      compatible = "ibm,sim-pib";
+	      chip-id = <0x8>;
+	      index = <0x1>;
+	      include(p8-pib.dts.m4)dnl
+
+	      fsi@0 {
+		      compatible = "ibm,sim-fsi";
+		      reg = <0x0 0x0 0x0>;
+		      index = <0x1>;
+	      };
+	};
+};
@@ -25,7 +25,7 @@ index = <HEX(eval($1, 16))>;
 #size-cells = <0x1>;
 
 adu@90000 {
-	  compatible = "ibm,power9-adu";
+	  compatible = ifdef(`REMOTE', `"ibm,remote-adu"', `"ibm,power9-adu"');
 	  reg = <0x0 0x90000 0x5>;
 };
 
@@ -0,0 +1,33 @@
+/dts-v1/;
+
+/ {
+	#address-cells = <0x1>;
+	#size-cells = <0x0>;
+
+	/* Register level simulation of two processors */
+	pib@0 {
+	      compatible = "ibm,sim-pib";
+	      chip-id = <0x0>;
+	      index = <0x0>;
+	      include(p9-pib.dts.m4)dnl
+
+	      fsi@0 {
+		      compatible = "ibm,sim-fsi";
+		      reg = <0x0 0x0 0x0>;
+		      index = <0x0>;
+	      };
+	};
+
+	pib@8 {
+	      compatible = "ibm,sim-pib";
+	      chip-id = <0x8>;
+	      index = <0x1>;
+	      include(p9-pib.dts.m4)dnl
+
+	      fsi@0 {
+		      compatible = "ibm,sim-fsi";
+		      reg = <0x0 0x0 0x0>;
+		      index = <0x1>;
+	      };
+	};
+};
@@ -0,0 +1,33 @@
+define(`REMOTE')dnl
+/dts-v1/;
+
+/ {
+	#address-cells = <0x1>;
+	#size-cells = <0x0>;
+
+	/* Everything is forwarded to a pdbg daemon, one connection per
+	 * processor */
+	pib@0 {
+	      compatible = "ibm,remote-pib";
+	      index = <0x0>;
+	      include(p9-pib.dts.m4)dnl
+
+	      fsi@0 {
+		      compatible = "ibm,remote-fsi";
+		      reg = <0x0 0x0 0x0>;
+		      index = <0x0>;
+	      };
+	};
+
+	pib@1 {
+	      compatible = "ibm,remote-pib";
+	      index = <0x1>;
+	      include(p9-pib.dts.m4)dnl
+
+	      fsi@0 {
+		      compatible = "ibm,remote-fsi";
+		      reg = <0x0 0x0 0x0>;
+		      index = <0x1>;
+	      };
+	};
+};
@@ -0,0 +1,628 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <ccan/array_size/array_size.h>
+
+#include <backend.h>
+#include <operations.h>
+#include <target.h>
+#include <device.h>
+#include <timing.h>
+
+#include <config.h>
+
+/* Microbenchmarks of the library's operations. Each benchmark prints
+ * one line of space separated key=value pairs:
+ *
+ *	name=<benchmark> status=ok|error|unsupported|skipped ops=<n>
+ *	seconds=<s> ops_per_sec=<n> min_ns=<n> p50_ns=<n> p90_ns=<n>
+ *	p99_ns=<n> max_ns=<n> [bytes_per_sec=<n>]
+ *	[projected_seconds=<s> projected_ops_per_sec=<n>]
+ *
+ * after a header line giving the format and the setup. Keys are never
+ * renamed or removed, new ones are added at the end of the line and
+ * the format number is bumped if anything else changes. */
+#define BENCH_FORMAT		1
+#define DEFAULT_ITERATIONS	1000
+#define DEFAULT_MEM_SIZE	(64 * 1024)
+#define DEFAULT_READ_ADDR	0xf000f
+#define NSEC_PER_SEC		1000000000
+
+/* Scratch registers only used by default on the simulated backends */
+#define SIM_WRITE_ADDR		0x1000
+#define SIM_INDIRECT_ADDR	0x800c012301010000ULL
+#define DEFAULT_MEM_ADDR	0x0
+
+enum backend { FAKE, SIM, HOST, KERNEL, REMOTE };
+
+extern unsigned char _binary_fake_dtb_o_start[];
+extern unsigned char _binary_fake_dtb_o_end;
+extern unsigned char _binary_p8_host_dtb_o_start[];
+extern unsigned char _binary_p8_host_dtb_o_end;
+extern unsigned char _binary_p9_host_dtb_o_start[];
+extern unsigned char _binary_p9_host_dtb_o_end;
+extern unsigned char _binary_p9_kernel_dtb_o_start[];
+extern unsigned char _binary_p9_kernel_dtb_o_end;
+extern unsigned char _binary_p8_sim_dtb_o_start[];
+extern unsigned char _binary_p8_sim_dtb_o_end;
+extern unsigned char _binary_p9_sim_dtb_o_start[];
+extern unsigned char _binary_p9_sim_dtb_o_end;
+extern unsigned char _binary_remote_dtb_o_start[];
+extern unsigned char _binary_remote_dtb_o_end;
+
+static enum backend backend = SIM;
+static const char *backend_name = "sim";
+static const char *device_node = "p9";
+static int processor;
+static int iterations = DEFAULT_ITERATIONS;
+static uint64_t mem_size = DEFAULT_MEM_SIZE;
+static uint64_t read_addr = DEFAULT_READ_ADDR;
+static uint64_t write_addr, indirect_addr, mem_addr = DEFAULT_MEM_ADDR;
+static bool have_write_addr, have_indirect_addr, have_mem_addr;
+
+static struct target *pib, *fsi, *adu, *chiplet, *thread;
+static uint8_t *mem_buf;
+
+struct bench {
+	const char *name;
+
+	/* Target the benchmark needs, NULL if it needs none */
+	struct target **target;
+
+	/* Writes to the hardware, stops threads or probes everything
+	 * again, so only run by default on the simulated backends */
+	bool intrusive;
+
+	/* Runs iterations / div operations */
+	int div;
+
+	/* Moves mem_size bytes per operation */
+	bool mem;
+
+	int (*setup)(void);
+
+	/* Untimed work before each operation */
+	int (*prepare)(void);
+	int (*op)(int i);
+	void (*teardown)(void);
+};
+
+static bool simulated(void)
+{
+	return backend == SIM || backend == FAKE;
+}
+
+static int bench_pib_read(int i)
+{
+	uint64_t value;
+
+	return pib_read(pib, read_addr, &value);
+}
+
+static int bench_pib_write_setup(void)
+{
+	return have_write_addr ? 0 : -1;
+}
+
+static int bench_pib_write(int i)
+{
+	return pib_write(pib, write_addr, i);
+}
+
+static int bench_indirect_setup(void)
+{
+	return have_indirect_addr ? 0 : -1;
+}
+
+static int bench_indirect_read(int i)
+{
+	uint64_t value;
+
+	return pib_read(pib, indirect_addr, &value);
+}
+
+static int bench_cfam_read(int i)
+{
+	uint32_t value;
+
+	return fsi_read(fsi, 0xc09, &value);
+}
+
+static int bench_getmem(int i)
+{
+	return adu_getmem(adu, mem_addr, mem_buf, mem_size);
+}
+
+static int bench_putmem_setup(void)
+{
+	return have_mem_addr ? 0 : -1;
+}
+
+static int bench_putmem(int i)
+{
+	return adu_putmem(adu, mem_addr, mem_buf, mem_size);
+}
+
+/* RAM needs every thread on the core stopped */
+static int bench_ram_setup(void)
+{
+	struct target *target;
+
+	for_each_class_target("thread", target) {
+		if (target->dn->parent != chiplet->dn ||
+		    target_ensure_probed(target) != TARGET_PRESENT)
+			continue;
+		CHECK_ERR(ram_stop_thread(target));
+	}
+
+	return 0;
+}
+
+static void bench_ram_teardown(void)
+{
+	struct target *target;
+
+	for_each_class_target("thread", target) {
+		if (target->dn->parent != chiplet->dn ||
+		    target_ensure_probed(target) != TARGET_PRESENT)
+			continue;
+		ram_start_thread(target);
+	}
+}
+
+static int bench_ram_getgpr(int i)
+{
+	uint64_t value;
+
+	return ram_getgpr(target_to_thread(thread), i % 32, &value);
+}
+
+static int bench_thread_start(void)
+{
+	return ram_start_thread(thread);
+}
+
+static int bench_thread_stop(void)
+{
+	return ram_stop_thread(thread);
+}
+
+static int bench_op_thread_stop(int i)
+{
+	return bench_thread_stop();
+}
+
+static int bench_op_thread_start(int i)
+{
+	return bench_thread_start();
+}
+
+static void bench_thread_teardown(void)
+{
+	ram_start_thread(thread);
+}
+
+static int bench_probe(int i)
+{
+	target_invalidate();
+	target_probe();
+
+	return 0;
+}
+
+static struct bench benches[] = {
+	{ .name = "pib_read", .target = &pib, .div = 1, .op = bench_pib_read },
+	{ .name = "pib_write", .target = &pib, .intrusive = true, .div = 1,
+	  .setup = bench_pib_write_setup, .op = bench_pib_write },
+	{ .name = "indirect_read", .target = &pib, .div = 1,
+	  .setup = bench_indirect_setup, .op = bench_indirect_read },
+	{ .name = "cfam_read", .target = &fsi, .div = 1, .op = bench_cfam_read },
+	{ .name = "getmem", .target = &adu, .div = 100, .mem = true,
+	  .op = bench_getmem },
+	{ .name = "putmem", .target = &adu, .intrusive = true, .div = 100, .mem = true,
+	  .setup = bench_putmem_setup, .op = bench_putmem },
+	{ .name = "ram_getgpr", .target = &thread, .intrusive = true, .div = 10,
+	  .setup = bench_ram_setup, .op = bench_ram_getgpr, .teardown = bench_ram_teardown },
+	{ .name = "thread_stop", .target = &thread, .intrusive = true, .div = 10,
+	  .prepare = bench_thread_start, .op = bench_op_thread_stop,
+	  .teardown = bench_thread_teardown },
+	{ .name = "thread_start", .target = &thread, .intrusive = true, .div = 10,
+	  .prepare = bench_thread_stop, .op = bench_op_thread_start,
+	  .teardown = bench_thread_teardown },
+	{ .name = "probe", .intrusive = true, .div = 100, .op = bench_probe },
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of sorted values */
+static uint64_t percentile(uint64_t *values, int n, int p)
+{
+	int rank = (n * p + 99) / 100;
+
+	return values[rank ? rank - 1 : 0];
+}
+
+/* Per second rate of count events taking ns */
+static double rate(uint64_t count, uint64_t ns)
+{
+	return ns ? (double) count * NSEC_PER_SEC / ns : 0;
+}
+
+static void print_seconds(FILE *out, const char *key, uint64_t ns)
+{
+	fprintf(out, " %s=%" PRIu64 ".%09" PRIu64, key, ns / NSEC_PER_SEC, ns % NSEC_PER_SEC);
+}
+
+static void run_bench(struct bench *b, FILE *out)
+{
+	uint64_t *lat, start, total = 0, projected = 0, vstart;
+	int i, n = iterations / b->div ? iterations / b->div : 1;
+	const char *status = "ok";
+
+	fprintf(out, "name=%s", b->name);
+	if (b->target && !*b->target) {
+		fprintf(out, " status=unsupported\n");
+		return;
+	}
+
+	if (b->setup && b->setup()) {
+		fprintf(out, " status=skipped\n");
+		return;
+	}
+
+	lat = calloc(n, sizeof(*lat));
+	if (!lat) {
+		fprintf(out, " status=error\n");
+		return;
+	}
+
+	if (timing_enabled())
+		timing_reset();
+
+	for (i = 0; i < n; i++) {
+		if (b->prepare && b->prepare()) {
+			status = "error";
+			break;
+		}
+
+		vstart = timing_now();
+		start = now_ns();
+		if (b->op(i)) {
+			status = "error";
+			break;
+		}
+		lat[i] = now_ns() - start;
+		projected += timing_now() - vstart;
+		total += lat[i];
+	}
+
+	if (b->teardown)
+		b->teardown();
+
+	fprintf(out, " status=%s", status);
+	if (i < n) {
+		fprintf(out, "\n");
+		free(lat);
+		return;
+	}
+
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	fprintf(out, " ops=%d", n);
+	print_seconds(out, "seconds", total);
+	fprintf(out, " ops_per_sec=%.1f min_ns=%" PRIu64 " p50_ns=%" PRIu64
+		" p90_ns=%" PRIu64 " p99_ns=%" PRIu64 " max_ns=%" PRIu64,
+		rate(n, total), lat[0], percentile(lat, n, 50),
+		percentile(lat, n, 90), percentile(lat, n, 99), lat[n - 1]);
+	if (b->mem)
+		fprintf(out, " bytes_per_sec=%.1f",
+			rate(mem_size * n, total));
+	if (timing_enabled()) {
+		print_seconds(out, "projected_seconds", projected);
+		fprintf(out, " projected_ops_per_sec=%.1f",
+			rate(n, projected));
+	}
+	fprintf(out, "\n");
+	fflush(out);
+
+	free(lat);
+}
+
+/* First present target of the class below parent, with the given
+ * index if it isn't -1 */
+static struct target *find_target(const char *class, struct target *parent, int index)
+{
+	struct target *target;
+	struct dt_node *dn;
+
+	if (!find_target_class(class))
+		return NULL;
+
+	for_each_class_target(class, target) {
+		for (dn = target->dn; parent && dn && dn != parent->dn; dn = dn->parent);
+		if (!dn || (index != -1 && target->index != index))
+			continue;
+
+		if (target_ensure_probed(target) == TARGET_PRESENT)
+			return target;
+	}
+
+	return NULL;
+}
+
+static void *load_fdt(void)
+{
+	switch (backend) {
+	case FAKE:
+		return _binary_fake_dtb_o_start;
+
+	case SIM:
+		if (!strcmp(device_node, "p8"))
+			return _binary_p8_sim_dtb_o_start;
+		else if (!strcmp(device_node, "p9"))
+			return _binary_p9_sim_dtb_o_start;
+		break;
+
+	case HOST:
+		if (!strcmp(device_node, "p8"))
+			return _binary_p8_host_dtb_o_start;
+		else if (!strcmp(device_node, "p9"))
+			return _binary_p9_host_dtb_o_start;
+		break;
+
+	case KERNEL:
+		return _binary_p9_kernel_dtb_o_start;
+
+	case REMOTE:
+		remote_init(device_node);
+		return _binary_remote_dtb_o_start;
+	}
+
+	PR_ERROR("Unsupported device type %s for the %s backend\n", device_node, backend_name);
+	return NULL;
+}
+
+static void print_usage(char *pname)
+{
+	int i;
+
+	printf("Usage: %s [options] [benchmark...]\n\n", pname);
+	printf(" Options:\n");
+	printf("\t-b, --backend=sim|fake|host|kernel|remote\n");
+	printf("\t\tDefaults to sim\n");
+	printf("\t-d, --device=backend device\n");
+	printf("\t\tp8 or p9 for sim and host, the daemon's [host][:port]\n");
+	printf("\t\tfor remote\n");
+	printf("\t-p, --processor=processor-id\n");
+	printf("\t-n, --iterations=count\n");
+	printf("\t\tOperations per benchmark, defaults to %d. Memory, RAM,\n", DEFAULT_ITERATIONS);
+	printf("\t\tthread and probe benchmarks run fewer\n");
+	printf("\t-s, --size=bytes\n");
+	printf("\t\tMemory moved by each getmem/putmem, defaults to %d\n", DEFAULT_MEM_SIZE);
+	printf("\t-r, --read-address=address\n");
+	printf("\t\tSCOM register read by pib_read, defaults to 0x%x\n", DEFAULT_READ_ADDR);
+	printf("\t-w, --write-address=address\n");
+	printf("\t-i, --indirect-address=address\n");
+	printf("\t-m, --mem-address=address\n");
+	printf("\t\tSCOM registers and memory used by pib_write,\n");
+	printf("\t\tindirect_read, getmem and putmem. Only the simulated\n");
+	printf("\t\tbackends have defaults\n");
+	printf("\t-o, --output=file\n");
+	printf("\t\tWrite the results to file rather than stdout\n");
+	printf("\t--timing=model[,parameter=value...]\n");
+	printf("\t\tAlso report what the transport model projects, see pdbg\n");
+	printf("\t-h, --help\n");
+	printf("\n");
+	printf(" Benchmarks:\n");
+	for (i = 0; i < ARRAY_SIZE(benches); i++)
+		printf("\t%s%s\n", benches[i].name,
+		       benches[i].intrusive ? " (only run by default with sim and fake)" : "");
+}
+
+static bool parse_u64(const char *arg, uint64_t *value)
+{
+	char *end;
+
+	*value = strtoull(arg, &end, 0);
+
+	return end != arg && !*end;
+}
+
+int main(int argc, char *argv[])
+{
+	struct option long_opts[] = {
+		{"backend",		required_argument,	NULL,	'b'},
+		{"device",		required_argument,	NULL,	'd'},
+		{"processor",		required_argument,	NULL,	'p'},
+		{"iterations",		required_argument,	NULL,	'n'},
+		{"size",		required_argument,	NULL,	's'},
+		{"read-address",	required_argument,	NULL,	'r'},
+		{"write-address",	required_argument,	NULL,	'w'},
+		{"indirect-address",	required_argument,	NULL,	'i'},
+		{"mem-address",		required_argument,	NULL,	'm'},
+		{"output",		required_argument,	NULL,	'o'},
+		{"timing",		required_argument,	NULL,	'T'},
+		{"help",		no_argument,		NULL,	'h'},
+		{NULL,			0,			NULL,	0},
+	};
+	const char *output = NULL, *timing = NULL;
+	bool error = false, selected;
+	uint64_t value;
+	void *fdt;
+	FILE *out = stdout;
+	int c, i, j;
+
+	while ((c = getopt_long(argc, argv, "b:d:p:n:s:r:w:i:m:o:h", long_opts, NULL)) != -1) {
+		switch (c) {
+		case 'b':
+			backend_name = optarg;
+			if (!strcmp(optarg, "sim"))
+				backend = SIM;
+			else if (!strcmp(optarg, "fake"))
+				backend = FAKE;
+			else if (!strcmp(optarg, "host"))
+				backend = HOST;
+			else if (!strcmp(optarg, "kernel"))
+				backend = KERNEL;
+			else if (!strcmp(optarg, "remote")) {
+				backend = REMOTE;
+				device_node = NULL;
+			} else
+				error = true;
+			break;
+
+		case 'd':
+			device_node = optarg;
+			break;
+
+		case 'p':
+			error |= !parse_u64(optarg, &value);
+			processor = value;
+			break;
+
+		case 'n':
+			error |= !parse_u64(optarg, &value) || !value;
+			iterations = value;
+			break;
+
+		case 's':
+			error |= !parse_u64(optarg, &mem_size) || !mem_size;
+			break;
+
+		case 'r':
+			error |= !parse_u64(optarg, &read_addr);
+			break;
+
+		case 'w':
+			error |= !parse_u64(optarg, &write_addr);
+			have_write_addr = true;
+			break;
+
+		case 'i':
+			error |= !parse_u64(optarg, &indirect_addr);
+			have_indirect_addr = true;
+			break;
+
+		case 'm':
+			error |= !parse_u64(optarg, &mem_addr);
+			have_mem_addr = true;
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'T':
+			timing = optarg;
+			break;
+
+		default:
+			error = true;
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		for (j = 0; j < ARRAY_SIZE(benches); j++)
+			if (!strcmp(argv[i], benches[j].name))
+				break;
+		if (j == ARRAY_SIZE(benches)) {
+			PR_ERROR("Unknown benchmark %s\n", argv[i]);
+			error = true;
+		}
+	}
+
+	if (error || (timing && timing_init(timing))) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	if (simulated()) {
+		if (!have_write_addr)
+			write_addr = SIM_WRITE_ADDR;
+		if (!have_indirect_addr)
+			indirect_addr = SIM_INDIRECT_ADDR;
+		have_write_addr = have_indirect_addr = have_mem_addr = true;
+	}
+
+	if (output) {
+		out = fopen(output, "w");
+		if (!out) {
+			PR_ERROR("Unable to open %s: %m\n", output);
+			return 1;
+		}
+	}
+
+	mem_buf = calloc(1, mem_size);
+	if (!mem_buf)
+		return 1;
+	for (value = 0; value < mem_size; value++)
+		mem_buf[value] = value * 7;
+
+	fdt = load_fdt();
+	if (!fdt)
+		return 1;
+	targets_init(fdt);
+
+	pib = find_target("pib", NULL, processor);
+	fsi = find_target("fsi", NULL, processor);
+	adu = pib ? find_target("adu", pib, -1) : NULL;
+	chiplet = pib ? find_target("chiplet", pib, -1) : NULL;
+	thread = chiplet ? find_target("thread", chiplet, -1) : NULL;
+
+	fprintf(out, "pdbg-bench format=%d version=%s commit=%s backend=%s device=%s processor=%d"
+		" iterations=%d timing=%s\n", BENCH_FORMAT, PACKAGE_VERSION, GIT_SHA1,
+		backend_name, device_node ? device_node : "default", processor, iterations,
+		timing_enabled() ? timing_model_name() : "none");
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		if (optind < argc) {
+			for (j = optind, selected = false; j < argc && !selected; j++)
+				selected = !strcmp(argv[j], benches[i].name);
+			if (!selected)
+				continue;
+		} else if (benches[i].intrusive && !simulated())
+			continue;
+
+		run_bench(&benches[i], out);
+	}
+
+	if (out != stdout && fclose(out)) {
+		PR_ERROR("Unable to write %s: %m\n", output);
+		return 1;
+	}
+
+	return 0;
+}
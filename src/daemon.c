@@ -0,0 +1,740 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <ccan/container_of/container_of.h>
+
+#include <operations.h>
+#include <target.h>
+#include <device.h>
+
+#include "compress.h"
+#include "mem.h"
+#include "daemon.h"
+
+/* Each GETMEM response is compressed as a single block */
+#if DAEMON_MAX_GETMEM > COMPRESS_BLOCK_SIZE
+#error "DAEMON_MAX_GETMEM must fit in a compressed block"
+#endif
+
+/* Requests from all clients go through the per link queues (see
+ * pib_submit()) so accesses to one link are serialised while separate
+ * links are used in parallel. Invalidating the probe results has to
+ * wait for everything else to finish. */
+static pthread_rwlock_t daemon_lock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile sig_atomic_t daemon_stop;
+
+/* Token TCP clients must give before anything else, NULL on a UNIX
+ * socket */
+static const char *daemon_token;
+
+/* One access queued on a link on behalf of a client */
+struct daemon_op {
+	struct pib_req req;
+	struct pib_op op;
+	uint32_t index;
+	uint8_t *buf;
+	uint64_t size;
+};
+
+static int cfam_run(struct pib_req *req)
+{
+	struct daemon_op *dop = container_of(req, struct daemon_op, req);
+	uint32_t value;
+
+	if (dop->op.type == PIB_OP_WRITE)
+		return fsi_write(req->target, dop->op.addr, dop->op.data);
+
+	if (fsi_read(req->target, dop->op.addr, &value))
+		return -1;
+	dop->op.data = value;
+
+	return 0;
+}
+
+static int mem_run(struct pib_req *req)
+{
+	struct daemon_op *dop = container_of(req, struct daemon_op, req);
+
+	if (dop->op.type == PIB_OP_WRITE)
+		return adu_putmem(req->target, dop->op.addr, dop->buf, dop->size);
+
+	return adu_getmem(req->target, dop->op.addr, dop->buf, dop->size);
+}
+
+static int queue_op(struct daemon_op *dop, struct target *target, int (*run)(struct pib_req *))
+{
+	dop->req.target = target;
+	dop->req.ops = &dop->op;
+	dop->req.count = 1;
+	dop->req.run = run;
+
+	return pib_submit(&dop->req);
+}
+
+static bool proc_selected(struct daemon_req *req, struct target *target)
+{
+	return target->index >= 0 && target->index < 32 &&
+		(req->procs & (1U << target->index)) &&
+		target_ensure_probed(target) == TARGET_PRESENT;
+}
+
+/* Queue the access on every selected processor at once so processors
+ * on different links are accessed in parallel */
+static int serve_per_proc(int fd, struct daemon_req *req, bool *error)
+{
+	bool cfam = req->op == DAEMON_GETCFAM || req->op == DAEMON_PUTCFAM;
+	bool write = req->op == DAEMON_PUTSCOM || req->op == DAEMON_PUTCFAM;
+	char *class = cfam ? "fsi" : "pib";
+	struct daemon_op *dops, *dop;
+	struct target *target;
+	int i, nr = 0, ok = 0, rc = 0;
+
+	for_each_class_target(class, target)
+		if (proc_selected(req, target))
+			nr++;
+
+	dops = calloc(nr ? nr : 1, sizeof(*dops));
+	assert(dops);
+
+	i = 0;
+	for_each_class_target(class, target) {
+		if (i == nr || !proc_selected(req, target))
+			continue;
+
+		dop = &dops[i++];
+		dop->index = target->index;
+		dop->op.addr = req->addr;
+		dop->op.data = req->data;
+		dop->op.type = write ? PIB_OP_WRITE : PIB_OP_READ;
+		if (!cfam && write && req->mask != -1ULL) {
+			dop->op.type = PIB_OP_RMW;
+			dop->op.mask = req->mask;
+		}
+
+		queue_op(dop, target, cfam ? cfam_run : NULL);
+	}
+
+	for (i = 0; i < nr; i++) {
+		dop = &dops[i];
+		if (!pib_wait(&dop->req))
+			ok++;
+		if (!rc)
+			rc = remote_send_resp(fd, dop->req.rc, dop->index, dop->op.data);
+	}
+
+	free(dops);
+
+	/* Nothing selected being present may be because the host has
+	 * been powered on since it was probed */
+	*error = !nr || ok < nr;
+
+	return rc ? rc : remote_send_resp(fd, ok, DAEMON_END, 0);
+}
+
+/* The ADU to access memory with, either the one owning it or for
+ * DAEMON_ON_PROC the one on the first selected processor */
+static struct target *req_adu(struct daemon_req *req)
+{
+	struct target *adu;
+
+	if (!(req->flags & DAEMON_ON_PROC))
+		return mem_adu(req->addr, req->data);
+
+	for_each_class_target("adu", adu)
+		if (proc_selected(req, require_target_parent(adu)) &&
+		    target_ensure_probed(adu) == TARGET_PRESENT)
+			return adu;
+
+	return NULL;
+}
+
+/* Stream memory back a chunk at a time, each read being queued on the
+ * ADU's link */
+static int serve_getmem(int fd, struct daemon_req *req, bool *error)
+{
+	struct daemon_op dop;
+	struct target *adu;
+	uint64_t addr = req->addr, end = req->addr + req->data;
+	uint8_t *block = NULL;
+	size_t len;
+	int rc = -1;
+
+	adu = req_adu(req);
+	if (!adu) {
+		*error = true;
+		return remote_send_resp(fd, -1, DAEMON_END, 0);
+	}
+
+	memset(&dop, 0, sizeof(dop));
+	dop.buf = malloc(DAEMON_MAX_GETMEM);
+	assert(dop.buf);
+	if (req->flags & DAEMON_COMPRESS) {
+		block = malloc(COMPRESS_BOUND(DAEMON_MAX_GETMEM));
+		assert(block);
+	}
+
+	for (; addr < end; addr += dop.size) {
+		dop.size = end - addr < DAEMON_MAX_GETMEM ? end - addr : DAEMON_MAX_GETMEM;
+		dop.op.type = PIB_OP_READ;
+		dop.op.addr = addr;
+		if (queue_op(&dop, adu, mem_run) || pib_wait(&dop.req))
+			break;
+
+		if (block) {
+			len = compress_block(dop.buf, dop.size, block);
+			if (remote_send_resp(fd, 0, 0, len) || remote_send_all(fd, block, len))
+				goto out;
+		} else if (remote_send_resp(fd, 0, 0, dop.size) ||
+			   remote_send_all(fd, dop.buf, dop.size))
+			goto out;
+	}
+
+	*error = addr != end;
+	rc = remote_send_resp(fd, addr == end ? 0 : -1, DAEMON_END, 0);
+out:
+	free(block);
+	free(dop.buf);
+
+	return rc;
+}
+
+static int serve_putmem(int fd, struct daemon_req *req, bool *error)
+{
+	struct daemon_op dop;
+	struct target *adu;
+	int rc;
+
+	if (req->data > DAEMON_MAX_PUTMEM)
+		return -1;
+
+	memset(&dop, 0, sizeof(dop));
+	dop.buf = malloc(req->data ? req->data : 1);
+	assert(dop.buf);
+
+	rc = remote_recv_all(fd, dop.buf, req->data);
+	if (rc)
+		goto out;
+
+	dop.op.type = PIB_OP_WRITE;
+	dop.op.addr = req->addr;
+	dop.size = req->data;
+	adu = req_adu(req);
+	*error = !adu || queue_op(&dop, adu, mem_run) || pib_wait(&dop.req);
+	rc = remote_send_resp(fd, *error ? -1 : 0, DAEMON_END, 0);
+out:
+	free(dop.buf);
+
+	return rc;
+}
+
+/* Run a batch of PIB operations on one processor as a single request
+ * on its link */
+static int serve_batch(int fd, struct daemon_req *req, bool *failed, bool *error)
+{
+	struct pib_op ops[DAEMON_MAX_BATCH];
+	struct daemon_op dop;
+	struct target *pib;
+	int i, rc;
+
+	if (req->data > DAEMON_MAX_BATCH || remote_recv_ops(fd, ops, req->data))
+		return -1;
+
+	/* Pipelined batches stop at the first one which fails */
+	if ((req->flags & DAEMON_IF_OK) && *failed)
+		return remote_send_resp(fd, -1, DAEMON_END, 0);
+
+	*failed = true;
+	for_each_class_target("pib", pib)
+		if (proc_selected(req, pib))
+			break;
+	if (!pib) {
+		*error = true;
+		return remote_send_resp(fd, -1, DAEMON_END, 0);
+	}
+
+	memset(&dop, 0, sizeof(dop));
+	dop.req.target = pib;
+	dop.req.ops = ops;
+	dop.req.count = req->data;
+	*error = pib_submit(&dop.req) || pib_wait(&dop.req);
+	if (*error)
+		return remote_send_resp(fd, -1, DAEMON_END, 0);
+	*failed = false;
+
+	for (i = 0; i < req->data; i++) {
+		rc = remote_send_resp(fd, 0, i, ops[i].data);
+		if (rc)
+			return rc;
+	}
+
+	return remote_send_resp(fd, 0, DAEMON_END, 0);
+}
+
+/* What identifies the IPL of the chip behind each link, which changes
+ * when the host is powered on, off or rebooted (see target_link_id()) */
+static struct target **links;
+static uint64_t *link_ids;
+static int nr_links;
+
+static void links_record(void)
+{
+	struct dt_node *dn;
+
+	nr_links = 0;
+	dt_for_each_node(dt_root, dn) {
+		if (!dn->target || target_link(dn->target) != dn->target)
+			continue;
+
+		links = realloc(links, (nr_links + 1) * sizeof(*links));
+		link_ids = realloc(link_ids, (nr_links + 1) * sizeof(*link_ids));
+		assert(links && link_ids);
+		links[nr_links] = dn->target;
+		link_ids[nr_links++] = target_link_id(dn->target);
+	}
+}
+
+/* Called with daemon_lock held for writing after a request failed or
+ * found nothing to access. If the host's power state has changed since
+ * the links were last looked at everything below them is probed
+ * again. */
+static void links_check(void)
+{
+	bool changed = false;
+	uint64_t id;
+	int i;
+
+	for (i = 0; i < nr_links; i++) {
+		id = target_link_id(links[i]);
+		if (target_link_changed(link_ids[i], id))
+			changed = true;
+		link_ids[i] = id;
+	}
+
+	if (changed) {
+		PR_INFO("Host power state changed, probing again\n");
+		target_invalidate();
+	}
+}
+
+/* Returns non-zero if the connection should be dropped. failed tracks
+ * whether the client's last batch failed. */
+static int serve_req(int fd, struct daemon_req *req, bool *failed)
+{
+	bool error = false;
+	int rc;
+
+	if (req->op == DAEMON_INVALIDATE) {
+		pthread_rwlock_wrlock(&daemon_lock);
+		target_invalidate();
+		links_record();
+		pthread_rwlock_unlock(&daemon_lock);
+
+		return remote_send_resp(fd, 0, DAEMON_END, 0);
+	}
+
+	pthread_rwlock_rdlock(&daemon_lock);
+	switch (req->op) {
+	case DAEMON_GETSCOM:
+	case DAEMON_PUTSCOM:
+	case DAEMON_GETCFAM:
+	case DAEMON_PUTCFAM:
+		rc = serve_per_proc(fd, req, &error);
+		break;
+
+	case DAEMON_GETMEM:
+		rc = serve_getmem(fd, req, &error);
+		break;
+
+	case DAEMON_PUTMEM:
+		rc = serve_putmem(fd, req, &error);
+		break;
+
+	case DAEMON_BATCH:
+		rc = serve_batch(fd, req, failed, &error);
+		break;
+
+	default:
+		rc = -1;
+		break;
+	}
+	pthread_rwlock_unlock(&daemon_lock);
+
+	/* Failures are the first sign of the host going away or coming
+	 * back */
+	if (error) {
+		pthread_rwlock_wrlock(&daemon_lock);
+		links_check();
+		pthread_rwlock_unlock(&daemon_lock);
+	}
+
+	return rc;
+}
+
+/* Check the first request is DAEMON_AUTH with our token. Every byte is
+ * compared so the time taken doesn't give away how much matched. */
+static int client_auth(int fd)
+{
+	struct daemon_req req;
+	char token[DAEMON_MAX_TOKEN];
+	size_t i, len = strlen(daemon_token);
+	uint8_t diff;
+
+	if (remote_recv_req(fd, &req) || req.op != DAEMON_AUTH || req.data > DAEMON_MAX_TOKEN ||
+	    remote_recv_all(fd, token, req.data))
+		return -1;
+
+	diff = req.data != len;
+	for (i = 0; i < req.data && i < len; i++)
+		diff |= token[i] ^ daemon_token[i];
+
+	if (diff) {
+		PR_ERROR("Refusing client with the wrong token\n");
+		remote_send_resp(fd, -1, DAEMON_END, 0);
+		return -1;
+	}
+
+	return remote_send_resp(fd, 0, DAEMON_END, 0);
+}
+
+/* Each client gets a thread of its own, which handles its requests
+ * until it disconnects or sends something invalid */
+static void *client_thread(void *arg)
+{
+	int fd = (intptr_t) arg;
+	struct daemon_req req;
+	bool failed = false;
+
+	if (daemon_token && client_auth(fd)) {
+		close(fd);
+		return NULL;
+	}
+
+	while (!remote_recv_req(fd, &req) && !serve_req(fd, &req, &failed));
+	close(fd);
+
+	return NULL;
+}
+
+static void stop_handler(int sig)
+{
+	daemon_stop = 1;
+}
+
+/* Listen on a UNIX socket which only our user may connect to. It is
+ * created without permissions for anyone else, so there is no window
+ * where they could connect. */
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	mode_t mask;
+	int fd, rc;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		PR_ERROR("Socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		PR_ERROR("Unable to create socket: %m\n");
+		return -1;
+	}
+
+	unlink(path);
+	mask = umask(0077);
+	rc = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+	if (rc || listen(fd, SOMAXCONN)) {
+		PR_ERROR("Unable to listen on %s: %m\n", path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Only root and our own user may use a UNIX socket, whatever the
+ * permissions on it */
+static bool peer_allowed(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		PR_ERROR("Unable to identify client: %m\n");
+		return false;
+	}
+
+	if (cred.uid && cred.uid != geteuid()) {
+		PR_ERROR("Refusing client with uid %d\n", (int) cred.uid);
+		return false;
+	}
+
+	return true;
+}
+
+static bool is_loopback(const struct sockaddr *sa)
+{
+	const struct in6_addr *addr6;
+
+	if (sa->sa_family == AF_INET)
+		return ntohl(((const struct sockaddr_in *) sa)->sin_addr.s_addr) >> 24 == 127;
+
+	if (sa->sa_family == AF_INET6) {
+		addr6 = &((const struct sockaddr_in6 *) sa)->sin6_addr;
+		return IN6_IS_ADDR_LOOPBACK(addr6) ||
+			(IN6_IS_ADDR_V4MAPPED(addr6) && addr6->s6_addr[12] == 127);
+	}
+
+	return false;
+}
+
+/* TCP has no such protection, so clients need the token as well and
+ * only loopback addresses are used unless any is true as the token is
+ * sent in the clear */
+static int listen_tcp(const char *address, bool any)
+{
+	struct addrinfo *res, *ai;
+	int fd = -1, one = 1;
+	bool refused = false;
+
+	if (remote_getaddrinfo(address, &res))
+		return -1;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (!any && !is_loopback(ai->ai_addr)) {
+			refused = true;
+			continue;
+		}
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, SOMAXCONN))
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0 && refused)
+		PR_ERROR("Refusing to listen on %s without --listen-any as it isn't loopback\n", address);
+	else if (fd < 0)
+		PR_ERROR("Unable to listen on %s: %m\n", address);
+
+	return fd;
+}
+
+/* Serve requests on a UNIX socket or TCP address (see
+ * remote_connect()) until interrupted. TCP clients must give the token
+ * in DAEMON_TOKEN_ENV and addresses other than loopback are only used
+ * if listen_any is set. The targets are only set
+ * up and probed once however many clients come and go. Returns 1 on a
+ * clean exit or 0 on failure. */
+int daemon_serve(const char *path, bool listen_any)
+{
+	struct sigaction sa = { .sa_handler = stop_handler };
+	bool unix_socket = strchr(path, '/');
+	pthread_t thread;
+	int fd, client, one = 1;
+
+	if (!unix_socket) {
+		daemon_token = getenv(DAEMON_TOKEN_ENV);
+		if (!daemon_token || !*daemon_token || strlen(daemon_token) > DAEMON_MAX_TOKEN) {
+			PR_ERROR("Set %s to a token of up to %d characters for clients to give\n",
+				 DAEMON_TOKEN_ENV, DAEMON_MAX_TOKEN);
+			return 0;
+		}
+	}
+
+	fd = unix_socket ? listen_unix(path) : listen_tcp(path, listen_any);
+	if (fd < 0)
+		return 0;
+
+	links_record();
+
+	/* Clients going away mustn't take us with them, and accept()
+	 * needs interrupting to stop */
+	signal(SIGPIPE, SIG_IGN);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	PR_INFO("Listening on %s\n", path);
+	while (!daemon_stop) {
+		client = accept(fd, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			PR_ERROR("Unable to accept connection: %m\n");
+			break;
+		}
+
+		if (unix_socket && !peer_allowed(client)) {
+			close(client);
+			continue;
+		}
+
+		if (!unix_socket)
+			setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		if (pthread_create(&thread, NULL, client_thread, (void *) (intptr_t) client)) {
+			close(client);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	close(fd);
+	if (unix_socket)
+		unlink(path);
+
+	return daemon_stop;
+}
+
+static int client_getmem(int fd, struct daemon_req *req, const char *filename)
+{
+	struct daemon_resp resp = { .rc = -1 };
+	uint8_t *buf;
+	int out = STDOUT_FILENO, rc = -1;
+
+	if (filename) {
+		out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out < 0) {
+			PR_ERROR("Unable to open %s: %m\n", filename);
+			return -1;
+		}
+	}
+
+	buf = malloc(DAEMON_MAX_GETMEM);
+	assert(buf);
+
+	if (remote_send_req(fd, req))
+		goto out;
+
+	while (!remote_recv_resp(fd, &resp) && resp.index != DAEMON_END) {
+		if (resp.data > DAEMON_MAX_GETMEM || remote_recv_all(fd, buf, resp.data) ||
+		    remote_send_all(out, buf, resp.data))
+			goto out;
+	}
+
+	if (resp.index == DAEMON_END && !resp.rc)
+		rc = 1;
+out:
+	free(buf);
+	if (filename)
+		close(out);
+
+	return rc;
+}
+
+/* Stdin is sent a chunk at a time, returning the number of bytes
+ * written */
+static int client_putmem(int fd, struct daemon_req *req)
+{
+	struct daemon_resp resp;
+	uint8_t *buf;
+	ssize_t len;
+	int rc = 0;
+
+	buf = malloc(DAEMON_MAX_PUTMEM);
+	assert(buf);
+
+	while ((len = read(STDIN_FILENO, buf, DAEMON_MAX_PUTMEM)) > 0) {
+		req->data = len;
+		if (remote_send_req(fd, req) || remote_send_all(fd, buf, len) ||
+		    remote_recv_resp(fd, &resp) || resp.rc) {
+			PR_ERROR("Unable to write memory at 0x%016" PRIx64 "\n", req->addr);
+			break;
+		}
+
+		req->addr += len;
+		rc += len;
+	}
+
+	free(buf);
+
+	return rc;
+}
+
+/* Send a request to the daemon at path and print the results the same
+ * way as running the command locally would. Returns the number of
+ * processors the access worked on, 1 if a getmem worked or the number
+ * of bytes written by a putmem. Anything less than 1 is a failure. */
+int daemon_client(const char *path, struct daemon_req *req, const char *filename)
+{
+	struct daemon_resp resp = { .rc = -1 };
+	int fd, rc = -1;
+
+	fd = remote_connect(path);
+	if (fd < 0)
+		return -1;
+
+	switch (req->op) {
+	case DAEMON_GETMEM:
+		rc = client_getmem(fd, req, filename);
+		break;
+
+	case DAEMON_PUTMEM:
+		rc = client_putmem(fd, req);
+		break;
+
+	default:
+		if (remote_send_req(fd, req))
+			break;
+
+		while (!remote_recv_resp(fd, &resp) && resp.index != DAEMON_END) {
+			if (resp.rc)
+				continue;
+
+			if (req->op == DAEMON_GETSCOM)
+				printf("p%d:0x%" PRIx64 " = 0x%016" PRIx64 "\n",
+				       resp.index, req->addr, resp.data);
+			else if (req->op == DAEMON_GETCFAM)
+				printf("p%d:0x%x = 0x%08x\n",
+				       resp.index, (uint32_t) req->addr, (uint32_t) resp.data);
+		}
+
+		if (resp.index == DAEMON_END)
+			rc = resp.rc;
+		break;
+	}
+
+	close(fd);
+
+	return rc;
+}
@@ -0,0 +1,27 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __DAEMON_H
+#define __DAEMON_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <remote.h>
+
+int daemon_serve(const char *path, bool listen_any);
+int daemon_client(const char *path, struct daemon_req *req, const char *filename);
+
+#endif
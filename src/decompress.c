@@ -0,0 +1,58 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <compress.h>
+
+/* Expand dumps written by pdbg --compress */
+int main(int argc, char *argv[])
+{
+	int in_fd = STDIN_FILENO, out_fd = STDOUT_FILENO, rc;
+
+	if (argc > 3 || (argc > 1 && !strcmp(argv[1], "-h"))) {
+		fprintf(stderr, "Usage: %s [<input> [<output>]]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc > 1) {
+		in_fd = open(argv[1], O_RDONLY);
+		if (in_fd < 0) {
+			fprintf(stderr, "Unable to open %s: %m\n", argv[1]);
+			return 1;
+		}
+	}
+
+	if (argc > 2) {
+		out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out_fd < 0) {
+			fprintf(stderr, "Unable to open %s: %m\n", argv[2]);
+			return 1;
+		}
+	}
+
+	rc = decompress_stream(in_fd, out_fd);
+
+	close(in_fd);
+	if (close(out_fd) && !rc) {
+		fprintf(stderr, "Unable to write output: %m\n");
+		rc = -1;
+	}
+
+	return rc ? 1 : 0;
+}
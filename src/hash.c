@@ -0,0 +1,108 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "hash.h"
+
+/* XXH64. Four independent lanes each take a word of every 32 bytes so
+ * the multiplies can overlap, which keeps hashing well ahead of even
+ * the fastest backend. */
+#define PRIME1	0x9e3779b185ebca87ULL
+#define PRIME2	0xc2b2ae3d27d4eb4fULL
+#define PRIME3	0x165667b19e3779f9ULL
+#define PRIME4	0x85ebca77c2b2ae63ULL
+#define PRIME5	0x27d4eb2f165667c5ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t get64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t val)
+{
+	return rotl(acc + val * PRIME2, 31) * PRIME1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val)
+{
+	return (acc ^ round64(0, val)) * PRIME1 + PRIME4;
+}
+
+uint64_t hash64(const void *buf, size_t size, uint64_t seed)
+{
+	const uint8_t *p = buf, *end = p + size;
+	uint64_t v1, v2, v3, v4, h;
+
+	if (size >= 32) {
+		v1 = seed + PRIME1 + PRIME2;
+		v2 = seed + PRIME2;
+		v3 = seed;
+		v4 = seed - PRIME1;
+
+		for (; p + 32 <= end; p += 32) {
+			v1 = round64(v1, get64(p));
+			v2 = round64(v2, get64(p + 8));
+			v3 = round64(v3, get64(p + 16));
+			v4 = round64(v4, get64(p + 24));
+		}
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else
+		h = seed + PRIME5;
+
+	h += size;
+
+	for (; p + 8 <= end; p += 8)
+		h = rotl(h ^ round64(0, get64(p)), 27) * PRIME1 + PRIME4;
+
+	if (p + 4 <= end) {
+		h = rotl(h ^ (get32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+
+	for (; p < end; p++)
+		h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+
+	return h;
+}
@@ -25,15 +25,21 @@
 #include <assert.h>
 #include <limits.h>
 #include <inttypes.h>
+#include <endian.h>
+#include <sys/stat.h>
 
 #include <backend.h>
 #include <operations.h>
 #include <target.h>
 #include <device.h>
+#include <timing.h>
 
 #include <config.h>
 
 #include "bitutils.h"
+#include "mem.h"
+#include "hash.h"
+#include "daemon.h"
 
 #undef PR_DEBUG
 #define PR_DEBUG(...)
@@ -46,23 +52,47 @@ enum command { GETCFAM = 1, PUTCFAM, GETSCOM, PUTSCOM,	\
 	       STOP, START, THREADSTATUS, STEP, PROBE,	\
 	       GETVMEM, SRESET, HTM_STOP, HTM_ANALYSE,  \
 	       HTM_START, HTM_DUMP, HTM_RESET, HTM_GO,  \
-	       HTM_TRACE, HTM_STATUS };
+	       HTM_TRACE, HTM_STATUS, MEMSEARCH, MEMHASH,	\
+	       MEMVERIFY, MEMFILL, MEMCOPY, SCRIPT, DAEMON };
 
-#define MAX_CMD_ARGS 3
+#define MAX_CMD_ARGS 4
 enum command cmd = 0;
 static int cmd_arg_count = 0;
 static int cmd_min_arg_count = 0;
 static int cmd_max_arg_count = 0;
 
-/* At the moment all commands only take some kind of number */
+/* Most commands only take some kind of number. The raw strings are
+ * kept for the few arguments which aren't (eg. file names). */
 static uint64_t cmd_args[MAX_CMD_ARGS];
+static char *cmd_args_str[MAX_CMD_ARGS];
 
-enum backend { FSI, I2C, KERNEL, FAKE, HOST };
+/* Bitmask of the arguments which are only used as strings */
+static unsigned int cmd_str_args;
+
+enum backend { FSI, I2C, KERNEL, FAKE, HOST, REMOTE, SIM };
 static enum backend backend = KERNEL;
 
 static char const *device_node;
 static int i2c_addr = 0x50;
 
+/* Number of processors to read memory through in parallel */
+static int mem_jobs = 1;
+static int mem_priority = -1;
+static uint64_t mem_rate;
+static int mem_flags;
+static int htm_flags;
+
+/* Probe results are kept in here between invocations */
+#define PROBE_CACHE_DIR "/run/pdbg"
+static bool reprobe;
+static char *probe_cache;
+
+/* Socket of a pdbg daemon to send commands to */
+static char *daemon_socket;
+
+/* Let a daemon listen on addresses other than loopback */
+static bool daemon_listen_any;
+
 #define MAX_PROCESSORS 16
 #define MAX_CHIPS 24
 #define MAX_THREADS THREADS_PER_CORE
@@ -70,6 +100,23 @@ static int i2c_addr = 0x50;
 static int **processorsel[MAX_PROCESSORS];
 static int *chipsel[MAX_PROCESSORS][MAX_CHIPS];
 static int threadsel[MAX_PROCESSORS][MAX_CHIPS][MAX_THREADS];
+static int current_processor = INT_MAX, current_chip = INT_MAX, current_thread = INT_MAX;
+
+/* Nodes whose status target_select() changed and what it was before,
+ * so clear_selection() can put it back */
+struct selection_change {
+	struct dt_node *dn;
+	bool hidden;
+};
+static struct selection_change *selection_changes;
+static int nr_selection_changes;
+
+/* Commands in a script are run one per line. Lines select their own
+ * targets, or use the selection from the command line if they don't,
+ * and can't change anything which applies to the whole session. */
+#define MAX_SCRIPT_ARGS	32
+static bool script;
+static bool line_selects;
 
 /* Convenience functions */
 #define for_each_thread(x) while(0)
@@ -93,13 +140,50 @@ static void print_usage(char *pname)
 	printf("\t\ti2c:\tThe P8 only backend which goes via I2C.\n");
 	printf("\t\thost:\tUse the debugfs xscom nodes.\n");
 	printf("\t\tkernel:\tThe default backend which goes the kernel FSI driver.\n");
+	printf("\t\tremote:\tSend everything to a pdbg daemon over TCP.\n");
+	printf("\t\tsim:\tSimulate POWER8 or POWER9 processors in software.\n");
 	printf("\t-d, --device=backend device\n");
 	printf("\t\tFor I2C the device node used by the backend to access the bus.\n");
 	printf("\t\tFor FSI the system board type, one of p8 or p9w\n");
+	printf("\t\tFor remote the daemon's [host][:port], defaulting to\n");
+	printf("\t\tlocalhost:%s\n", DAEMON_PORT);
+	printf("\t\tFor sim the processor to simulate, one of p8 or p9\n");
 	printf("\t\tDefaults to /dev/i2c4 for I2C\n");
 	printf("\t-s, --slave-address=backend device address\n");
 	printf("\t\tDevice slave address to use for the backend. Not used by FSI\n");
 	printf("\t\tand defaults to 0x50 for I2C\n");
+	printf("\t-j, --jobs=count\n");
+	printf("\t\tRead memory through the ADUs of up to count processors\n");
+	printf("\t\tin parallel. Only useful when each processor has an\n");
+	printf("\t\tindependent link (eg. kernel or host backends)\n");
+	printf("\t--priority=low|medium|high\n");
+	printf("\t\tPowerBus drop priority for memory accesses. Lower priority\n");
+	printf("\t\tcommands are dropped first when the fabric is busy\n");
+	printf("\t--rate=MB/s\n");
+	printf("\t\tLimit memory accesses to the given rate to reduce the\n");
+	printf("\t\timpact on a running system\n");
+	printf("\t--sparse\n");
+	printf("\t\tSkip over memory which can't be read when using getmem\n");
+	printf("\t\twith a file, leaving holes in the file. The regions read\n");
+	printf("\t\tare listed in <file>.map\n");
+	printf("\t-z, --compress\n");
+	printf("\t\tCompress the output of getmem and htm_dump. Use\n");
+	printf("\t\tpdbg-decompress to expand it again\n");
+	printf("\t-D, --connect=socket\n");
+	printf("\t\tRun getscom, putscom, getcfam, putcfam, getmem or putmem\n");
+	printf("\t\tthrough a pdbg daemon listening on socket, which is either\n");
+	printf("\t\ta path or [host][:port]\n");
+	printf("\t--listen-any\n");
+	printf("\t\tLet daemon listen on TCP addresses other than loopback.\n");
+	printf("\t\tThe token in PDBG_TOKEN is sent in the clear\n");
+	printf("\t--timing=model[,parameter=value...]\n");
+	printf("\t\tReport how long the command would take over another\n");
+	printf("\t\ttransport, one of bmcfsi, kernel, i2c or host. The\n");
+	printf("\t\tparameters are syscall, bit, relax and access in ns,\n");
+	printf("\t\tjitter in percent and the seed for the jitter\n");
+	printf("\t--reprobe\n");
+	printf("\t\tProbe everything again rather than relying on what earlier\n");
+	printf("\t\tinvocations found, which is kept in %s\n", PROBE_CACHE_DIR);
 	printf("\t-V, --version\n");
 	printf("\t-h, --help\n");
 	printf("\n");
@@ -108,8 +192,13 @@ static void print_usage(char *pname)
 	printf("\tputcfam <address> <value> [<mask>]\n");
 	printf("\tgetscom <address>\n");
 	printf("\tputscom <address> <value> [<mask>]\n");
-	printf("\tgetmem <address> <count>\n");
+	printf("\tgetmem <address> <count> [<file>]\n");
 	printf("\tputmem <address>\n");
+	printf("\tmemsearch <address> <count> <pattern>[,<pattern>...] [<max>]\n");
+	printf("\tmemfill <address> <count> <pattern>\n");
+	printf("\tmemcopy <source> <destination> <count>\n");
+	printf("\tmemhash <address> <count> [<block size>]\n");
+	printf("\tmemverify <address> <count> <file> [<block size>]\n");
 	printf("\tgetvmem <virtual address>\n");
 	printf("\tgetgpr <gpr>\n");
 	printf("\tputgpr <gpr> <value>\n");
@@ -129,11 +218,14 @@ static void print_usage(char *pname)
 	printf("\thtm_dump\n");
 	printf("\thtm_trace\n");
 	printf("\thtm_analyse\n");
+	printf("\tscript <file>\n");
+	printf("\tdaemon <socket>\n");
 }
 
 enum command parse_cmd(char *optarg)
 {
 	cmd_max_arg_count = 0;
+	cmd_str_args = 0;
 
 	if (strcmp(optarg, "getcfam") == 0) {
 		cmd = GETCFAM;
@@ -158,6 +250,34 @@ enum command parse_cmd(char *optarg)
 	} else if (strcmp(optarg, "getmem") == 0) {
 		cmd = GETMEM;
 		cmd_min_arg_count = 2;
+		cmd_max_arg_count = 3;
+		cmd_str_args = 1 << 2;
+	} else if (strcmp(optarg, "memsearch") == 0) {
+		cmd = MEMSEARCH;
+		cmd_min_arg_count = 3;
+		cmd_max_arg_count = 4;
+		cmd_str_args = 1 << 2;
+
+		/* Report every match by default */
+		cmd_args[3] = 0;
+	} else if (strcmp(optarg, "memfill") == 0) {
+		cmd = MEMFILL;
+		cmd_min_arg_count = 3;
+		cmd_str_args = 1 << 2;
+	} else if (strcmp(optarg, "memcopy") == 0) {
+		cmd = MEMCOPY;
+		cmd_min_arg_count = 3;
+	} else if (strcmp(optarg, "memhash") == 0) {
+		cmd = MEMHASH;
+		cmd_min_arg_count = 2;
+		cmd_max_arg_count = 3;
+		cmd_args[2] = MEM_HASH_BLOCK_SIZE;
+	} else if (strcmp(optarg, "memverify") == 0) {
+		cmd = MEMVERIFY;
+		cmd_min_arg_count = 3;
+		cmd_max_arg_count = 4;
+		cmd_str_args = 1 << 2;
+		cmd_args[3] = MEM_HASH_BLOCK_SIZE;
 	} else if (strcmp(optarg, "putmem") == 0) {
 		cmd = PUTMEM;
 		cmd_min_arg_count = 1;
@@ -230,6 +350,14 @@ enum command parse_cmd(char *optarg)
 	} else if (strcmp(optarg, "htm_analyse") == 0) {
 		cmd = HTM_ANALYSE;
 		cmd_min_arg_count = 0;
+	} else if (strcmp(optarg, "script") == 0) {
+		cmd = SCRIPT;
+		cmd_min_arg_count = 1;
+		cmd_str_args = 1 << 0;
+	} else if (strcmp(optarg, "daemon") == 0) {
+		cmd = DAEMON;
+		cmd_min_arg_count = 1;
+		cmd_str_args = 1 << 0;
 	}
 
 	if (cmd_min_arg_count && !cmd_max_arg_count)
@@ -238,11 +366,25 @@ enum command parse_cmd(char *optarg)
 	return cmd;
 }
 
+/* The first selection option on a script line replaces the selection
+ * from the command line */
+static void start_selection(void)
+{
+	if (!script || line_selects)
+		return;
+
+	memset(processorsel, 0, sizeof(processorsel));
+	memset(chipsel, 0, sizeof(chipsel));
+	memset(threadsel, 0, sizeof(threadsel));
+	current_processor = current_chip = current_thread = INT_MAX;
+	line_selects = true;
+}
+
 static bool parse_options(int argc, char *argv[])
 {
 	int c, oidx = 0, cmd_arg_idx = 0;
 	bool opt_error = true;
-	static int current_processor = INT_MAX, current_chip = INT_MAX, current_thread = INT_MAX;
+	char *endptr;
 	struct option long_opts[] = {
 		{"all",			no_argument,		NULL,	'a'},
 		{"processor",		required_argument,	NULL,	'p'},
@@ -251,12 +393,21 @@ static bool parse_options(int argc, char *argv[])
 		{"backend",		required_argument,	NULL,	'b'},
 		{"device",		required_argument,	NULL,	'd'},
 		{"slave-address",	required_argument,	NULL,	's'},
+		{"jobs",		required_argument,	NULL,	'j'},
+		{"priority",		required_argument,	NULL,	'P'},
+		{"rate",		required_argument,	NULL,	'R'},
+		{"sparse",		no_argument,		NULL,	'S'},
+		{"compress",		no_argument,		NULL,	'z'},
+		{"reprobe",		no_argument,		NULL,	'r'},
+		{"connect",		required_argument,	NULL,	'D'},
+		{"listen-any",		no_argument,		NULL,	'L'},
+		{"timing",		required_argument,	NULL,	'T'},
 		{"version",		no_argument,		NULL,	'V'},
 		{"help",		no_argument,		NULL,	'h'},
 	};
 
 	do {
-		c = getopt_long(argc, argv, "-p:c:t:b:d:s:haV", long_opts, &oidx);
+		c = getopt_long(argc, argv, "-p:c:t:b:d:s:j:D:hazV", long_opts, &oidx);
 		switch(c) {
 		case 1:
 			/* Positional argument */
@@ -265,14 +416,19 @@ static bool parse_options(int argc, char *argv[])
 			else if (cmd_arg_idx >= MAX_CMD_ARGS ||
 				 (cmd && cmd_arg_idx >= cmd_max_arg_count))
 				opt_error = true;
-			else {
+			else if (cmd_str_args & (1 << cmd_arg_idx)) {
+				cmd_args_str[cmd_arg_idx++] = optarg;
+				opt_error = false;
+			} else {
 				errno = 0;
+				cmd_args_str[cmd_arg_idx] = optarg;
 				cmd_args[cmd_arg_idx++] = strtoull(optarg, NULL, 0);
 				opt_error = errno;
 			}
 			break;
 
 		case 'a':
+			start_selection();
 			opt_error = false;
 			for (current_processor = 0; current_processor < MAX_PROCESSORS; current_processor++) {
 				processorsel[current_processor] = &chipsel[current_processor][0];
@@ -285,6 +441,7 @@ static bool parse_options(int argc, char *argv[])
 			break;
 
 		case 'p':
+			start_selection();
 			errno = 0;
 			current_processor = strtoul(optarg, NULL, 0);
 			if (current_processor >= MAX_PROCESSORS)
@@ -295,6 +452,7 @@ static bool parse_options(int argc, char *argv[])
 			break;
 
 		case 'c':
+			start_selection();
 			errno = 0;
 			current_chip = strtoul(optarg, NULL, 0);
 			if (current_chip >= MAX_CHIPS)
@@ -305,6 +463,7 @@ static bool parse_options(int argc, char *argv[])
 			break;
 
 		case 't':
+			start_selection();
 			errno = 0;
 			current_thread = strtoul(optarg, NULL, 0);
 			if (current_thread >= MAX_THREADS)
@@ -330,6 +489,12 @@ static bool parse_options(int argc, char *argv[])
 				backend = FAKE;
 			} else if (strcmp(optarg, "host") == 0) {
 				backend = HOST;
+			} else if (strcmp(optarg, "remote") == 0) {
+				backend = REMOTE;
+				device_node = NULL;
+			} else if (strcmp(optarg, "sim") == 0) {
+				backend = SIM;
+				device_node = "p9";
 			} else
 				opt_error = true;
 			break;
@@ -345,6 +510,71 @@ static bool parse_options(int argc, char *argv[])
 			opt_error = errno;
 			break;
 
+		case 'j':
+			errno = 0;
+			mem_jobs = strtoul(optarg, NULL, 0);
+			if (mem_jobs < 1)
+				errno = -1;
+			opt_error = errno;
+			break;
+
+		case 'P':
+			opt_error = false;
+			if (strcmp(optarg, "low") == 0)
+				mem_priority = DROP_PRIORITY_LOW;
+			else if (strcmp(optarg, "medium") == 0)
+				mem_priority = DROP_PRIORITY_MEDIUM;
+			else if (strcmp(optarg, "high") == 0)
+				mem_priority = DROP_PRIORITY_HIGH;
+			else
+				opt_error = true;
+			break;
+
+		case 'R':
+			errno = 0;
+			mem_rate = strtoull(optarg, &endptr, 0);
+			if (errno || *endptr || !mem_rate ||
+			    mem_rate > ADU_MAX_RATE / (1024 * 1024)) {
+				fprintf(stderr, "Rate must be between 1 and %llu MB/s\n",
+					ADU_MAX_RATE / (1024 * 1024));
+				opt_error = true;
+				break;
+			}
+			mem_rate *= 1024 * 1024;
+			opt_error = false;
+			break;
+
+		case 'S':
+			opt_error = false;
+			mem_flags |= GETMEM_SPARSE;
+			break;
+
+		case 'z':
+			opt_error = false;
+			mem_flags |= GETMEM_COMPRESS;
+			htm_flags |= HTM_DUMP_COMPRESS;
+			break;
+
+		case 'r':
+			opt_error = false;
+			reprobe = true;
+			break;
+
+		case 'D':
+			opt_error = false;
+			daemon_socket = optarg;
+			break;
+
+		case 'L':
+			opt_error = false;
+			daemon_listen_any = true;
+			break;
+
+		case 'T':
+			/* Applies to the whole script */
+			opt_error = script || timing_init(optarg) != 0;
+			break;
+
 		case 'V':
 			errno = 0;
 			printf("%s (commit %s)\n", PACKAGE_STRING, GIT_SHA1);
@@ -358,7 +588,7 @@ static bool parse_options(int argc, char *argv[])
 	} while (c != EOF && !opt_error);
 
 	opt_error |= cmd_arg_idx < cmd_min_arg_count;
-	if (opt_error)
+	if (opt_error && !script)
 		print_usage(argv[0]);
 
 	cmd_arg_count = cmd_arg_idx;
@@ -366,6 +596,12 @@ static bool parse_options(int argc, char *argv[])
 	return opt_error;
 }
 
+/* Iterate over the selected targets of a class which are present,
+ * probing them on first use */
+#define for_each_present_target(class_name, target)			\
+	for_each_class_target(class_name, target)			\
+		if (!target_selected(target)) {} else
+
 /* Returns the sum of return codes. This can be used to count how many targets the callback was run on. */
 static int for_each_child_target(char *class, struct target *parent,
 				 int (*cb)(struct target *, uint32_t, uint64_t *, uint64_t *),
@@ -377,8 +613,6 @@ static int for_each_child_target(char *class, struct target *parent,
 	struct dt_node *dn;
 
 	for_each_class_target(class, target) {
-		struct dt_property *p;
-
 		dn = target->dn;
 		if (parent && dn->parent != parent->dn)
 			continue;
@@ -387,8 +621,7 @@ static int for_each_child_target(char *class, struct target *parent,
 		for (index = dn->target->index; index == -1; dn = dn->parent);
 		assert(index != -1);
 
-		p = dt_find_property(dn, "status");
-		if (p && (!strcmp(p->prop, "disabled") || !strcmp(p->prop, "hidden")))
+		if (!target_selected(target))
 			continue;
 
 		rc += cb(target, index, arg1, arg2);
@@ -422,24 +655,83 @@ static int putcfam(struct target *target, uint32_t index, uint64_t *addr, uint64
 	return 1;
 }
 
-static int getscom(struct target *target, uint32_t index, uint64_t *addr, uint64_t *unused)
-{
-	uint64_t value;
+/* SCOM accesses for every selected processor are queued together so
+ * chips on separate links are accessed in parallel */
+struct scom_req {
+	struct pib_req req;
+	struct pib_op op;
+	uint32_t index;
+};
 
-	if (pib_read(target, *addr, &value))
+static struct scom_req **scom_reqs;
+static int nr_scom_reqs;
+
+static int queue_scom(struct target *target, uint32_t index, struct pib_op *op)
+{
+	struct scom_req *scom;
+
+	scom = calloc(1, sizeof(*scom));
+	scom_reqs = realloc(scom_reqs, (nr_scom_reqs + 1) * sizeof(*scom_reqs));
+	assert(scom && scom_reqs);
+
+	scom->op = *op;
+	scom->index = index;
+	scom->req.target = target;
+	scom->req.ops = &scom->op;
+	scom->req.count = 1;
+	if (pib_submit(&scom->req)) {
+		free(scom);
 		return 0;
+	}
 
-	printf("p%d:0x%" PRIx64 " = 0x%016" PRIx64 "\n", index, *addr, value);
+	scom_reqs[nr_scom_reqs++] = scom;
 
 	return 1;
 }
 
+/* Wait for the queued accesses in order, printing the values read.
+ * Returns the number which succeeded. */
+static int wait_scoms(void)
+{
+	struct scom_req *scom;
+	int i, rc = 0;
+
+	for (i = 0; i < nr_scom_reqs; i++) {
+		scom = scom_reqs[i];
+		if (!pib_wait(&scom->req)) {
+			if (scom->op.type == PIB_OP_READ)
+				printf("p%d:0x%" PRIx64 " = 0x%016" PRIx64 "\n",
+				       scom->index, scom->op.addr, scom->op.data);
+			rc++;
+		}
+		free(scom);
+	}
+
+	free(scom_reqs);
+	scom_reqs = NULL;
+	nr_scom_reqs = 0;
+
+	return rc;
+}
+
+static int getscom(struct target *target, uint32_t index, uint64_t *addr, uint64_t *unused)
+{
+	struct pib_op op = { .type = PIB_OP_READ, .addr = *addr };
+
+	return queue_scom(target, index, &op);
+}
+
+/* data points to the value followed by the mask */
 static int putscom(struct target *target, uint32_t index, uint64_t *addr, uint64_t *data)
 {
-	if (pib_write(target, *addr, *data))
-		return 0;
+	struct pib_op op = { .type = PIB_OP_WRITE, .addr = *addr, .data = data[0] };
 
-	return 1;
+	if (data[1] != -1ULL) {
+		op.type = PIB_OP_RMW;
+		op.mask = data[1];
+	}
+
+	return queue_scom(target, index, &op);
 }
 
 static int print_thread_status(struct target *thread_target, uint32_t index, uint64_t *status, uint64_t *unused1)
@@ -571,25 +863,40 @@ static int getprocreg(struct target *thread_target, uint32_t index, uint64_t *re
 }
 
 #define PUTMEM_BUF_SIZE 1024
+static int get_mem_jobs(void)
+{
+	if (mem_jobs > 1 && (backend == FSI || backend == I2C)) {
+		/* These backends share a single bus between all
+		 * processors so there is nothing to gain */
+		PR_INFO("Backend accesses are serialised, ignoring --jobs\n");
+		return 1;
+	}
+
+	return mem_jobs;
+}
+
 static int putmem(uint64_t addr)
 {
         uint8_t *buf;
         int read_size, rc = 0;
         struct target *adu_target;
 
-	for_each_class_target("adu", adu_target)
-		break;
-
         buf = malloc(PUTMEM_BUF_SIZE);
         assert(buf);
 	do {
                 read_size = read(STDIN_FILENO, buf, PUTMEM_BUF_SIZE);
-                if (adu_putmem(adu_target, addr, buf, read_size)) {
+		if (read_size <= 0)
+			break;
+
+		/* The data may land on a different chip each time */
+		adu_target = mem_adu(addr, read_size);
+                if (!adu_target || adu_putmem(adu_target, addr, buf, read_size)) {
                         rc = 0;
                         PR_ERROR("Unable to write memory.\n");
                         break;
                 }
                 rc += read_size;
+                addr += read_size;
         } while (read_size > 0);
 
         free(buf);
@@ -616,6 +923,14 @@ static int sreset_thread(struct target *thread_target, uint32_t index, uint64_t
 	return ram_sreset_thread(thread_target) ? 0 : 1;
 }
 
+static void record_selection_change(struct dt_node *dn, bool hidden)
+{
+	selection_changes = realloc(selection_changes,
+				    (nr_selection_changes + 1) * sizeof(*selection_changes));
+	assert(selection_changes);
+	selection_changes[nr_selection_changes++] = (struct selection_change) { dn, hidden };
+}
+
 static void enable_dn(struct dt_node *dn)
 {
 	struct dt_property *p;
@@ -632,6 +947,7 @@ static void enable_dn(struct dt_node *dn)
 		return;
 
 	dt_del_property(dn, p);
+	record_selection_change(dn, true);
 }
 
 static void disable_dn(struct dt_node *dn)
@@ -647,6 +963,7 @@ static void disable_dn(struct dt_node *dn)
 		return;
 
 	dt_add_property_string(dn, "status", "disabled");
+	record_selection_change(dn, false);
 }
 
 static char *get_htm_dump_filename(void)
@@ -674,7 +991,7 @@ static int run_htm_start(void)
 	struct target *target;
 	int rc = 0;
 
-	for_each_class_target("htm", target) {
+	for_each_present_target("htm", target) {
 		printf("Starting HTM@%d#%d\n",
 			dt_get_chip_id(target->dn), target->index);
 		if (htm_start(target) != 1)
@@ -691,7 +1008,7 @@ static int run_htm_stop(void)
 	struct target *target;
 	int rc = 0;
 
-	for_each_class_target("htm", target) {
+	for_each_present_target("htm", target) {
 		printf("Stopping HTM@%d#%d\n",
 			dt_get_chip_id(target->dn), target->index);
 		if (htm_stop(target) != 1)
@@ -708,7 +1025,7 @@ static int run_htm_status(void)
 	struct target *target;
 	int rc = 0;
 
-	for_each_class_target("htm", target) {
+	for_each_present_target("htm", target) {
 		printf("HTM@%d#%d\n",
 			dt_get_chip_id(target->dn), target->index);
 		if (htm_status(target) != 1)
@@ -727,7 +1044,7 @@ static int run_htm_reset(void)
 	struct target *target;
 	int rc = 0;
 
-	for_each_class_target("htm", target) {
+	for_each_present_target("htm", target) {
 		printf("Resetting HTM@%d#%d\n",
 			dt_get_chip_id(target->dn), target->index);
 		if (htm_reset(target, &base, &size) != 1)
@@ -759,10 +1076,10 @@ static int run_htm_dump(void)
 
 	/* size = 0 will dump everything */
 	printf("Dumping HTM trace to file [chip].[#]%s\n", filename);
-	for_each_class_target("htm", target) {
+	for_each_present_target("htm", target) {
 		printf("Dumping HTM@%d#%d\n",
 			dt_get_chip_id(target->dn), target->index);
-		if (htm_dump(target, 0, filename) == 1)
+		if (htm_dump(target, 0, filename, htm_flags) == 1)
 			printf("Couldn't dump HTM@%d#%d\n",
 				dt_get_chip_id(target->dn), target->index);
 		rc++;
@@ -778,7 +1095,7 @@ static int run_htm_trace(void)
 	struct target *target;
 	int rc = 0;
 
-	for_each_class_target("htm", target) {
+	for_each_present_target("htm", target) {
 		/*
 		 * Don't mind if stop fails, it will fail if it wasn't
 		 * running, if anything bad is happening reset will fail
@@ -799,7 +1116,7 @@ static int run_htm_trace(void)
 		old_base = base;
 	}
 
-	for_each_class_target("htm", target) {
+	for_each_present_target("htm", target) {
 		printf("Starting HTM@%d#%d\n",
 			dt_get_chip_id(target->dn), target->index);
 		if (htm_start(target) != 1)
@@ -817,7 +1134,7 @@ static int run_htm_analyse(void)
 	char *filename;
 	int rc = 0;
 
-	for_each_class_target("htm", target)
+	for_each_present_target("htm", target)
 		htm_stop(target);
 
 	filename = get_htm_dump_filename();
@@ -825,10 +1142,10 @@ static int run_htm_analyse(void)
 		return 0;
 
 	printf("Dumping HTM trace to file [chip].[#]%s\n", filename);
-	for_each_class_target("htm", target) {
+	for_each_present_target("htm", target) {
 		printf("Dumping HTM@%d#%d\n",
 			dt_get_chip_id(target->dn), target->index);
-		if (htm_dump(target, 0, filename) != 1)
+		if (htm_dump(target, 0, filename, htm_flags) != 1)
 			printf("Couldn't dump HTM@%d#%d\n",
 				dt_get_chip_id(target->dn), target->index);
 		rc++;
@@ -839,42 +1156,87 @@ static int run_htm_analyse(void)
 }
 
 /* TODO: It would be nice to have a more dynamic way of doing this */
-extern unsigned char _binary_p8_i2c_dtb_o_start;
+extern unsigned char _binary_p8_i2c_dtb_o_start[];
 extern unsigned char _binary_p8_i2c_dtb_o_end;
-extern unsigned char _binary_p8_fsi_dtb_o_start;
+extern unsigned char _binary_p8_fsi_dtb_o_start[];
 extern unsigned char _binary_p8_fsi_dtb_o_end;
-extern unsigned char _binary_p9w_fsi_dtb_o_start;
+extern unsigned char _binary_p9w_fsi_dtb_o_start[];
 extern unsigned char _binary_p9w_fsi_dtb_o_end;
-extern unsigned char _binary_p9r_fsi_dtb_o_start;
+extern unsigned char _binary_p9r_fsi_dtb_o_start[];
 extern unsigned char _binary_p9r_fsi_dtb_o_end;
-extern unsigned char _binary_p9z_fsi_dtb_o_start;
+extern unsigned char _binary_p9z_fsi_dtb_o_start[];
 extern unsigned char _binary_p9z_fsi_dtb_o_end;
-extern unsigned char _binary_p9_kernel_dtb_o_start;
+extern unsigned char _binary_p9_kernel_dtb_o_start[];
 extern unsigned char _binary_p9_kernel_dtb_o_end;
-extern unsigned char _binary_fake_dtb_o_start;
+extern unsigned char _binary_fake_dtb_o_start[];
 extern unsigned char _binary_fake_dtb_o_end;
-extern unsigned char _binary_p8_host_dtb_o_start;
+extern unsigned char _binary_p8_host_dtb_o_start[];
 extern unsigned char _binary_p8_host_dtb_o_end;
-extern unsigned char _binary_p9_host_dtb_o_start;
+extern unsigned char _binary_p9_host_dtb_o_start[];
 extern unsigned char _binary_p9_host_dtb_o_end;
-static int target_select(void)
+extern unsigned char _binary_remote_dtb_o_start[];
+extern unsigned char _binary_remote_dtb_o_end;
+extern unsigned char _binary_p8_sim_dtb_o_start[];
+extern unsigned char _binary_p8_sim_dtb_o_end;
+extern unsigned char _binary_p9_sim_dtb_o_start[];
+extern unsigned char _binary_p9_sim_dtb_o_end;
+
+/* Probe results are only reused when everything deciding what there
+ * is to probe is the same: the backend and its device, the device tree
+ * and the boot of the machine we are running on. With the host backend
+ * that covers any reconfiguration of the hardware. On a BMC the host
+ * can be powered on or off underneath us. Targets which have gone are
+ * noticed when they fail to probe, and new ones because the time of day
+ * behind each link, which restarts at every IPL, is checked before
+ * trusting what was found absent below it. */
+static char *probe_cache_path(void *fdt)
 {
-	struct target *fsi, *pib, *chip, *thread;
+	char boot_id[64] = "", *path;
+	uint64_t key;
+	FILE *f;
+
+	f = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (f) {
+		if (!fgets(boot_id, sizeof(boot_id), f))
+			boot_id[0] = '\0';
+		fclose(f);
+	}
+
+	/* The second word of the blob's header is its total size */
+	key = hash64(fdt, be32toh(((uint32_t *) fdt)[1]), 0);
+	key = hash64(&backend, sizeof(backend), key);
+	key = hash64(&i2c_addr, sizeof(i2c_addr), key);
+	if (device_node)
+		key = hash64(device_node, strlen(device_node), key);
+	key = hash64(boot_id, strlen(boot_id), key);
+
+	if (mkdir(PROBE_CACHE_DIR, 0700) && errno != EEXIST)
+		return NULL;
+
+	if (asprintf(&path, PROBE_CACHE_DIR "/probe-%016" PRIx64, key) < 0)
+		return NULL;
+
+	return path;
+}
+
+static int load_targets(void)
+{
+	void *fdt;
 
 	switch (backend) {
 	case I2C:
-		targets_init(&_binary_p8_i2c_dtb_o_start);
+		fdt = _binary_p8_i2c_dtb_o_start;
 		break;
 
 	case FSI:
 		if (!strcmp(device_node, "p8"))
-			targets_init(&_binary_p8_fsi_dtb_o_start);
+			fdt = _binary_p8_fsi_dtb_o_start;
 		else if (!strcmp(device_node, "p9w") || !strcmp(device_node, "witherspoon"))
-			targets_init(&_binary_p9w_fsi_dtb_o_start);
+			fdt = _binary_p9w_fsi_dtb_o_start;
 		else if (!strcmp(device_node, "p9r") || !strcmp(device_node, "romulus"))
-			targets_init(&_binary_p9r_fsi_dtb_o_start);
+			fdt = _binary_p9r_fsi_dtb_o_start;
 		else if (!strcmp(device_node, "p9z") || !strcmp(device_node, "zaius"))
-			targets_init(&_binary_p9z_fsi_dtb_o_start);
+			fdt = _binary_p9z_fsi_dtb_o_start;
 		else {
 			PR_ERROR("Invalid device type specified\n");
 			return -1;
@@ -882,32 +1244,61 @@ static int target_select(void)
 		break;
 
 	case KERNEL:
-		targets_init(&_binary_p9_kernel_dtb_o_start);
+		fdt = _binary_p9_kernel_dtb_o_start;
 		break;
 
 	case FAKE:
-		targets_init(&_binary_fake_dtb_o_start);
+		fdt = _binary_fake_dtb_o_start;
 		break;
 
 	case HOST:
 		if (!strcmp(device_node, "p8"))
-			targets_init(&_binary_p8_host_dtb_o_start);
+			fdt = _binary_p8_host_dtb_o_start;
 		else if (!strcmp(device_node, "p9"))
-			targets_init(&_binary_p9_host_dtb_o_start);
+			fdt = _binary_p9_host_dtb_o_start;
 		else {
 			PR_ERROR("Unsupported device type for host backend\n");
 			return -1;
 		}
 		break;
 
+	case REMOTE:
+		remote_init(device_node);
+		fdt = _binary_remote_dtb_o_start;
+		break;
+
+	case SIM:
+		if (!strcmp(device_node, "p8"))
+			fdt = _binary_p8_sim_dtb_o_start;
+		else if (!strcmp(device_node, "p9"))
+			fdt = _binary_p9_sim_dtb_o_start;
+		else {
+			PR_ERROR("Unsupported device type for sim backend\n");
+			return -1;
+		}
+		break;
+
 	default:
 		PR_ERROR("Invalid backend specified\n");
 		return -1;
 	}
 
-	/* At this point we should have a device-tree loaded. We want
-	 * to walk the tree and disabled nodes we don't care about
-	 * prior to probing. */
+	targets_init(fdt);
+
+	/* Listing the targets always looks at the hardware afresh */
+	probe_cache = probe_cache_path(fdt);
+	if (probe_cache && !reprobe && cmd != PROBE)
+		probe_cache_load(probe_cache);
+
+	return 0;
+}
+
+/* Walk the tree and disable nodes we don't care about, which then
+ * don't get probed */
+static void target_select(void)
+{
+	struct target *fsi, *pib, *chip, *thread;
+
 	for_each_class_target("pib", pib) {
 		int proc_index = pib->index;
 
@@ -947,8 +1338,31 @@ static int target_select(void)
 		else
 			disable_dn(fsi->dn);
 	}
+}
 
-	return 0;
+/* Put back the status of everything target_select() enabled or
+ * disabled, apart from targets found to be absent since, so the next
+ * selection starts from the same tree */
+static void clear_selection(void)
+{
+	struct dt_property *p;
+	struct dt_node *dn;
+	int i;
+
+	for (i = 0; i < nr_selection_changes; i++) {
+		dn = selection_changes[i].dn;
+		if (dn->target && dn->target->status == TARGET_ABSENT)
+			continue;
+
+		p = dt_find_property(dn, "status");
+		if (p && !strcmp(p->prop, "disabled"))
+			dt_del_property(dn, p);
+
+		if (selection_changes[i].hidden && !dt_find_property(dn, "status"))
+			dt_add_property_string(dn, "status", "hidden");
+	}
+
+	nr_selection_changes = 0;
 }
 
 void print_target(struct dt_node *dn, int level)
@@ -992,20 +1406,11 @@ void print_target(struct dt_node *dn, int level)
 		print_target(next, level + 1);
 }
 
-int main(int argc, char *argv[])
+/* Returns the number of targets the command ran on, or something
+ * less than one if it failed */
+static int __run_command(void)
 {
 	int rc = 0;
-	uint8_t *buf;
-	struct target *target;
-
-	if (parse_options(argc, argv))
-		return 1;
-
-	/* Disable unselected targets */
-	if (target_select())
-		return 1;
-
-	target_probe();
 
 	switch(cmd) {
 	case GETCFAM:
@@ -1015,28 +1420,30 @@ int main(int argc, char *argv[])
 		rc = for_each_target("fsi", putcfam, &cmd_args[0], &cmd_args[1]);
 		break;
 	case GETSCOM:
-		rc = for_each_target("pib", getscom, &cmd_args[0], NULL);
+		for_each_target("pib", getscom, &cmd_args[0], NULL);
+		rc = wait_scoms();
 		break;
 	case PUTSCOM:
-		rc = for_each_target("pib", putscom, &cmd_args[0], &cmd_args[1]);
+		for_each_target("pib", putscom, &cmd_args[0], &cmd_args[1]);
+		rc = wait_scoms();
 		break;
 	case GETMEM:
-                buf = malloc(cmd_args[1]);
-                assert(buf);
-		for_each_class_target("adu", target) {
-			if (!adu_getmem(target, cmd_args[0], buf, cmd_args[1])) {
-				if (write(STDOUT_FILENO, buf, cmd_args[1]) < 0)
-					PR_ERROR("Unable to write stdout.\n");
-				else
-					rc++;
-			} else
-				PR_ERROR("Unable to read memory.\n");
-
-			/* We only ever care about getting memory from a single processor */
-			break;
-		}
-
-		free(buf);
+		rc = getmem(cmd_args[0], cmd_args[1], cmd_args_str[2], get_mem_jobs(), mem_flags);
+		break;
+	case MEMSEARCH:
+		rc = memsearch(cmd_args[0], cmd_args[1], cmd_args_str[2], cmd_args[3], get_mem_jobs());
+		break;
+	case MEMFILL:
+		rc = memfill(cmd_args[0], cmd_args[1], cmd_args_str[2]);
+		break;
+	case MEMCOPY:
+		rc = memcopy(cmd_args[0], cmd_args[1], cmd_args[2], get_mem_jobs());
+		break;
+	case MEMHASH:
+		rc = memhash(cmd_args[0], cmd_args[1], cmd_args[2], get_mem_jobs());
+		break;
+	case MEMVERIFY:
+		rc = memverify(cmd_args[0], cmd_args[1], cmd_args_str[2], cmd_args[3], get_mem_jobs());
 		break;
 	case PUTMEM:
                 rc = putmem(cmd_args[0]);
@@ -1090,6 +1497,7 @@ int main(int argc, char *argv[])
 		rc = for_each_target("thread", sreset_thread, NULL, NULL);
 		break;
 	case PROBE:
+		target_probe();
 		rc = 1;
 		print_target(dt_root, 0);
 		printf("\nNote that only selected targets will be shown above. If none are shown\n"
@@ -1117,17 +1525,236 @@ int main(int argc, char *argv[])
 	case HTM_ANALYSE:
 		rc = run_htm_analyse();
 		break;
+	case SCRIPT:
+	case DAEMON:
+		PR_ERROR("Scripts can only run commands which access targets\n");
+		break;
 	default:
 		PR_ERROR("Unsupported command\n");
 		break;
 	}
 
-	if (rc <= 0) {
-                printf("No valid targets found or specified. Try adding -p/-c/-t options to specify a target.\n");
-                printf("Alternatively run %s -a probe to get a list of all valid targets\n", argv[0]);
-		rc = 1;
-	} else
+
+	return rc;
+}
+
+static int run_command(void)
+{
+	struct timing_stats stats;
+	int rc;
+
+	if (!timing_enabled())
+		return __run_command();
+
+	timing_reset();
+	rc = __run_command();
+	timing_get_stats(&stats);
+	fprintf(stderr, "Projected time over %s: %" PRIu64 ".%06" PRIu64 " s "
+		"(%" PRIu64 " PIB and %" PRIu64 " CFAM accesses, bus busy %" PRIu64 ".%06" PRIu64 " s)\n",
+		timing_model_name(), timing_now() / 1000000000, timing_now() / 1000 % 1000000,
+		stats.pib_accesses, stats.cfam_accesses,
+		stats.busy / 1000000000, stats.busy / 1000 % 1000000);
+
+	return rc;
+}
+
+/* Run the commands in filename ("-" for stdin) one line at a time,
+ * following the output of each with a status line:
+ *
+ *	@@ <line number> ok|error
+ *
+ * Blank lines and lines starting with # are skipped. Returns 1 if every
+ * command succeeded or 0 if not. */
+static int run_script(const char *filename)
+{
+	int **def_processorsel[MAX_PROCESSORS];
+	int *def_chipsel[MAX_PROCESSORS][MAX_CHIPS];
+	int def_threadsel[MAX_PROCESSORS][MAX_CHIPS][MAX_THREADS];
+	int def_processor = current_processor, def_chip = current_chip, def_thread = current_thread;
+	int jobs = mem_jobs, flags = mem_flags, hflags = htm_flags;
+	enum backend def_backend = backend;
+	const char *def_device_node = device_node;
+	int def_i2c_addr = i2c_addr, def_priority = mem_priority;
+	uint64_t def_rate = mem_rate;
+	char *line = NULL, *args[MAX_SCRIPT_ARGS + 1], *saveptr;
+	int nr_args, lineno = 0, failed = 0, rc;
+	size_t len = 0;
+	FILE *f;
+
+	f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+	if (!f) {
+		PR_ERROR("Unable to open %s: %m\n", filename);
+		return 0;
+	}
+
+	memcpy(def_processorsel, processorsel, sizeof(processorsel));
+	memcpy(def_chipsel, chipsel, sizeof(chipsel));
+	memcpy(def_threadsel, threadsel, sizeof(threadsel));
+
+	script = true;
+	while (getline(&line, &len, f) > 0) {
+		lineno++;
+
+		args[0] = "pdbg";
+		nr_args = 1;
+		for (args[nr_args] = strtok_r(line, " \t\n", &saveptr); args[nr_args] && nr_args <= MAX_SCRIPT_ARGS;
+		     args[nr_args] = strtok_r(NULL, " \t\n", &saveptr))
+			nr_args++;
+
+		if (nr_args == 1 || args[1][0] == '#')
+			continue;
+
+		/* Each line starts from the command line's settings */
+		memcpy(processorsel, def_processorsel, sizeof(processorsel));
+		memcpy(chipsel, def_chipsel, sizeof(chipsel));
+		memcpy(threadsel, def_threadsel, sizeof(threadsel));
+		current_processor = def_processor;
+		current_chip = def_chip;
+		current_thread = def_thread;
+		line_selects = false;
+		mem_jobs = jobs;
+		mem_flags = flags;
+		htm_flags = hflags;
+		cmd = 0;
+		memset(cmd_args, 0, sizeof(cmd_args));
+		memset(cmd_args_str, 0, sizeof(cmd_args_str));
+		cmd_min_arg_count = cmd_max_arg_count = 0;
+
+		/* getopt needs resetting to parse a new argument list */
+		optind = 0;
 		rc = 0;
+		if (nr_args > MAX_SCRIPT_ARGS)
+			PR_ERROR("Line %d has too many arguments\n", lineno);
+		else if (parse_options(nr_args, args) || !cmd)
+			PR_ERROR("Invalid command on line %d\n", lineno);
+		else if (backend != def_backend || device_node != def_device_node ||
+			 i2c_addr != def_i2c_addr || mem_priority != def_priority ||
+			 mem_rate != def_rate)
+			PR_ERROR("Line %d changes options which apply to the whole script\n", lineno);
+		else {
+			target_select();
+			rc = run_command();
+			clear_selection();
+		}
+
+		/* Put back anything the line changed so later lines see the
+		 * session settings */
+		backend = def_backend;
+		device_node = def_device_node;
+		i2c_addr = def_i2c_addr;
+		mem_priority = def_priority;
+		mem_rate = def_rate;
+
+		if (rc <= 0)
+			failed++;
+		printf("@@ %d %s\n", lineno, rc > 0 ? "ok" : "error");
+		fflush(stdout);
+	}
+
+	free(line);
+	if (f != stdin)
+		fclose(f);
+
+	return failed ? 0 : 1;
+}
+
+/* Commands sent to a daemon run against its targets with only the
+ * processor selection passed on */
+static int run_daemon_command(void)
+{
+	struct daemon_req req = { .addr = cmd_args[0], .data = cmd_args[1], .mask = cmd_args[2] };
+	struct daemon_req invalidate = { .op = DAEMON_INVALIDATE };
+	const char *filename = NULL;
+	int i, rc;
+
+	for (i = 0; i < MAX_PROCESSORS; i++)
+		if (processorsel[i])
+			req.procs |= 1 << i;
+
+	switch (cmd) {
+	case GETSCOM:
+		req.op = DAEMON_GETSCOM;
+		break;
+	case PUTSCOM:
+		req.op = DAEMON_PUTSCOM;
+		break;
+	case GETCFAM:
+		req.op = DAEMON_GETCFAM;
+		break;
+	case PUTCFAM:
+		req.op = DAEMON_PUTCFAM;
+		break;
+	case GETMEM:
+		req.op = DAEMON_GETMEM;
+		filename = cmd_args_str[2];
+		if (mem_flags) {
+			PR_ERROR("--sparse and --compress can't be used with a daemon\n");
+			return 0;
+		}
+		break;
+	case PUTMEM:
+		req.op = DAEMON_PUTMEM;
+		break;
+	default:
+		PR_ERROR("Only getscom, putscom, getcfam, putcfam, getmem and putmem can be run through a daemon\n");
+		return 0;
+	}
+
+	/* Make the daemon look at the hardware afresh first */
+	if (reprobe && daemon_client(daemon_socket, &invalidate, NULL) < 0)
+		return 0;
+
+	rc = daemon_client(daemon_socket, &req, filename);
+	if (cmd == PUTMEM)
+		printf("Wrote %d bytes starting at 0x%016" PRIx64 "\n", rc > 0 ? rc : 0, cmd_args[0]);
+	else if (rc <= 0 && cmd != GETMEM)
+		printf("No valid targets found or specified. Try adding -p/-c/-t options to specify a target.\n");
+
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc = 0;
+	struct target *target;
+
+	if (parse_options(argc, argv))
+		return 1;
+
+	if (daemon_socket)
+		return run_daemon_command() > 0 ? 0 : 1;
+
+	if (load_targets())
+		return 1;
+
+	if (mem_priority >= 0) {
+		for_each_class_target("adu", target)
+			adu_set_priority(target, mem_priority);
+	}
+
+	if (mem_rate && adu_set_rate(mem_rate))
+		return 1;
+
+	if (cmd == SCRIPT) {
+		rc = run_script(cmd_args_str[0]) ? 0 : 1;
+	} else if (cmd == DAEMON) {
+		/* Nothing is deselected as clients choose for themselves */
+		rc = daemon_serve(cmd_args_str[0], daemon_listen_any) ? 0 : 1;
+	} else {
+		/* Disable unselected targets */
+		target_select();
+
+		rc = run_command();
+		if (rc <= 0) {
+			printf("No valid targets found or specified. Try adding -p/-c/-t options to specify a target.\n");
+			printf("Alternatively run %s -a probe to get a list of all valid targets\n", argv[0]);
+			rc = 1;
+		} else
+			rc = 0;
+	}
+
+	if (probe_cache)
+		probe_cache_save(probe_cache);
 
 	if (backend == FSI)
 		fsi_destroy(NULL);
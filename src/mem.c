@@ -0,0 +1,905 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <endian.h>
+
+#include <operations.h>
+#include <target.h>
+#include <device.h>
+#include <compress.h>
+#include <timing.h>
+
+#include "mem.h"
+#include "hash.h"
+
+/* Each chunk is compressed as a single block */
+#if MEM_CHUNK_SIZE > COMPRESS_BLOCK_SIZE
+#error "MEM_CHUNK_SIZE must fit in a compressed block"
+#endif
+
+struct mem_hole {
+	uint64_t addr;
+	uint64_t size;
+};
+
+struct mem_buf {
+	uint8_t *data;
+	uint64_t addr;
+	uint64_t size;
+	int rc;
+	bool full;
+
+	/* Virtual time it was last filled or emptied */
+	uint64_t vtime;
+
+	/* Unreadable parts of this buffer in address order */
+	struct mem_hole *holes;
+	int nr_holes;
+	int max_holes;
+};
+
+/* Reader threads fill the buffers from the ADUs while the calling
+ * thread drains them in order through the sink, so the bus is kept
+ * busy while the previous chunk is being written out. With more than
+ * one ADU the range is striped a chunk at a time across the readers
+ * and reassembled in order by the sink. */
+struct mem_pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct mem_buf *bufs;
+	int nr_bufs;
+	int nr_readers;
+	uint64_t addr;
+	uint64_t size;
+	bool stop;
+
+	/* If set, unreadable regions are recorded in a sorted list
+	 * shared between the readers instead of failing the stream */
+	bool sparse;
+	struct mem_hole *holes;
+	int nr_holes;
+	int max_holes;
+};
+
+struct mem_reader {
+	struct mem_pipe *pipe;
+	struct target *adu;
+	int index;
+	pthread_t thread;
+};
+
+static uint64_t mem_chunk_size(struct mem_pipe *pipe, uint64_t chunk)
+{
+	uint64_t offset = chunk * MEM_CHUNK_SIZE;
+
+	return pipe->size - offset < MEM_CHUNK_SIZE ? pipe->size - offset : MEM_CHUNK_SIZE;
+}
+
+static void mem_add_hole(struct mem_hole **holes, int *nr_holes, int *max_holes,
+			 int index, uint64_t addr, uint64_t size)
+{
+	if (*nr_holes == *max_holes) {
+		*max_holes = *max_holes ? *max_holes * 2 : 16;
+		*holes = realloc(*holes, *max_holes * sizeof(**holes));
+		assert(*holes);
+	}
+
+	memmove(&(*holes)[index + 1], &(*holes)[index], (*nr_holes - index) * sizeof(**holes));
+	(*holes)[index].addr = addr;
+	(*holes)[index].size = size;
+	(*nr_holes)++;
+}
+
+/* Look addr up in the holes found so far by any reader. Returns true
+ * and the end of the hole if addr is inside one. Otherwise returns
+ * false and the start of the next known hole or limit, whichever is
+ * lower. */
+static bool mem_hole_lookup(struct mem_pipe *pipe, uint64_t addr, uint64_t limit, uint64_t *end)
+{
+	struct mem_hole *hole;
+	int lo = 0, hi, mid;
+	bool found = false;
+
+	pthread_mutex_lock(&pipe->lock);
+
+	/* Find the first hole starting after addr */
+	hi = pipe->nr_holes;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (pipe->holes[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*end = limit;
+	if (lo > 0) {
+		hole = &pipe->holes[lo - 1];
+		if (addr - hole->addr < hole->size) {
+			*end = hole->addr + hole->size < limit ? hole->addr + hole->size : limit;
+			found = true;
+		}
+	}
+
+	if (!found && lo < pipe->nr_holes && pipe->holes[lo].addr < limit)
+		*end = pipe->holes[lo].addr;
+
+	pthread_mutex_unlock(&pipe->lock);
+
+	return found;
+}
+
+static void mem_record_hole(struct mem_pipe *pipe, uint64_t addr, uint64_t size)
+{
+	int i;
+
+	pthread_mutex_lock(&pipe->lock);
+	for (i = 0; i < pipe->nr_holes && pipe->holes[i].addr < addr; i++);
+	mem_add_hole(&pipe->holes, &pipe->nr_holes, &pipe->max_holes, i, addr, size);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+static bool mem_word_readable(struct target *adu, uint64_t addr)
+{
+	uint8_t word[8];
+
+	return !adu_probemem(adu, addr, word, sizeof(word));
+}
+
+/* Find the end of the hole containing the word at addr. We skip ahead
+ * in doubling strides (up to MEM_HOLE_MAX_STRIDE so a small readable
+ * region between two large holes isn't missed entirely) until a word
+ * can be read then binary search back for the boundary. */
+static uint64_t mem_hole_end(struct target *adu, uint64_t addr, uint64_t limit)
+{
+	uint64_t bad = addr & ~7ULL, good, stride = 8, mid;
+
+	for (;;) {
+		good = bad + stride;
+		if (good >= limit) {
+			/* Check the last word before giving up */
+			good = (limit - 1) & ~7ULL;
+			if (good <= bad || !mem_word_readable(adu, good))
+				return limit;
+			break;
+		}
+
+		if (mem_word_readable(adu, good))
+			break;
+
+		bad = good;
+		if (stride < MEM_HOLE_MAX_STRIDE)
+			stride *= 2;
+	}
+
+	while (good - bad > 8) {
+		mid = (bad + (good - bad) / 2) & ~7ULL;
+		if (mem_word_readable(adu, mid))
+			good = mid;
+		else
+			bad = mid;
+	}
+
+	return good;
+}
+
+/* Fill buf skipping over anything that can't be read. Unreadable
+ * regions are added to the buffer's hole list and, as they may extend
+ * well beyond this buffer, to the shared hole list so other readers
+ * can skip them without touching the bus. */
+static void mem_read_sparse(struct mem_reader *reader, struct mem_buf *buf)
+{
+	struct mem_pipe *pipe = reader->pipe;
+	uint64_t pos, end, next, good, bad, mid, hole_end;
+	uint8_t *data = buf->data - buf->addr;
+
+	buf->nr_holes = 0;
+	end = buf->addr + buf->size;
+	for (pos = buf->addr; pos < end; pos = next) {
+		if (mem_hole_lookup(pipe, pos, end, &next)) {
+			memset(data + pos, 0, next - pos);
+			mem_add_hole(&buf->holes, &buf->nr_holes, &buf->max_holes,
+				     buf->nr_holes, pos, next - pos);
+			continue;
+		}
+
+		if (!adu_probemem(reader->adu, pos, data + pos, next - pos))
+			continue;
+
+		/* Binary search for the first unreadable word. Everything
+		 * before good has been read and [good, bad) contains at
+		 * least one word that can't be. */
+		good = pos;
+		bad = next;
+		while (bad - good > 8) {
+			mid = (good + (bad - good) / 2) & ~7ULL;
+			if (mid <= good)
+				mid = (good & ~7ULL) + 8;
+			if (mid >= bad)
+				break;
+
+			if (adu_probemem(reader->adu, good, data + good, mid - good))
+				bad = mid;
+			else
+				good = mid;
+		}
+
+		hole_end = mem_hole_end(reader->adu, good, pipe->addr + pipe->size);
+		PR_INFO("Unable to read 0x%016" PRIx64 "-0x%016" PRIx64 ", skipping\n",
+			good, hole_end - 1);
+		mem_record_hole(pipe, good, hole_end - good);
+
+		/* The next iteration picks the hole up from the shared list */
+		next = good;
+	}
+}
+
+static void *mem_reader(void *arg)
+{
+	struct mem_reader *reader = arg;
+	struct mem_pipe *pipe = reader->pipe;
+	struct mem_buf *buf;
+	uint64_t chunk, nr_chunks;
+	bool stop;
+	int rc;
+
+	/* The number of buffers is a multiple of the number of readers
+	 * so each buffer only ever belongs to one reader */
+	nr_chunks = (pipe->size + MEM_CHUNK_SIZE - 1) / MEM_CHUNK_SIZE;
+	for (chunk = reader->index; chunk < nr_chunks; chunk += pipe->nr_readers) {
+		buf = &pipe->bufs[chunk % pipe->nr_bufs];
+
+		pthread_mutex_lock(&pipe->lock);
+		while (buf->full && !pipe->stop)
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		stop = pipe->stop;
+		pthread_mutex_unlock(&pipe->lock);
+		if (stop)
+			break;
+
+		/* Wait for the buffer to have been emptied */
+		timing_sync(buf->vtime);
+
+		buf->addr = pipe->addr + chunk * MEM_CHUNK_SIZE;
+		buf->size = mem_chunk_size(pipe, chunk);
+		if (pipe->sparse) {
+			mem_read_sparse(reader, buf);
+			rc = 0;
+		} else
+			rc = adu_getmem(reader->adu, buf->addr, buf->data, buf->size);
+
+		pthread_mutex_lock(&pipe->lock);
+		buf->rc = rc;
+		buf->vtime = timing_now();
+		buf->full = true;
+		pthread_cond_broadcast(&pipe->cond);
+		pthread_mutex_unlock(&pipe->lock);
+
+		if (rc)
+			break;
+	}
+
+	return NULL;
+}
+
+/* Pass the readable parts of buf to sink and the rest to hole */
+static int mem_drain(struct mem_buf *buf, mem_sink_t sink, mem_hole_t hole, void *priv)
+{
+	uint64_t pos = buf->addr, end = buf->addr + buf->size;
+	struct mem_hole *h;
+	int i, rc;
+
+	for (i = 0; i < buf->nr_holes; i++) {
+		h = &buf->holes[i];
+		if (h->addr > pos) {
+			rc = sink(priv, pos, buf->data + (pos - buf->addr), h->addr - pos);
+			if (rc)
+				return rc;
+		}
+
+		rc = hole(priv, h->addr, h->size);
+		if (rc)
+			return rc;
+		pos = h->addr + h->size;
+	}
+
+	if (pos < end)
+		return sink(priv, pos, buf->data + (pos - buf->addr), end - pos);
+
+	return 0;
+}
+
+/* Read size bytes from addr through the given ADUs, passing each
+ * chunk to the sink in order. If hole is given anything that can't be
+ * read is passed to it in order instead of failing the stream.
+ * Returns 0 on success, -1 if memory couldn't be read or the sink's
+ * return code if it stopped the stream. */
+int mem_stream(struct target **adus, int nr_adus, uint64_t addr, uint64_t size,
+	       mem_sink_t sink, mem_hole_t hole, void *priv)
+{
+	struct mem_pipe pipe;
+	struct mem_reader *readers;
+	struct mem_buf *buf;
+	uint64_t chunk, nr_chunks;
+	int i, nr_started, rc = 0;
+
+	assert(nr_adus > 0);
+	memset(&pipe, 0, sizeof(pipe));
+	pthread_mutex_init(&pipe.lock, NULL);
+	pthread_cond_init(&pipe.cond, NULL);
+	pipe.addr = addr;
+	pipe.size = size;
+	pipe.nr_readers = nr_adus;
+	pipe.nr_bufs = MEM_STREAM_BUFS * nr_adus;
+	pipe.sparse = hole != NULL;
+
+	pipe.bufs = calloc(pipe.nr_bufs, sizeof(*pipe.bufs));
+	readers = calloc(nr_adus, sizeof(*readers));
+	assert(pipe.bufs && readers);
+	for (i = 0; i < pipe.nr_bufs; i++) {
+		pipe.bufs[i].data = malloc(MEM_CHUNK_SIZE);
+		assert(pipe.bufs[i].data);
+		pipe.bufs[i].vtime = timing_now();
+	}
+
+	for (nr_started = 0; nr_started < nr_adus; nr_started++) {
+		readers[nr_started].pipe = &pipe;
+		readers[nr_started].adu = adus[nr_started];
+		readers[nr_started].index = nr_started;
+		if (pthread_create(&readers[nr_started].thread, NULL, mem_reader, &readers[nr_started])) {
+			PR_ERROR("Unable to start reader thread\n");
+			rc = -1;
+			break;
+		}
+	}
+
+	nr_chunks = (size + MEM_CHUNK_SIZE - 1) / MEM_CHUNK_SIZE;
+	for (chunk = 0; !rc && chunk < nr_chunks; chunk++) {
+		buf = &pipe.bufs[chunk % pipe.nr_bufs];
+
+		pthread_mutex_lock(&pipe.lock);
+		while (!buf->full)
+			pthread_cond_wait(&pipe.cond, &pipe.lock);
+		pthread_mutex_unlock(&pipe.lock);
+		timing_sync(buf->vtime);
+
+		if (buf->rc) {
+			PR_ERROR("Unable to read memory at 0x%016" PRIx64 "\n", buf->addr);
+			rc = -1;
+		} else if (buf->nr_holes)
+			rc = mem_drain(buf, sink, hole, priv);
+		else
+			rc = sink(priv, buf->addr, buf->data, buf->size);
+
+		pthread_mutex_lock(&pipe.lock);
+		buf->vtime = timing_now();
+		buf->full = false;
+		pthread_cond_broadcast(&pipe.cond);
+		pthread_mutex_unlock(&pipe.lock);
+	}
+
+	pthread_mutex_lock(&pipe.lock);
+	pipe.stop = true;
+	pthread_cond_broadcast(&pipe.cond);
+	pthread_mutex_unlock(&pipe.lock);
+
+	for (i = 0; i < nr_started; i++)
+		pthread_join(readers[i].thread, NULL);
+
+	for (i = 0; i < pipe.nr_bufs; i++) {
+		free(pipe.bufs[i].data);
+		free(pipe.bufs[i].holes);
+	}
+	free(pipe.bufs);
+	free(pipe.holes);
+	free(readers);
+	pthread_cond_destroy(&pipe.cond);
+	pthread_mutex_destroy(&pipe.lock);
+
+	return rc;
+}
+
+static int write_all(int fd, uint8_t *buf, uint64_t size)
+{
+	ssize_t rc;
+
+	while (size) {
+		rc = write(fd, buf, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		buf += rc;
+		size -= rc;
+	}
+
+	return 0;
+}
+
+/* The journal lets an interrupted getmem to a file pick up where it
+ * left off. It starts with a header identifying the dump followed by
+ * a record for each chunk as it is written, giving where the chunk
+ * ends in the output file and a hash of its bytes there. On restart
+ * the records are checked against the file and the dump carries on
+ * after the last chunk which matches. All fields are big-endian. */
+#define GETMEM_JOURNAL_MAGIC	"PDBGJNL1"
+
+struct getmem_journal_hdr {
+	char magic[8];
+	uint64_t addr;
+	uint64_t size;
+	uint32_t chunk_size;
+	uint32_t flags;
+};
+
+struct getmem_journal_rec {
+	uint64_t chunk;
+	uint64_t end;
+	uint64_t hash;
+};
+
+struct getmem_out {
+	int fd;
+	uint64_t start;
+	bool sparse;
+	bool compress;
+	uint8_t *zbuf;
+
+	/* Journal of completed chunks or -1 */
+	int journal;
+	uint64_t offset;
+
+	/* Region index for sparse dumps. The current region is only
+	 * written out once we know where it ends. */
+	FILE *map;
+	uint64_t region_addr;
+	uint64_t region_size;
+	bool region_hole;
+};
+
+static int getmem_flush_region(struct getmem_out *out)
+{
+	if (out->region_size &&
+	    fprintf(out->map, "0x%016" PRIx64 " 0x%016" PRIx64 " %s\n", out->region_addr,
+		    out->region_size, out->region_hole ? "hole" : "data") < 0) {
+		PR_ERROR("Unable to write region map: %m\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int getmem_region(struct getmem_out *out, uint64_t addr, uint64_t size, bool hole)
+{
+	if (out->region_size && out->region_hole == hole &&
+	    out->region_addr + out->region_size == addr) {
+		out->region_size += size;
+		return 0;
+	}
+
+	if (getmem_flush_region(out))
+		return -1;
+
+	out->region_addr = addr;
+	out->region_size = size;
+	out->region_hole = hole;
+
+	return 0;
+}
+
+static int getmem_sparse_sink(struct getmem_out *out, uint64_t addr, uint8_t *buf, uint64_t size)
+{
+	uint64_t done;
+	ssize_t rc;
+
+	for (done = 0; done < size; done += rc) {
+		rc = pwrite(out->fd, buf + done, size - done, addr + done - out->start);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				rc = 0;
+				continue;
+			}
+			PR_ERROR("Unable to write output: %m\n");
+			return -1;
+		}
+	}
+
+	return getmem_region(out, addr, size, false);
+}
+
+static int getmem_sink(void *priv, uint64_t addr, uint8_t *buf, uint64_t size)
+{
+	struct getmem_out *out = priv;
+	struct getmem_journal_rec rec;
+
+	if (out->sparse)
+		return getmem_sparse_sink(out, addr, buf, size);
+
+	if (out->compress) {
+		/* Compressing here rather than in the readers keeps it off
+		 * the bus. The readers carry on filling the other buffers
+		 * while we work on this one. */
+		size = compress_block(buf, size, out->zbuf);
+		buf = out->zbuf;
+	}
+
+	if (write_all(out->fd, buf, size)) {
+		PR_ERROR("Unable to write output: %m\n");
+		return -1;
+	}
+	out->offset += size;
+
+	if (out->journal < 0)
+		return 0;
+
+	rec.chunk = htobe64((addr - out->start) / MEM_CHUNK_SIZE);
+	rec.end = htobe64(out->offset);
+	rec.hash = htobe64(hash64(buf, size, 0));
+	if (write_all(out->journal, (uint8_t *) &rec, sizeof(rec))) {
+		PR_ERROR("Unable to write journal: %m\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int getmem_hole(void *priv, uint64_t addr, uint64_t size)
+{
+	/* Nothing is written so the file is left sparse */
+	return getmem_region(priv, addr, size, true);
+}
+
+/* Check the journal against the output file and position both after
+ * the last chunk which matches, or start them afresh if the journal is
+ * for a different dump. Returns the number of chunks already done. */
+static uint64_t getmem_resume(struct getmem_out *out, uint64_t addr, uint64_t size, int flags)
+{
+	struct getmem_journal_hdr hdr, want;
+	struct getmem_journal_rec rec;
+	uint64_t chunk = 0, end, offset = 0;
+	uint8_t *buf;
+	ssize_t len;
+
+	memset(&want, 0, sizeof(want));
+	memcpy(want.magic, GETMEM_JOURNAL_MAGIC, sizeof(want.magic));
+	want.addr = htobe64(addr);
+	want.size = htobe64(size);
+	want.chunk_size = htobe32(MEM_CHUNK_SIZE);
+	want.flags = htobe32(flags);
+
+	buf = malloc(COMPRESS_BOUND(MEM_CHUNK_SIZE));
+	assert(buf);
+
+	if (pread(out->journal, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(&hdr, &want, sizeof(hdr)))
+		goto done;
+
+	offset = out->compress ? COMPRESS_MAGIC_SIZE : 0;
+	while (pread(out->journal, &rec, sizeof(rec), sizeof(hdr) + chunk * sizeof(rec)) == sizeof(rec)) {
+		end = be64toh(rec.end);
+		if (be64toh(rec.chunk) != chunk || end < offset ||
+		    end - offset > COMPRESS_BOUND(MEM_CHUNK_SIZE))
+			break;
+
+		len = pread(out->fd, buf, end - offset, offset);
+		if (len != end - offset || hash64(buf, len, 0) != be64toh(rec.hash))
+			break;
+
+		offset = end;
+		chunk++;
+	}
+
+done:
+	free(buf);
+
+	if (!chunk)
+		offset = 0;
+
+	/* Drop anything after the last good chunk */
+	if (ftruncate(out->journal, chunk ? sizeof(hdr) + chunk * sizeof(rec) : 0) ||
+	    ftruncate(out->fd, offset) ||
+	    lseek(out->journal, 0, SEEK_END) < 0 ||
+	    lseek(out->fd, offset, SEEK_SET) < 0)
+		return 0;
+
+	if (!chunk && write_all(out->journal, (uint8_t *) &want, sizeof(want)))
+		return 0;
+
+	out->offset = offset;
+
+	return chunk;
+}
+
+/* Collect up to max ADUs to access [addr, addr + size) through. ADUs
+ * on the chip owning the range come first as they can use a narrower
+ * bus scope. Any ADU can reach all of memory so if none of the
+ * selected processors have one we just use the first one present. */
+int mem_adus(struct target **adus, int max, uint64_t addr, uint64_t size)
+{
+	struct target *target;
+	int count = 0;
+
+	for_each_class_target("adu", target) {
+		if (count < max && target_selected(target) && adu_owns(target, addr, size))
+			adus[count++] = target;
+	}
+
+	for_each_class_target("adu", target) {
+		if (count < max && target_selected(target) && !adu_owns(target, addr, size))
+			adus[count++] = target;
+	}
+
+	if (!count) {
+		for_each_class_target("adu", target) {
+			if (target_ensure_probed(target) == TARGET_PRESENT) {
+				adus[count++] = target;
+				break;
+			}
+		}
+	}
+
+	return count;
+}
+
+/* Pick the best single ADU for accessing [addr, addr + size) or NULL
+ * if there aren't any */
+struct target *mem_adu(uint64_t addr, uint64_t size)
+{
+	struct target *adu;
+
+	return mem_adus(&adu, 1, addr, size) ? adu : NULL;
+}
+
+/* Stream memory to the given file, or stdout if filename is NULL,
+ * reading through up to jobs ADUs in parallel. Unless the dump is
+ * sparse a journal is kept next to the file so running the same
+ * command again after a failure carries on where it left off. Returns
+ * 1 on success or 0 on failure. */
+int getmem(uint64_t addr, uint64_t size, const char *filename, int jobs, int flags)
+{
+	struct getmem_out out;
+	struct target **adus;
+	char *map_file, *journal_file = NULL;
+	uint64_t done = 0;
+	int nr_adus, rc = -1;
+
+	memset(&out, 0, sizeof(out));
+	out.fd = STDOUT_FILENO;
+	out.journal = -1;
+	out.start = addr;
+	out.sparse = flags & GETMEM_SPARSE;
+	out.compress = flags & GETMEM_COMPRESS;
+
+	if (out.sparse && !filename) {
+		PR_ERROR("A sparse dump needs an output file\n");
+		return 0;
+	}
+
+	if (out.sparse && out.compress) {
+		PR_ERROR("Sparse dumps can't be compressed\n");
+		return 0;
+	}
+
+	if (jobs < 1)
+		jobs = 1;
+
+	adus = calloc(jobs, sizeof(*adus));
+	out.zbuf = malloc(COMPRESS_BOUND(MEM_CHUNK_SIZE));
+	assert(adus && out.zbuf);
+	nr_adus = mem_adus(adus, jobs, addr, size);
+	if (!nr_adus)
+		goto out_free;
+
+	if (filename && !out.sparse) {
+		if (asprintf(&journal_file, "%s.journal", filename) < 0) {
+			journal_file = NULL;
+			goto out_free;
+		}
+
+		out.journal = open(journal_file, O_RDWR | O_CREAT, 0644);
+		if (out.journal < 0) {
+			PR_ERROR("Unable to open %s: %m\n", journal_file);
+			goto out_free;
+		}
+	}
+
+	if (filename) {
+		/* The existing contents are checked against the journal */
+		out.fd = open(filename, (out.journal < 0 ? O_WRONLY | O_TRUNC : O_RDWR) | O_CREAT, 0644);
+		if (out.fd < 0) {
+			PR_ERROR("Unable to open %s: %m\n", filename);
+			goto out_close;
+		}
+	}
+
+	if (out.journal >= 0) {
+		done = getmem_resume(&out, addr, size, flags) * MEM_CHUNK_SIZE;
+		if (done > size)
+			done = size;
+		if (done)
+			PR_INFO("Resuming at 0x%016" PRIx64 " with 0x%" PRIx64 " bytes already read\n",
+				addr + done, done);
+	}
+
+	if (!done && out.compress && compress_start(out.fd)) {
+		PR_ERROR("Unable to write output: %m\n");
+		goto out_close;
+	}
+	out.offset = done ? out.offset : (out.compress ? COMPRESS_MAGIC_SIZE : 0);
+
+	if (out.sparse) {
+		if (asprintf(&map_file, "%s.map", filename) < 0)
+			goto out_close;
+
+		out.map = fopen(map_file, "w");
+		if (!out.map) {
+			PR_ERROR("Unable to open %s: %m\n", map_file);
+			free(map_file);
+			goto out_close;
+		}
+		free(map_file);
+	}
+
+	rc = mem_stream(adus, nr_adus, addr + done, size - done, getmem_sink,
+			out.sparse ? getmem_hole : NULL, &out);
+
+	if (out.sparse) {
+		/* Flush the last region and make sure a trailing hole
+		 * still counts towards the file size */
+		if (!rc)
+			rc = getmem_flush_region(&out);
+		if (!rc && ftruncate(out.fd, size)) {
+			PR_ERROR("Unable to set size of %s: %m\n", filename);
+			rc = -1;
+		}
+		if (fclose(out.map) && !rc) {
+			PR_ERROR("Unable to write region map: %m\n");
+			rc = -1;
+		}
+	}
+
+out_close:
+	if (filename && out.fd >= 0 && close(out.fd) && !rc) {
+		PR_ERROR("Unable to write %s: %m\n", filename);
+		rc = -1;
+	}
+
+	if (out.journal >= 0) {
+		close(out.journal);
+
+		/* The journal is only needed to resume a failed dump */
+		if (!rc)
+			unlink(journal_file);
+	}
+out_free:
+	free(journal_file);
+	free(out.zbuf);
+	free(adus);
+
+	return rc ? 0 : 1;
+}
+
+/* Fill [addr, addr + size) with repeats of a pattern as understood by
+ * memsearch. Returns 1 on success or 0 on failure. */
+int memfill(uint64_t addr, uint64_t size, const char *pattern)
+{
+	struct target *adu;
+	uint8_t *bytes;
+	size_t len;
+	char *str;
+	int rc = 0;
+
+	str = strdup(pattern);
+	assert(str);
+	if (mem_parse_pattern(str, &bytes, &len)) {
+		PR_ERROR("Invalid pattern %s\n", pattern);
+		free(str);
+		return 0;
+	}
+
+	adu = mem_adu(addr, size);
+	if (!adu)
+		PR_ERROR("No ADU found\n");
+	else if (adu_fill(adu, addr, bytes, len, size))
+		PR_ERROR("Unable to fill memory\n");
+	else
+		rc = 1;
+
+	if (bytes != (uint8_t *) str)
+		free(bytes);
+	free(str);
+
+	return rc;
+}
+
+struct memcopy {
+	struct target *adu;
+	int64_t offset;
+};
+
+static int memcopy_sink(void *priv, uint64_t addr, uint8_t *buf, uint64_t size)
+{
+	struct memcopy *copy = priv;
+
+	if (adu_putmem(copy->adu, addr + copy->offset, buf, size)) {
+		PR_ERROR("Unable to write memory at 0x%016" PRIx64 "\n", addr + copy->offset);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Copy [src, src + size) to dst. Writes happen from the stream's sink
+ * so the readers carry on fetching the following chunks while each one
+ * is written out. When the ranges don't overlap the reads and writes
+ * touch different memory and can go through different ADUs
+ * independently. When they do, everything goes through the
+ * destination ADU so its lock serialises the accesses, and as chunks
+ * are written in order after they have been read a write only lands on
+ * source chunks which are already done. Returns 1 on success or 0 on
+ * failure. */
+int memcopy(uint64_t src, uint64_t dst, uint64_t size, int jobs)
+{
+	struct memcopy copy;
+	struct target **adus;
+	int nr_adus, rc = -1;
+
+	/* Chunks are written strictly after they are read so copying
+	 * down over the source is fine but copying up isn't */
+	if (dst > src && dst - src < size) {
+		PR_ERROR("Destination overlaps the end of the source\n");
+		return 0;
+	}
+
+	copy.offset = dst - src;
+	copy.adu = mem_adu(dst, size);
+	if (!copy.adu) {
+		PR_ERROR("No ADU found\n");
+		return 0;
+	}
+
+	if (jobs < 1)
+		jobs = 1;
+
+	adus = calloc(jobs, sizeof(*adus));
+	assert(adus);
+
+	if (dst < src + size && src < dst + size) {
+		adus[0] = copy.adu;
+		nr_adus = 1;
+	} else
+		nr_adus = mem_adus(adus, jobs, src, size);
+
+	if (nr_adus)
+		rc = mem_stream(adus, nr_adus, src, size, memcopy_sink, NULL, &copy);
+
+	free(adus);
+
+	return rc ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __MEM_H
+#define __MEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <target.h>
+
+/* Size of each buffer in the getmem pipeline and how many of them
+ * there are per reader. Memory use is bounded by the product of the
+ * two and the number of readers no matter how large a range is being
+ * read. */
+#define MEM_CHUNK_SIZE		(64 * 1024)
+#define MEM_STREAM_BUFS		3
+
+/* Largest step taken when skipping over an unreadable region */
+#define MEM_HOLE_MAX_STRIDE	(16 * 1024 * 1024)
+
+/* Called in address order for each chunk read from memory. Returning
+ * non-zero stops the stream. */
+typedef int (*mem_sink_t)(void *priv, uint64_t addr, uint8_t *buf, uint64_t size);
+
+/* Called in order with the sink for regions which couldn't be read */
+typedef int (*mem_hole_t)(void *priv, uint64_t addr, uint64_t size);
+
+int mem_stream(struct target **adus, int nr_adus, uint64_t addr, uint64_t size,
+	       mem_sink_t sink, mem_hole_t hole, void *priv);
+
+int mem_adus(struct target **adus, int max, uint64_t addr, uint64_t size);
+struct target *mem_adu(uint64_t addr, uint64_t size);
+
+/* Skip unreadable memory leaving holes in the output file and write a
+ * <file>.map listing the data and hole regions */
+#define GETMEM_SPARSE		0x1
+
+/* Write the output in the format understood by pdbg-decompress */
+#define GETMEM_COMPRESS		0x2
+
+int getmem(uint64_t addr, uint64_t size, const char *filename, int jobs, int flags);
+int memsearch(uint64_t addr, uint64_t size, const char *patterns, uint64_t max, int jobs);
+int mem_parse_pattern(char *str, uint8_t **bytes, size_t *len);
+int memfill(uint64_t addr, uint64_t size, const char *pattern);
+int memcopy(uint64_t src, uint64_t dst, uint64_t size, int jobs);
+
+/* Default size of the blocks hashed or compared by memhash/memverify */
+#define MEM_HASH_BLOCK_SIZE	4096
+
+int memhash(uint64_t addr, uint64_t size, uint64_t block_size, int jobs);
+int memverify(uint64_t addr, uint64_t size, const char *filename, uint64_t block_size, int jobs);
+
+#endif
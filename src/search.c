@@ -0,0 +1,242 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <endian.h>
+
+#include <operations.h>
+#include <target.h>
+
+#include "mem.h"
+
+#define MAX_PATTERNS	16
+
+struct pattern {
+	const char *str;
+	uint8_t *bytes;
+	size_t len;
+};
+
+/* Patterns are grouped by their first byte so each word of memory only
+ * needs checking once per distinct first byte however many patterns
+ * there are. A match found near the end of one chunk may continue in
+ * the next so the window keeps the last longest - 1 bytes of the
+ * previous chunk in front of the new one. */
+struct search {
+	struct pattern patterns[MAX_PATTERNS];
+	int nr_patterns;
+	uint8_t first[MAX_PATTERNS];
+	int nr_first;
+	size_t longest;
+
+	uint8_t *window;
+	size_t tail;
+	uint64_t window_addr;
+
+	uint64_t matches;
+	uint64_t max;
+};
+
+#define ONES	0x0101010101010101ULL
+#define HIGHS	0x8080808080808080ULL
+
+/* Sets the top bit of each byte in w equal to the byte repeated in rep.
+ * Bytes above a match may also be flagged which is fine as every
+ * candidate is checked in full. */
+static inline uint64_t swar_match(uint64_t w, uint64_t rep)
+{
+	uint64_t x = w ^ rep;
+
+	return (x - ONES) & ~x & HIGHS;
+}
+
+/* Report matches starting at pos which end after the tail, anything
+ * else was already reported with the previous chunk. Returns 1 once
+ * the maximum number of matches has been reported. */
+static int search_at(struct search *search, size_t pos, size_t len)
+{
+	struct pattern *p;
+	int i;
+
+	for (i = 0; i < search->nr_patterns; i++) {
+		p = &search->patterns[i];
+		if (search->window[pos] != p->bytes[0] || pos + p->len > len ||
+		    pos + p->len <= search->tail || memcmp(&search->window[pos], p->bytes, p->len))
+			continue;
+
+		printf("0x%016" PRIx64 " %s\n", search->window_addr + pos, p->str);
+		if (++search->matches == search->max)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int search_sink(void *priv, uint64_t addr, uint8_t *buf, uint64_t size)
+{
+	struct search *search = priv;
+	uint64_t w, mask, reps[MAX_PATTERNS];
+	size_t pos, len;
+	int i;
+
+	memcpy(search->window + search->tail, buf, size);
+	len = search->tail + size;
+	search->window_addr = addr - search->tail;
+
+	for (i = 0; i < search->nr_first; i++)
+		reps[i] = ONES * search->first[i];
+
+	for (pos = 0; pos + 8 <= len; pos += 8) {
+		memcpy(&w, &search->window[pos], sizeof(w));
+		w = le64toh(w);
+
+		mask = 0;
+		for (i = 0; i < search->nr_first; i++)
+			mask |= swar_match(w, reps[i]);
+
+		for (; mask; mask &= mask - 1)
+			if (search_at(search, pos + __builtin_ctzll(mask) / 8, len))
+				return 1;
+	}
+
+	for (; pos < len; pos++)
+		if (search_at(search, pos, len))
+			return 1;
+
+	/* Keep enough of the end for a match to straddle the next chunk */
+	search->tail = len < search->longest - 1 ? len : search->longest - 1;
+	memmove(search->window, search->window + len - search->tail, search->tail);
+
+	return 0;
+}
+
+static int hex_digit(char c)
+{
+	return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+/* Patterns starting 0x are hex bytes in memory order, anything else is
+ * taken as text. For text *bytes points into str, otherwise it must be
+ * freed by the caller. */
+int mem_parse_pattern(char *str, uint8_t **bytes, size_t *len)
+{
+	size_t i;
+
+	if (strncmp(str, "0x", 2)) {
+		*len = strlen(str);
+		*bytes = (uint8_t *) str;
+		return *len ? 0 : -1;
+	}
+
+	str += 2;
+	*len = strlen(str) / 2;
+	if (!*len || strlen(str) % 2)
+		return -1;
+
+	for (i = 0; i < 2 * *len; i++)
+		if (!isxdigit(str[i]))
+			return -1;
+
+	*bytes = malloc(*len);
+	assert(*bytes);
+	for (i = 0; i < *len; i++)
+		(*bytes)[i] = hex_digit(str[2*i]) << 4 | hex_digit(str[2*i + 1]);
+
+	return 0;
+}
+
+static int parse_pattern(struct pattern *p, char *str)
+{
+	p->str = str;
+	return mem_parse_pattern(str, &p->bytes, &p->len);
+}
+
+/* Search [addr, addr + size) for a comma separated list of patterns
+ * printing the address of each match, stopping after max matches if
+ * max isn't zero. Returns 1 on success or 0 on failure. */
+int memsearch(uint64_t addr, uint64_t size, const char *patterns, uint64_t max, int jobs)
+{
+	struct search search;
+	struct target **adus;
+	char *list, *str, *saveptr;
+	int i, j, nr_adus, rc = -1;
+
+	memset(&search, 0, sizeof(search));
+	search.max = max;
+
+	list = strdup(patterns);
+	assert(list);
+	for (str = strtok_r(list, ",", &saveptr); str; str = strtok_r(NULL, ",", &saveptr)) {
+		if (search.nr_patterns == MAX_PATTERNS) {
+			PR_ERROR("Too many patterns, at most %d can be given\n", MAX_PATTERNS);
+			goto out;
+		}
+
+		if (parse_pattern(&search.patterns[search.nr_patterns], str)) {
+			PR_ERROR("Invalid pattern %s\n", str);
+			goto out;
+		}
+
+		if (search.patterns[search.nr_patterns++].len > MEM_CHUNK_SIZE) {
+			PR_ERROR("Pattern %s is too long\n", str);
+			goto out;
+		}
+	}
+
+	if (!search.nr_patterns) {
+		PR_ERROR("No patterns given\n");
+		goto out;
+	}
+
+	for (i = 0; i < search.nr_patterns; i++) {
+		for (j = 0; j < search.nr_first; j++)
+			if (search.first[j] == search.patterns[i].bytes[0])
+				break;
+		if (j == search.nr_first)
+			search.first[search.nr_first++] = search.patterns[i].bytes[0];
+
+		if (search.patterns[i].len > search.longest)
+			search.longest = search.patterns[i].len;
+	}
+
+	search.window = malloc(search.longest - 1 + MEM_CHUNK_SIZE);
+	adus = calloc(jobs > 1 ? jobs : 1, sizeof(*adus));
+	assert(search.window && adus);
+
+	nr_adus = mem_adus(adus, jobs > 1 ? jobs : 1, addr, size);
+	if (nr_adus)
+		rc = mem_stream(adus, nr_adus, addr, size, search_sink, NULL, &search);
+
+	/* Stopping early once we have enough matches isn't a failure */
+	if (rc > 0)
+		rc = 0;
+
+	free(adus);
+	free(search.window);
+out:
+	for (i = 0; i < search.nr_patterns; i++)
+		if (search.patterns[i].bytes != (uint8_t *) search.patterns[i].str)
+			free(search.patterns[i].bytes);
+	free(list);
+
+	return rc ? 0 : 1;
+}
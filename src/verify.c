@@ -0,0 +1,206 @@
+/* Copyright 2017 IBM Corp.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include <operations.h>
+#include <target.h>
+
+#include "mem.h"
+#include "hash.h"
+
+#define MANIFEST_HEADER "# pdbg memhash"
+
+/* Blocks are hashed in the sink as each chunk arrives so the hashing
+ * overlaps the reads of the following chunks. Block sizes divide the
+ * chunk size so blocks never straddle two chunks. */
+struct verify {
+	uint64_t start;
+	uint64_t block_size;
+
+	/* Golden image to compare against, or a manifest of hashes as
+	 * printed by memhash. With neither the hashes are printed. */
+	int golden_fd;
+	uint8_t *golden;
+	FILE *manifest;
+
+	uint64_t blocks;
+	uint64_t mismatches;
+};
+
+static int verify_block(struct verify *verify, uint64_t addr, uint8_t *buf, uint64_t size)
+{
+	uint64_t hash = hash64(buf, size, 0), want, want_addr;
+	char line[128];
+	ssize_t len;
+
+	verify->blocks++;
+	if (verify->manifest) {
+		if (!fgets(line, sizeof(line), verify->manifest) ||
+		    sscanf(line, "%" SCNx64 " %" SCNx64, &want_addr, &want) != 2 ||
+		    want_addr != addr) {
+			PR_ERROR("Manifest doesn't have a hash for 0x%016" PRIx64 "\n", addr);
+			return -1;
+		}
+
+		if (hash != want) {
+			printf("0x%016" PRIx64 " 0x%" PRIx64 " differs (hash %016" PRIx64 " expected %016" PRIx64 ")\n",
+			       addr, size, hash, want);
+			verify->mismatches++;
+		}
+	} else if (verify->golden) {
+		len = pread(verify->golden_fd, verify->golden, size, addr - verify->start);
+		if (len != size || memcmp(buf, verify->golden, size)) {
+			printf("0x%016" PRIx64 " 0x%" PRIx64 " differs\n", addr, size);
+			verify->mismatches++;
+		}
+	} else
+		printf("0x%016" PRIx64 " %016" PRIx64 "\n", addr, hash);
+
+	return 0;
+}
+
+static int verify_sink(void *priv, uint64_t addr, uint8_t *buf, uint64_t size)
+{
+	struct verify *verify = priv;
+	uint64_t len;
+
+	for (; size; addr += len, buf += len, size -= len) {
+		len = size < verify->block_size ? size : verify->block_size;
+		if (verify_block(verify, addr, buf, len))
+			return -1;
+	}
+
+	return 0;
+}
+
+static bool valid_block_size(uint64_t block_size)
+{
+	return block_size && block_size <= MEM_CHUNK_SIZE &&
+		!(block_size & (block_size - 1));
+}
+
+static int verify_stream(struct verify *verify, uint64_t addr, uint64_t size, int jobs)
+{
+	struct target **adus;
+	int nr_adus, rc = -1;
+
+	if (jobs < 1)
+		jobs = 1;
+
+	adus = calloc(jobs, sizeof(*adus));
+	assert(adus);
+
+	nr_adus = mem_adus(adus, jobs, addr, size);
+	if (nr_adus)
+		rc = mem_stream(adus, nr_adus, addr, size, verify_sink, NULL, verify);
+
+	free(adus);
+
+	return rc;
+}
+
+/* Print a hash of each block_size block of [addr, addr + size) in the
+ * manifest format memverify reads. Returns 1 on success or 0 on
+ * failure. */
+int memhash(uint64_t addr, uint64_t size, uint64_t block_size, int jobs)
+{
+	struct verify verify;
+
+	if (!valid_block_size(block_size)) {
+		PR_ERROR("Block size must be a power of two no larger than 0x%x\n", MEM_CHUNK_SIZE);
+		return 0;
+	}
+
+	memset(&verify, 0, sizeof(verify));
+	verify.start = addr;
+	verify.block_size = block_size;
+
+	printf(MANIFEST_HEADER " 0x%016" PRIx64 " 0x%" PRIx64 " 0x%" PRIx64 "\n",
+	       addr, size, block_size);
+
+	return verify_stream(&verify, addr, size, jobs) ? 0 : 1;
+}
+
+/* Compare [addr, addr + size) against either a golden image of the
+ * range or a manifest from memhash, printing only the blocks which
+ * differ. Returns 1 if the comparison could be done or 0 if not. */
+int memverify(uint64_t addr, uint64_t size, const char *filename, uint64_t block_size, int jobs)
+{
+	struct verify verify;
+	uint64_t m_addr, m_size, m_block_size;
+	char line[128];
+	int rc = -1;
+
+	memset(&verify, 0, sizeof(verify));
+	verify.start = addr;
+	verify.block_size = block_size;
+
+	verify.golden_fd = open(filename, O_RDONLY);
+	if (verify.golden_fd < 0) {
+		PR_ERROR("Unable to open %s: %m\n", filename);
+		return 0;
+	}
+
+	if (pread(verify.golden_fd, line, strlen(MANIFEST_HEADER), 0) == strlen(MANIFEST_HEADER) &&
+	    !memcmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER))) {
+		verify.manifest = fdopen(verify.golden_fd, "r");
+		assert(verify.manifest);
+
+		/* The manifest has to be for exactly this range as the
+		 * hash of a partial block depends on where the range ends */
+		if (!fgets(line, sizeof(line), verify.manifest) ||
+		    sscanf(line, MANIFEST_HEADER " %" SCNx64 " %" SCNx64 " %" SCNx64,
+			   &m_addr, &m_size, &m_block_size) != 3 ||
+		    !valid_block_size(m_block_size)) {
+			PR_ERROR("Invalid manifest %s\n", filename);
+			goto out;
+		}
+
+		if (m_addr != addr || m_size != size) {
+			PR_ERROR("Manifest is for 0x%016" PRIx64 "-0x%016" PRIx64 "\n",
+				 m_addr, m_addr + m_size - 1);
+			goto out;
+		}
+		verify.block_size = m_block_size;
+	} else if (!valid_block_size(block_size)) {
+		PR_ERROR("Block size must be a power of two no larger than 0x%x\n", MEM_CHUNK_SIZE);
+		goto out;
+	} else {
+		verify.golden = malloc(block_size);
+		assert(verify.golden);
+	}
+
+	rc = verify_stream(&verify, addr, size, jobs);
+	if (!rc)
+		printf("%" PRIu64 " of %" PRIu64 " blocks differ\n", verify.mismatches, verify.blocks);
+
+out:
+	free(verify.golden);
+	if (verify.manifest)
+		fclose(verify.manifest);
+	else
+		close(verify.golden_fd);
+
+	return rc ? 0 : 1;
+}